@@ -7,8 +7,33 @@ static const char APP_VER_STR[5 + 1] = "1.8.4";
 
 static unsigned char g_verbose = 0; //0
 static double g_alloc_size_mb = 0.0; //0.0
+static uint32 g_alloc_num = 0; //0
+static void* g_alloc_num_list = (void*) 0; //chained chunks of -alloc_num
 #define NUM_MEM_PTRS 10 //10
 static void* g_mem_ptr[NUM_MEM_PTRS];
+#if !defined(_WIN32) && !defined(_WIN64)
+    static heap_sink_t g_out_sink; //sink of -out <FILE> (kind 0 = stdout)
+#endif
+
+//Close the file of -out <FILE> behind the dump, 1 if it wasn't written:
+int close_out_file(const char* out_path,int ret)
+{
+    #if !defined(_WIN32) && !defined(_WIN64)
+        if(!g_out_sink.kind)
+            return ret;
+        int fd = g_out_sink.fd;
+        close_heap_sink(&g_out_sink); //writes the buffered rest
+        bool failed = g_out_sink.failed;
+        if(close(fd))
+            failed = true;
+        if(failed)
+        {
+            printf("ERROR - can't write %s\n",out_path);
+            return 1;
+        }
+    #endif
+    return ret;
+}
 
 void usage()
 {
@@ -19,13 +44,43 @@ void usage()
       "   %s [-v] [-alloc_mb <size/MB>]\n"
       "\n"
       "DUMP THE HEAP FOOTPRINT:\n"
-      "   %s [-v] [-alloc_mb <size/MB>] -footprint\n"
+      "   %s [-v] [-alloc_mb <size/MB>] -footprint [-threads <N>]\n"
+      "        [-lanes <N>] [-fork] [-async] [-compact] [-sizes] [-locked]\n"
       "\n"
       "DEBUG DUMP OF THE HEAP:\n"
-      "   %s [-v] [-alloc_mb <size/MB>] -debug\n"
+      "   %s [-v] [-alloc_mb <size/MB>] -debug [-fork]\n"
       "\n"
       "HEX DUMP OR RAW DATA OUTPUT OF THE HEAP:\n"
       "   %s [-v] [-alloc_mb <size/MB>] [-hex|-raw] [-max_kb <size/KB>]\n"
+      "        [-threads <N>] [-resident] [-fork] [-out <FILE>]\n"
+      "   %s [-v] [-alloc_mb <size/MB>] -image <FILE> [-max_kb <size/KB>]\n"
+      "        [-resident]\n"
+      "\n"
+      "LARGEST USED AND FREE CHUNKS PER ARENA:\n"
+      "   %s [-v] [-alloc_mb <size/MB>] -top <N> [-out <FILE>] [-locked]\n"
+      "\n"
+      "EXPORT THE CHUNKS AND ARENAS (JSON LINES OR CSV):\n"
+      "   %s [-v] [-alloc_mb <size/MB>] -format jsonl|csv [-out <FILE>]\n"
+      "        [-sizes] [-locked]\n"
+      "\n"
+      "DUMP THE HEAP OF ANOTHER PROCESS:\n"
+      "   %s [-v] -pid <PID> [-footprint|-debug|-hex|-raw|-format <F>|\n"
+      "        -top <N>] [-max_kb <size/KB>] [-async] [-compact] [-sizes]\n"
+      "\n"
+      "DUMP THE HEAP OUT OF A CORE FILE:\n"
+      "   %s [-v] -core <FILE> [-footprint|-debug|-hex|-raw|-format <F>|\n"
+      "        -top <N>] [-max_kb <size/KB>] [-async] [-compact] [-sizes]\n"
+      "\n"
+      "HEAP SNAPSHOT FILE (WRITE AND READ):\n"
+      "   %s [-v] [-alloc_mb <size/MB>] -snapshot <FILE> [-payload]\n"
+      "   %s [-v] -pid <PID>|-core <FILE> -snapshot <FILE> [-payload]\n"
+      "   %s [-v] -snapshot_info <FILE>\n"
+      "   %s [-v] -diff <OLD FILE> <NEW FILE>\n"
+      "\n"
+      "HEAP WALK BENCHMARK:\n"
+      "   %s [-v] [-alloc_mb <size/MB>] [-alloc_num <count>] -bench\n"
+      "        [-lanes <N>]\n"
+      "   %s [-v] [-alloc_mb <size/MB>] [-alloc_num <count>] -bench_hex\n"
       "\n"
       "Parameters:\n"
       "\n"
@@ -33,8 +88,63 @@ void usage()
       "   -v                   Verbose output\n"
       "   -alloc_mb <size/MB>  Allocate <size> MB using malloc()\n"
       "                        REMARK: <size> as integer *or* floating point\n"
+      "   -alloc_num <count>   Allocate <count> small chunks using malloc()\n"
+      "                        REMARK: every 3rd chunk is freed again\n"
       "   -max_kb <size/KB>    Limit the output to <size> KB\n"
       "                        REMARK: <size> as integer\n"
+      "   -threads <N>         Walk the heap segments with <N> threads and\n"
+      "                        dump the footprint per arena (not per chunk)\n"
+      "                        REMARK: -hex is formatted by <N> threads\n"
+      "   -lanes <N>           Interleave <N> cursors per walker thread\n"
+      "                        REMARK: hides the memory latency of the walk\n"
+      "   -raw                 Write the bytes of the main heap and of the\n"
+      "                        heap segments of all arenas\n"
+      "                        REMARK: -fork hands the pages to a pipe by\n"
+      "                        vmsplice() (no copy), else write() is used\n"
+      "   -image <FILE>        Write all heap segments into a sparse file\n"
+      "                        REMARK: zero pages are holes, see <FILE>.idx\n"
+      "   -resident            Don't read the heap pages not in RAM\n"
+      "                        REMARK: keeps the RSS, uses mincore()\n"
+      "   -format jsonl|csv    Export a record per chunk, heap segment and\n"
+      "                        arena as JSON Lines or CSV\n"
+      "   -top <N>             Rank the <N> largest used and free chunks of\n"
+      "                        every arena (top chunks aren't ranked)\n"
+      "                        REMARK: <N> up to 1024\n"
+      "   -out <FILE>          Write the dump into <FILE> instead of stdout\n"
+      "                        REMARK: with any mode but the interactive one\n"
+      "   -bench_hex           Compare the HEX dump with a printf() per line\n"
+      "   -fork                Walk a copy-on-write snapshot in a child\n"
+      "                        REMARK: the process is paused just for fork()\n"
+      "   -async               Walk, format and write the footprint by a\n"
+      "                        pipeline of 3 threads\n"
+      "                        REMARK: not with -threads or -lanes\n"
+      "   -compact             Print a line per run of chunks of the same\n"
+      "                        size and state (\"x12034 48 bytes USED\")\n"
+      "                        REMARK: not with -threads or -lanes\n"
+      "   -sizes               Print p50, p99 and max of the used and free\n"
+      "                        chunk sizes per arena (after the totals)\n"
+      "                        REMARK: -format adds them to the arenas\n"
+      "   -locked              Lock an arena while walking one of its heap\n"
+      "                        segments (or 1024 chunks of the main heap)\n"
+      "                        and print the pauses per arena\n"
+      "                        (the lines of a segment are kept in memory\n"
+      "                        and written after the unlock)\n"
+      "                        REMARK: not with -threads, -lanes or -fork\n"
+      "                        REMARK: -async waits under the lock, when\n"
+      "                        the output stalls the pipeline\n"
+      "   -pid <PID>           Read the heap of the process <PID>\n"
+      "                        REMARK: process must use the same glibc\n"
+      "                        REMARK: -hex and -raw dump the main heap and\n"
+      "                        the heap segments of all arenas\n"
+      "   -core <FILE>         Read the heap out of the ELF core file <FILE>\n"
+      "                        REMARK: process must use the same glibc\n"
+      "                        REMARK: -hex and -raw dump the main heap and\n"
+      "                        the heap segments of all arenas\n"
+      "   -snapshot <FILE>     Write the chunks into a binary snapshot file\n"
+      "                        REMARK: -payload adds the heap bytes\n"
+      "   -snapshot_info <FILE> Read a snapshot file and print its arenas\n"
+      "   -diff <OLD> <NEW>    Compare two snapshot files chunk by chunk\n"
+      "                        REMARK: ranked by the growth of used bytes\n"
       "\n"
       "--- VERSION:\n"
       "%s %s\n"
@@ -45,6 +155,17 @@ void usage()
       APP_NAME,
       APP_NAME,
       APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
+      APP_NAME,
       APP_VER_STR,
       APP_COPYRIGHT);
 }
@@ -91,13 +212,51 @@ int main(int argc,char* argv[])
     static const unsigned char MODE_DEBUGDUMP   = 2;
     static const unsigned char MODE_HEXDUMP     = 3;
     static const unsigned char MODE_RAW         = 4;
+    static const unsigned char MODE_BENCH       = 5;
+    static const unsigned char MODE_SNAPSHOT    = 6;
+    static const unsigned char MODE_SNAPSHOT_INFO = 7;
+    static const unsigned char MODE_DIFF        = 8;
+    static const unsigned char MODE_BENCH_HEX   = 9;
+    static const unsigned char MODE_IMAGE       = 10;
+    static const unsigned char MODE_EXPORT      = 11;
+    static const unsigned char MODE_TOP         = 12;
     unsigned char mode = MODE_INTERACTIVE;
 
     uint32 max_kb = 0;
+    uint32 num_threads = 0;
+    uint32 num_lanes = 0;
+    uint32 pid = 0;
+    const char* core_path = NULL;
+    bool fork_snapshot = false;
+    bool pipelined = false;
+    bool compact = false;
+    bool size_stats = false;
+    bool arena_locks = false;
+    bool resident_only = false;
+    const char* snapshot_path = NULL;
+    bool with_payload = false;
+    const char* diff_old_path = NULL;
+    const char* image_path = NULL;
+    const char* out_path = NULL;
+    unsigned char export_format = 0; //HEAP_EXPORT_...
+    uint32 num_top = 0;
 
     bool show_usage = false;
     static const unsigned char FLAG_ALLOC_MB = 0x01;
     static const unsigned char FLAG_MAX_KB   = 0x02;
+    static const unsigned char FLAG_ALLOC_NUM = 0x03;
+    static const unsigned char FLAG_THREADS  = 0x04;
+    static const unsigned char FLAG_LANES    = 0x05;
+    static const unsigned char FLAG_PID      = 0x06;
+    static const unsigned char FLAG_CORE     = 0x07;
+    static const unsigned char FLAG_SNAPSHOT = 0x08;
+    static const unsigned char FLAG_SNAPSHOT_INFO = 0x09;
+    static const unsigned char FLAG_DIFF_OLD = 0x0A;
+    static const unsigned char FLAG_DIFF_NEW = 0x0B;
+    static const unsigned char FLAG_IMAGE    = 0x0C;
+    static const unsigned char FLAG_OUT      = 0x0D;
+    static const unsigned char FLAG_FORMAT   = 0x0E;
+    static const unsigned char FLAG_TOP      = 0x0F;
     unsigned char flag = 0x00;
     for(i = 1;i < argc;++i)
     {
@@ -144,6 +303,96 @@ int main(int argc,char* argv[])
             {
                 flag = FLAG_MAX_KB;
             }
+            else if(!strcmp(argv[i],"-alloc_num"))
+            {
+                flag = FLAG_ALLOC_NUM;
+            }
+            else if(!strcmp(argv[i],"-bench"))
+            {
+                mode = MODE_BENCH;
+            }
+            else if(!strcmp(argv[i],"-bench_hex"))
+            {
+                mode = MODE_BENCH_HEX;
+            }
+            else if(!strcmp(argv[i],"-image"))
+            {
+                mode = MODE_IMAGE;
+                flag = FLAG_IMAGE;
+            }
+            else if(!strcmp(argv[i],"-out"))
+            {
+                flag = FLAG_OUT;
+            }
+            else if(!strcmp(argv[i],"-format"))
+            {
+                mode = MODE_EXPORT;
+                flag = FLAG_FORMAT;
+            }
+            else if(!strcmp(argv[i],"-top"))
+            {
+                mode = MODE_TOP;
+                flag = FLAG_TOP;
+            }
+            else if(!strcmp(argv[i],"-resident"))
+            {
+                resident_only = true;
+            }
+            else if(!strcmp(argv[i],"-fork"))
+            {
+                fork_snapshot = true;
+            }
+            else if(!strcmp(argv[i],"-async"))
+            {
+                pipelined = true;
+            }
+            else if(!strcmp(argv[i],"-compact"))
+            {
+                compact = true;
+            }
+            else if(!strcmp(argv[i],"-sizes"))
+            {
+                size_stats = true;
+            }
+            else if(!strcmp(argv[i],"-locked"))
+            {
+                arena_locks = true;
+            }
+            else if(!strcmp(argv[i],"-snapshot"))
+            {
+                mode = MODE_SNAPSHOT;
+                flag = FLAG_SNAPSHOT;
+            }
+            else if(!strcmp(argv[i],"-payload"))
+            {
+                with_payload = true;
+            }
+            else if(!strcmp(argv[i],"-snapshot_info"))
+            {
+                mode = MODE_SNAPSHOT_INFO;
+                flag = FLAG_SNAPSHOT_INFO;
+            }
+            else if(!strcmp(argv[i],"-diff"))
+            {
+                mode = MODE_DIFF;
+                flag = FLAG_DIFF_OLD;
+            }
+            else if(!strcmp(argv[i],"-threads"))
+            {
+                flag = FLAG_THREADS;
+            }
+            else if(!strcmp(argv[i],"-lanes"))
+            {
+                flag = FLAG_LANES;
+            }
+            else if(!strcmp(argv[i],"-pid"))
+            {
+                flag = FLAG_PID;
+            }
+            else if(!strcmp(argv[i],"-core"))
+            {
+                flag = FLAG_CORE;
+            }
             else
             {
                 show_usage = true;
@@ -173,6 +422,117 @@ int main(int argc,char* argv[])
                     break;
                 }
             }
+            else if(flag == FLAG_ALLOC_NUM) //-alloc_num <count>
+            {
+                char* p_wrong_char = NULL;
+                uint32 val = strtoul(argv[i],&p_wrong_char,10);
+                if(*p_wrong_char == 0x00)
+                {
+                    g_alloc_num = val;
+                }
+                else
+                {
+                    show_usage = true;
+                    break;
+                }
+            }
+            else if(flag == FLAG_THREADS) //-threads <N>
+            {
+                char* p_wrong_char = NULL;
+                uint32 val = strtoul(argv[i],&p_wrong_char,10);
+                if((*p_wrong_char == 0x00) && val)
+                {
+                    num_threads = val;
+                }
+                else
+                {
+                    show_usage = true;
+                    break;
+                }
+            }
+            else if(flag == FLAG_LANES) //-lanes <N>
+            {
+                char* p_wrong_char = NULL;
+                uint32 val = strtoul(argv[i],&p_wrong_char,10);
+                if((*p_wrong_char == 0x00) && val)
+                {
+                    num_lanes = val;
+                }
+                else
+                {
+                    show_usage = true;
+                    break;
+                }
+            }
+            else if(flag == FLAG_PID) //-pid <PID>
+            {
+                char* p_wrong_char = NULL;
+                uint32 val = strtoul(argv[i],&p_wrong_char,10);
+                if((*p_wrong_char == 0x00) && val)
+                {
+                    pid = val;
+                }
+                else
+                {
+                    show_usage = true;
+                    break;
+                }
+            }
+            else if(flag == FLAG_CORE) //-core <FILE>
+            {
+                core_path = argv[i];
+            }
+            else if((flag == FLAG_SNAPSHOT) || //-snapshot <FILE>
+                    (flag == FLAG_SNAPSHOT_INFO)) //-snapshot_info <FILE>
+            {
+                snapshot_path = argv[i];
+            }
+            else if(flag == FLAG_IMAGE) //-image <FILE>
+            {
+                image_path = argv[i];
+            }
+            else if(flag == FLAG_OUT) //-out <FILE>
+            {
+                out_path = argv[i];
+            }
+            else if(flag == FLAG_FORMAT) //-format jsonl|csv
+            {
+                #if !defined(_WIN32) && !defined(_WIN64)
+                    if(!strcmp(argv[i],"jsonl"))
+                        export_format = HEAP_EXPORT_JSONL;
+                    else if(!strcmp(argv[i],"csv"))
+                        export_format = HEAP_EXPORT_CSV;
+                #endif
+                if(!export_format)
+                {
+                    show_usage = true;
+                    break;
+                }
+            }
+            else if(flag == FLAG_TOP) //-top <N>
+            {
+                char* p_wrong_char = NULL;
+                uint32 val = strtoul(argv[i],&p_wrong_char,10);
+                if((*p_wrong_char == 0x00) && val)
+                {
+                    num_top = val;
+                }
+                else
+                {
+                    show_usage = true;
+                    break;
+                }
+            }
+            else if(flag == FLAG_DIFF_OLD) //-diff <OLD> <NEW>
+            {
+                diff_old_path = argv[i];
+                flag = FLAG_DIFF_NEW;
+                continue;
+            }
+            else if(flag == FLAG_DIFF_NEW)
+            {
+                snapshot_path = argv[i];
+            }
             else
             {
                 show_usage = true;
@@ -182,8 +542,77 @@ int main(int argc,char* argv[])
         }
     }
 
-    if(max_kb && ((mode != MODE_HEXDUMP) && (mode != MODE_RAW)))
+    if(max_kb &&
+       ((mode != MODE_HEXDUMP) && (mode != MODE_RAW) && (mode != MODE_IMAGE)))
+    {
+        show_usage = true;
+    }
+    if(num_threads && ((mode != MODE_FOOTPRINT) && (mode != MODE_HEXDUMP)))
+        show_usage = true;
+    if(num_lanes && ((mode != MODE_FOOTPRINT) && (mode != MODE_BENCH)))
+        show_usage = true;
+    if(with_payload && (mode != MODE_SNAPSHOT))
+        show_usage = true;
+    if(resident_only &&
+       ((mode != MODE_HEXDUMP) && (mode != MODE_RAW) &&
+        (mode != MODE_IMAGE)))
+    {
+        show_usage = true;
+    }
+    if(resident_only && (pid || core_path))
+        show_usage = true;
+    if((pid || core_path) &&
+       ((mode == MODE_INTERACTIVE) || (mode == MODE_BENCH) ||
+        (mode == MODE_BENCH_HEX) || (mode == MODE_IMAGE) ||
+        (mode == MODE_SNAPSHOT_INFO) || (mode == MODE_DIFF) ||
+        num_threads || num_lanes || (pid && core_path)))
+    {
+        show_usage = true;
+    }
+    if(fork_snapshot &&
+       ((mode == MODE_INTERACTIVE) || (mode == MODE_BENCH) ||
+        (mode == MODE_BENCH_HEX) || (mode == MODE_IMAGE) ||
+        (mode == MODE_SNAPSHOT) || (mode == MODE_SNAPSHOT_INFO) ||
+        (mode == MODE_DIFF) || (mode == MODE_EXPORT) || (mode == MODE_TOP) ||
+        pid || core_path))
+    {
+        show_usage = true;
+    }
+    if(((mode == MODE_SNAPSHOT) || (mode == MODE_SNAPSHOT_INFO) ||
+         (mode == MODE_DIFF)) &&
+       !snapshot_path)
+    {
+        show_usage = true;
+    }
+    if((mode == MODE_IMAGE) && !image_path)
+        show_usage = true;
+    if((mode == MODE_EXPORT) && !export_format)
+        show_usage = true;
+    if((mode == MODE_TOP) && !num_top)
         show_usage = true;
+    if(out_path && (mode == MODE_INTERACTIVE))
+        show_usage = true;
+    if(pipelined && ((mode != MODE_FOOTPRINT) || num_threads || num_lanes))
+        show_usage = true;
+    if(compact && ((mode != MODE_FOOTPRINT) || num_threads || num_lanes))
+        show_usage = true;
+    if(size_stats && (mode != MODE_FOOTPRINT) && (mode != MODE_EXPORT))
+        show_usage = true;
+    if(arena_locks &&
+       (((mode != MODE_FOOTPRINT) && (mode != MODE_TOP) &&
+         (mode != MODE_EXPORT)) ||
+        num_threads || num_lanes || fork_snapshot || pid || core_path))
+    {
+        show_usage = true;
+    }
+    #if defined(_WIN32) || defined(_WIN64)
+        if(num_threads || num_lanes || pid || core_path || fork_snapshot ||
+           snapshot_path || image_path || resident_only || out_path ||
+           pipelined || compact || size_stats || num_top || arena_locks)
+        {
+            show_usage = true;
+        }
+    #endif
 
     if(show_usage)
     {
@@ -191,6 +620,121 @@ int main(int argc,char* argv[])
         return 0;
     }
 
+    #if !defined(_WIN32) && !defined(_WIN64)
+        if(out_path) //the dumps write into the file instead of stdout
+        {
+            int out_fd = open(out_path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+            if((out_fd < 0) || !open_heap_sink_fd(&g_out_sink,out_fd))
+            {
+                printf("ERROR - can't open %s: %s\n",out_path,strerror(errno));
+                return 1;
+            }
+            set_heap_sink(&g_out_sink);
+        }
+        set_heap_dump_pipelined(pipelined);
+        set_heap_dump_compact(compact);
+        set_heap_dump_size_stats(size_stats);
+        set_heap_dump_arena_locks(arena_locks);
+        if(mode == MODE_SNAPSHOT_INFO) //no heap is walked
+        {
+            if(g_verbose)
+                printf("Reading the HEAP snapshot %s...\n",snapshot_path);
+            printf("\n");
+            dump_heap_snapshot_info(snapshot_path);
+            return close_out_file(out_path,0);
+        }
+        if(mode == MODE_DIFF) //no heap is walked
+        {
+            if(g_verbose)
+            {
+                printf(
+                    "Comparing the HEAP snapshots %s and %s...\n",
+                    diff_old_path,
+                    snapshot_path);
+            }
+            printf("\n");
+            dump_heap_snapshot_diff(diff_old_path,snapshot_path);
+            return close_out_file(out_path,0);
+        }
+
+        if(pid || core_path) //heap of another process or of a core file
+        {
+            char remote_name[64];
+            if(core_path)
+            {
+                if(!attach_remote_core(core_path))
+                    return close_out_file(out_path,1);
+                snprintf(remote_name,sizeof(remote_name),"core file");
+            }
+            else
+            {
+                if(!attach_remote_heap((pid_t) pid))
+                    return close_out_file(out_path,1);
+                snprintf(remote_name,sizeof(remote_name),"process %u",pid);
+            }
+            if(mode == MODE_FOOTPRINT)
+            {
+                if(g_verbose)
+                {
+                    printf(
+                        "Dumping the HEAP footprint of %s...\n",
+                        remote_name);
+                }
+                printf("\n");
+                dump_remote_heap_footprint();
+            }
+            else if(mode == MODE_DEBUGDUMP)
+            {
+                if(g_verbose)
+                    printf("DEBUG dump of the HEAP of %s...\n",remote_name);
+                printf("\n");
+                dump_remote_heap_details();
+            }
+            else if(mode == MODE_HEXDUMP)
+            {
+                if(g_verbose)
+                    printf("HEX dump of the HEAP of %s...\n",remote_name);
+                printf("\n");
+                dump_remote_heap_hex(max_kb);
+            }
+            else if(mode == MODE_RAW)
+            {
+                if(g_verbose)
+                    printf("RAW dump of the HEAP of %s...\n",remote_name);
+                printf("\n");
+                dump_remote_heap_raw(max_kb);
+            }
+            else if(mode == MODE_EXPORT) //records only, no empty line
+            {
+                dump_remote_heap_export(export_format);
+            }
+            else if(mode == MODE_TOP)
+            {
+                if(g_verbose)
+                {
+                    printf(
+                        "Ranking the largest chunks of %s...\n",
+                        remote_name);
+                }
+                printf("\n");
+                dump_remote_heap_top(num_top);
+            }
+            else if(mode == MODE_SNAPSHOT)
+            {
+                if(g_verbose)
+                {
+                    printf(
+                        "Writing a snapshot of the HEAP of %s...\n",
+                        remote_name);
+                }
+                printf("\n");
+                write_remote_heap_snapshot(snapshot_path,with_payload);
+            }
+            detach_remote_heap();
+            return close_out_file(out_path,0);
+        }
+    #endif
+
     if(g_alloc_size_mb)
     {
         size_t byte_size = (size_t) (g_alloc_size_mb * 1024.0 * 1024.0);
@@ -216,6 +760,36 @@ int main(int argc,char* argv[])
         }
     }
 
+    if(g_alloc_num) //chunks are kept until the program terminates
+    {
+        if(g_verbose)
+        {
+            printf(
+                "ALLOCATING %u small chunks in MAIN ARENA...",
+                g_alloc_num);
+            fflush(stdout);
+        }
+        uint32 i = 0;
+        for(;i < g_alloc_num;++i)
+        {
+            void* mem_ptr = malloc(16 + ((i * 37) % 480));
+            if((i % 3) == 2)
+            {
+                free(mem_ptr);
+            }
+            else if(mem_ptr)
+            {
+                *((void**) mem_ptr) = g_alloc_num_list;
+                g_alloc_num_list = mem_ptr;
+            }
+        }
+        if(g_verbose)
+        {
+            printf("done.\n");
+            printf("\n");
+        }
+    }
+
     size_t* heap_top_end = (size_t*) 0; //first invalid address
     size_t* heap_top_chunk =  (size_t*) 0; //heap top chunk
     size_t heap_size =
@@ -223,12 +797,37 @@ int main(int argc,char* argv[])
 
     if(mode != MODE_INTERACTIVE)
     {
+        #if !defined(_WIN32) && !defined(_WIN64)
+            set_heap_dump_resident_only(resident_only);
+            if(fork_snapshot) //walked by a forked child
+            {
+                if(g_verbose)
+                    printf("Dumping a fork() snapshot of the HEAP...\n");
+                printf("\n");
+                unsigned char what = HEAP_DUMP_FOOTPRINT;
+                if(mode == MODE_DEBUGDUMP)
+                    what = HEAP_DUMP_DETAILS;
+                else if(mode == MODE_HEXDUMP)
+                    what = HEAP_DUMP_HEX;
+                else if(mode == MODE_RAW)
+                    what = HEAP_DUMP_RAW;
+                dump_heap_fork_snapshot(what,max_kb,num_threads,num_lanes);
+            }
+            else
+        #endif
         if(mode == MODE_FOOTPRINT)
         {
             if(g_verbose)
                 printf("Dumping the HEAP footprint...\n");
             printf("\n");
-            dump_heap_footprint();
+            #if !defined(_WIN32) && !defined(_WIN64)
+                if(num_threads || num_lanes)
+                    dump_heap_footprint_parallel(num_threads,num_lanes);
+                else
+                    dump_heap_footprint();
+            #else
+                dump_heap_footprint();
+            #endif
         }
         else if(mode == MODE_DEBUGDUMP)
         {
@@ -249,7 +848,22 @@ int main(int argc,char* argv[])
                     printf("HEX dump of the HEAP...\n");
             }
             printf("\n");
-            dump_heap_hex(HEAP_BOTTOM_CHUNK,heap_top_end,max_kb);
+            #if !defined(_WIN32) && !defined(_WIN64)
+                if(num_threads)
+                {
+                    dump_heap_hex_parallel(
+                                    HEAP_BOTTOM_CHUNK,
+                                    heap_top_end,
+                                    num_threads,
+                                    max_kb);
+                }
+                else
+                {
+                    dump_heap_hex(HEAP_BOTTOM_CHUNK,heap_top_end,max_kb);
+                }
+            #else
+                dump_heap_hex(HEAP_BOTTOM_CHUNK,heap_top_end,max_kb);
+            #endif
         }
         else if(mode == MODE_RAW)
         {
@@ -261,8 +875,56 @@ int main(int argc,char* argv[])
                     printf("RAW dump of the HEAP...\n");
             }
             printf("\n");
-            dump_heap_raw(HEAP_BOTTOM_CHUNK,heap_top_end,max_kb);
+            #if !defined(_WIN32) && !defined(_WIN64)
+                dump_heap_raw_all(max_kb); //all arenas and heap segments
+            #else
+                dump_heap_raw(HEAP_BOTTOM_CHUNK,heap_top_end,max_kb);
+            #endif
         }
+        #if !defined(_WIN32) && !defined(_WIN64)
+            else if(mode == MODE_BENCH)
+            {
+                if(g_verbose)
+                    printf("Benchmarking the HEAP walk...\n");
+                printf("\n");
+                if(num_lanes)
+                    bench_heap_walk(10,num_lanes);
+                else
+                    bench_heap_walk();
+            }
+            else if(mode == MODE_BENCH_HEX)
+            {
+                if(g_verbose)
+                    printf("Benchmarking the HEX dump...\n");
+                printf("\n");
+                bench_heap_hex();
+            }
+            else if(mode == MODE_SNAPSHOT)
+            {
+                if(g_verbose)
+                    printf("Writing a snapshot of the HEAP...\n");
+                printf("\n");
+                write_heap_snapshot(snapshot_path,with_payload);
+            }
+            else if(mode == MODE_IMAGE)
+            {
+                if(g_verbose)
+                    printf("Writing a sparse image of the HEAP...\n");
+                printf("\n");
+                write_heap_image(image_path,max_kb);
+            }
+            else if(mode == MODE_EXPORT) //records only, no empty line
+            {
+                dump_heap_export(export_format);
+            }
+            else if(mode == MODE_TOP)
+            {
+                if(g_verbose)
+                    printf("Ranking the largest chunks of the HEAP...\n");
+                printf("\n");
+                dump_heap_top(num_top);
+            }
+        #endif
         if(g_alloc_size_mb)
         {
             for(i = 0;i < NUM_MEM_PTRS;++i)
@@ -271,7 +933,7 @@ int main(int argc,char* argv[])
                 g_mem_ptr[i] = (void*) 0;
             }
         }
-        return 0;
+        return close_out_file(out_path,0);
     }
 
     if(g_verbose)
@@ -16,13 +16,6 @@
 // Implementation:
 //*****************************************************************************
 
-//-----------------------------------------------------------------------------
-// Defines:
-//-----------------------------------------------------------------------------
-
-//Maximum number of heaps per arena (for arrays to be put on the stack):
-#define MAX_NUM_HEAPS 1024
-
 //-----------------------------------------------------------------------------
 // Initialize this module:
 //-----------------------------------------------------------------------------
@@ -61,6 +54,293 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
     static gen_ar_t* main_arena_ptr__ = (gen_ar_t*) 0;
     static int top_idx__ = -1;
     static int next_idx__ = -1;
+    static int mutex_idx__ = -1; //arena mutex (see find_arena_mutex__())
+    static size_t seg_bott_offs__ = 0; //bottom chunk offset in heap segments
+    static size_t first_seg_bott_offs__ = 0; //... in an arena's 1st segment
+    static bool resident_only__ = false; //dump just the heap pages in RAM
+    static bool compact__ = false; //footprint by runs of equal chunks
+    static bool fork_child__ = false; //dump by dump_heap_fork_snapshot()
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Output sink:
+//-----------------------------------------------------------------------------
+// The dumps format their lines right into the buffer of the current sink
+// (see heap_printf()), which is written by a few large write() calls. The
+// buffer of a fd sink is mapped by mmap() once, so neither the locking of
+// stdio nor its heap buffer are involved. A spool sink isn't written at all,
+// its mapping grows by mremap() until the caller drains it.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    #define HEAP_SINK_LINE_MAX 4096 //heap_printf() line without room in sink
+
+    //Mapped buffer, which grows instead of being written (see -locked):
+    static const unsigned char HEAP_SINK_SPOOL = 4;
+
+    static heap_sink_t stdout_sink__; //default sink (kind 0 = not opened)
+    static heap_sink_t* sink__ = (heap_sink_t*) 0; //current sink or NULL
+
+    //Write all bytes to a file descriptor:
+    static bool write_all__(int fd,const char* buf,size_t size)
+    {
+        while(size)
+        {
+            ssize_t n = write(fd,buf,size);
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                return false;
+            }
+            buf += n;
+            size -= (size_t) n;
+        }
+        return true;
+    }
+
+    bool open_heap_sink_fd(heap_sink_t* sink,int fd)
+    {
+        if(!sink || (fd < 0))
+            return false;
+        struct stat st;
+        bool is_pipe = !fstat(fd,&st) && S_ISFIFO(st.st_mode);
+        sink->kind = is_pipe ? HEAP_SINK_PIPE : HEAP_SINK_FD;
+        sink->fd = fd;
+        sink->len = 0;
+        sink->total = 0;
+        sink->lost = 0;
+        sink->failed = false;
+        void* buf = mmap(
+                    (void*) 0,
+                    HEAP_SINK_BUF_SIZE,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+        if(buf == MAP_FAILED)
+        {
+            sink->buf = (char*) 0; //no buffer ---> unbuffered writes
+            sink->buf_size = 0;
+        }
+        else
+        {
+            sink->buf = (char*) buf;
+            sink->buf_size = HEAP_SINK_BUF_SIZE;
+        }
+        #ifdef F_SETPIPE_SZ
+            if(is_pipe) //a whole buffer fits into the pipe (may be refused)
+                fcntl(fd,F_SETPIPE_SZ,HEAP_SINK_BUF_SIZE);
+        #endif
+        return true;
+    }
+
+    static bool open_spool_sink__(heap_sink_t* sink)
+    {
+        void* buf = mmap(
+                    (void*) 0,
+                    HEAP_SINK_BUF_SIZE,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+        if(buf == MAP_FAILED)
+            return false;
+        memset(sink,0,sizeof(heap_sink_t));
+        sink->kind = HEAP_SINK_SPOOL;
+        sink->fd = -1;
+        sink->buf = (char*) buf;
+        sink->buf_size = HEAP_SINK_BUF_SIZE;
+        return true;
+    }
+
+    //Make room for len more bytes in a spool (false if it can't grow):
+    static bool grow_spool_sink__(heap_sink_t* sink,size_t len)
+    {
+        if(sink->failed)
+            return false;
+        size_t size = 2 * sink->buf_size;
+        if(size < (sink->len + len))
+            size = sink->len + len;
+        void* buf = mremap(sink->buf,sink->buf_size,size,MREMAP_MAYMOVE);
+        if(buf == MAP_FAILED)
+        {
+            sink->failed = true;
+            return false;
+        }
+        sink->buf = (char*) buf;
+        sink->buf_size = size;
+        return true;
+    }
+
+    bool open_heap_sink_memory(heap_sink_t* sink,char* mem,size_t mem_size)
+    {
+        if(!sink || (!mem && mem_size))
+            return false;
+        sink->kind = HEAP_SINK_MEMORY;
+        sink->fd = -1;
+        sink->buf = mem;
+        sink->buf_size = mem_size;
+        sink->len = 0;
+        sink->total = 0;
+        sink->lost = 0;
+        sink->failed = false;
+        return true;
+    }
+
+    static bool flush_sink__(heap_sink_t* sink)
+    {
+        if((sink->kind == HEAP_SINK_MEMORY) || (sink->kind == HEAP_SINK_SPOOL))
+            return true;
+        if(sink->fd == STDOUT_FILENO)
+            fflush(stdout); //bytes are written behind the printf() output
+        if(sink->len && !write_all__(sink->fd,sink->buf,sink->len))
+            sink->failed = true;
+        sink->len = 0;
+        return !sink->failed;
+    }
+
+    void close_heap_sink(heap_sink_t* sink)
+    {
+        if(!sink || !sink->kind)
+            return;
+        flush_sink__(sink);
+        if((sink->kind != HEAP_SINK_MEMORY) && sink->buf)
+            munmap(sink->buf,sink->buf_size);
+        sink->buf = (char*) 0;
+        sink->buf_size = 0;
+        sink->kind = 0;
+        if(sink__ == sink)
+            sink__ = (heap_sink_t*) 0;
+    }
+
+    static heap_sink_t* get_sink__()
+    {
+        if(sink__)
+            return sink__;
+        if(!stdout_sink__.kind)
+            open_heap_sink_fd(&stdout_sink__,STDOUT_FILENO);
+        return &stdout_sink__;
+    }
+
+    heap_sink_t* set_heap_sink(heap_sink_t* sink)
+    {
+        heap_sink_t* prev = sink__;
+        flush_sink__(get_sink__()); //keep the order of the output
+        sink__ = sink;
+        return prev;
+    }
+
+    heap_sink_t* get_heap_sink()
+    {
+        return get_sink__();
+    }
+
+    bool flush_heap_sink()
+    {
+        return flush_sink__(get_sink__());
+    }
+
+    static void write_sink__(heap_sink_t* sink,const char* data,size_t len)
+    {
+        sink->total += len;
+        if((sink->kind == HEAP_SINK_SPOOL) &&
+           (len > (sink->buf_size - sink->len)))
+        {
+            grow_spool_sink__(sink,len);
+        }
+        if((sink->kind == HEAP_SINK_MEMORY) || (sink->kind == HEAP_SINK_SPOOL))
+        {
+            size_t room = sink->buf_size - sink->len;
+            if(len > room)
+            {
+                sink->lost += len - room;
+                len = room;
+            }
+            memcpy(sink->buf + sink->len,data,len);
+            sink->len += len;
+            return;
+        }
+        if(len > (sink->buf_size - sink->len))
+            flush_sink__(sink);
+        if(!sink->len && (len >= (sink->buf_size / 4))) //large block: no copy
+        {
+            if(!write_all__(sink->fd,data,len))
+                sink->failed = true;
+            return;
+        }
+        memcpy(sink->buf + sink->len,data,len);
+        sink->len += len;
+    }
+
+    void heap_sink_write(const char* data,size_t len)
+    {
+        write_sink__(get_sink__(),data,len);
+    }
+
+    //Format into the free part of the sink's buffer (flushed if the line
+    //does not fit), vsnprintf() does not allocate heap:
+    int heap_printf(const char* format,...)
+    {
+        heap_sink_t* sink = get_sink__();
+        size_t room = sink->buf_size - sink->len;
+        va_list args;
+        va_start(args,format);
+        int n = vsnprintf(sink->buf + sink->len,room,format,args);
+        va_end(args);
+        if(n < 0)
+            return n;
+        if((size_t) n < room)
+        {
+            sink->len += (size_t) n;
+            sink->total += (size_t) n;
+            return n;
+        }
+        if((sink->kind == HEAP_SINK_SPOOL) &&
+           grow_spool_sink__(sink,(size_t) n + 1))
+        {
+            va_start(args,format);
+            vsnprintf(sink->buf + sink->len,(size_t) n + 1,format,args);
+            va_end(args);
+            sink->len += (size_t) n;
+            sink->total += (size_t) n;
+            return n;
+        }
+        if((sink->kind != HEAP_SINK_MEMORY) &&
+           (sink->kind != HEAP_SINK_SPOOL) &&
+           ((size_t) n < sink->buf_size))
+        {
+            flush_sink__(sink);
+            va_start(args,format);
+            vsnprintf(sink->buf,sink->buf_size,format,args);
+            va_end(args);
+            sink->len = (size_t) n;
+            sink->total += (size_t) n;
+            return n;
+        }
+
+        //No buffer, a full memory sink or a spool that can't grow ---> format
+        //on the stack:
+        char line[HEAP_SINK_LINE_MAX];
+        va_start(args,format);
+        vsnprintf(line,sizeof(line),format,args);
+        va_end(args);
+        size_t len = (size_t) n;
+        if(len >= sizeof(line))
+            len = sizeof(line) - 1; //truncated
+        write_sink__(sink,line,len);
+        return n;
+    }
+
+    //Flushes the current sink when a dump function returns (by any path):
+    struct sink_flush_t
+    {
+        ~sink_flush_t() { flush_heap_sink(); }
+    };
 
 #endif
 
@@ -121,6 +401,196 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
 
 #else
 
+    //-------------------------------------------------------------------------
+    // Bottom chunks of allocated heap segments:
+    //-------------------------------------------------------------------------
+    // The bottom chunk of an allocated heap segment is found without any
+    // scanning, since glibc places it directly behind the segment's headers:
+    //
+    //  - any heap segment starts with the heap info (heap_bott_t), which is
+    //    padded so the first chunk's mem_ptr is aligned,
+    //  - the first heap segment of an arena additionally holds the arena's
+    //    malloc_state_t behind the heap info (hb->ar_ptr == hb + 1), here
+    //    the bottom chunk follows the aligned end of the malloc_state_t.
+    //
+    //      bottom = (size_t*) (((char*) hb) + seg_bott_offs__)
+    //      bottom = (size_t*) (((char*) hb) + first_seg_bott_offs__)
+    //
+    // Both offsets depend on the glibc version and are calibrated once by
+    // the ma_finder() thread on its own (fresh) thread arena. A bottom chunk
+    // computed this way is validated by its header, if this fails the
+    // bottom is searched by stepping back from a known chunk as fallback.
+    //-------------------------------------------------------------------------
+    // Attention: do not allocate heap inside (no STL) -> only use stack!!!
+    //-------------------------------------------------------------------------
+
+    static bool is_valid_bottom_chunk__(heap_bott_t* hb,size_t* chunk_ptr)
+    {
+        size_t* heap_end = (size_t*) (((char*) hb) + hb->size);
+        if((chunk_ptr <= (size_t*) hb) || (chunk_ptr >= heap_end))
+            return false;
+
+        //The bottom chunk has the P bit always set and is never mmapped:
+        size_t size_field = ((chunk_t*) chunk_ptr)->size;
+        if((size_field & (P__ | M__)) != P__)
+            return false;
+        size_t chunk_size = (size_t) (size_field & ~FLAGS_MASK);
+        if(!chunk_size || (chunk_size & ((2 * sizeof(size_t)) - 1)))
+            return false;
+        return (size_t*) (((char*) chunk_ptr) + chunk_size) <= heap_end;
+    }
+
+    static size_t* scan_bottom_chunk__(heap_bott_t* hb,size_t* chunk_ptr)
+    {
+        size_t* heap_end = (size_t*) (((char*) hb) + hb->size);
+        size_t* p = (size_t*) 0;
+
+        //Without a known chunk start at the top chunk of the heap segment
+        //(or at the zero sized fencepost of an older heap segment):
+        if(!chunk_ptr && !(((chunk_t*) (heap_end - 2))->size & ~FLAGS_MASK))
+            chunk_ptr = heap_end - 2;
+        if(!chunk_ptr)
+        {
+            for(p = heap_end - 2;p > (size_t*) hb;p -= 2)
+            {
+                if(get_next_chunk(p) == heap_end)
+                {
+                    chunk_ptr = p;
+                    break;
+                }
+            }
+            if(!chunk_ptr)
+                return (size_t*) 0;
+        }
+
+        //Step back to find the first chunk:
+        size_t* last_valid_chunk_ptr = chunk_ptr;
+        for(p = chunk_ptr - 2;p > (size_t*) hb;p -= 2)
+        {
+            if(get_next_chunk(p) == last_valid_chunk_ptr)
+                last_valid_chunk_ptr = p;
+        }
+        return last_valid_chunk_ptr;
+    }
+
+    static size_t* get_segment_bottom_chunk__(
+                                      heap_bott_t* hb,
+                                      size_t* chunk_ptr) //known chunk or NULL
+    {
+        if(!hb)
+            return (size_t*) 0;
+
+        if(seg_bott_offs__)
+        {
+            size_t offs = seg_bott_offs__;
+            if((size_t*) hb->ar_ptr == (size_t*) (((char*) hb) + offs))
+                offs = first_seg_bott_offs__; //malloc_state_t is inside
+            size_t* bottom = (size_t*) (((char*) hb) + offs);
+            if(is_valid_bottom_chunk__(hb,bottom))
+                return bottom;
+        }
+        return scan_bottom_chunk__(hb,chunk_ptr);
+    }
+
+    static void calibrate_segment_bottoms__(
+                                   heap_bott_t* hb,
+                                   size_t* chunk_ptr, //a chunk of the segment
+                                   unsigned char verbose)
+    {
+        #define MAX_CALIB_STEPS 64
+
+        seg_bott_offs__ = 0;
+        first_seg_bott_offs__ = 0;
+        if(hb->prev || (next_idx__ < 0))
+            return; //not the 1st heap segment of the arena
+
+        //The expected end of the malloc_state_t follows 4 fields behind
+        //'next' (next_free, attached_threads, system_mem, max_system_mem):
+        size_t align = 2 * sizeof(size_t);
+        gen_ar_t* ar_ptr = (gen_ar_t*) hb->ar_ptr;
+        char* expected = (char*) &ar_ptr->addr[next_idx__ + 5];
+        char* first = (char*) &ar_ptr->addr[next_idx__ + 1];
+        size_t misalign = ((size_t) (first + align)) & (align - 1);
+        if(misalign)
+            first += align - misalign;
+        misalign = ((size_t) (expected + align)) & (align - 1);
+        if(misalign)
+            expected += align - misalign;
+
+        //Try the expected bottom first, then every aligned address behind
+        //'next', until stepping forward hits the known chunk:
+        char* candidate = expected;
+        for(;;)
+        {
+            size_t* p = (size_t*) candidate;
+            if(is_valid_bottom_chunk__(hb,p))
+            {
+                uint32 i = 0;
+                for(;(i < MAX_CALIB_STEPS) && (p < chunk_ptr);++i)
+                {
+                    size_t chunk_size =
+                                (size_t) (((chunk_t*) p)->size & ~FLAGS_MASK);
+                    if(!chunk_size)
+                        break;
+                    p = (size_t*) (((char*) p) + chunk_size);
+                }
+                if(p == chunk_ptr)
+                    break;
+            }
+
+            candidate = (candidate == expected) ? first : candidate + align;
+            if(candidate == expected)
+                candidate += align;
+            if(candidate >= (char*) chunk_ptr)
+            {
+                if(verbose)
+                    heap_printf(
+                        "ma_finder() could not calibrate the heap segment "
+                        "bottom (fallback: scanning)\n");
+                return;
+            }
+        }
+
+        seg_bott_offs__ = (size_t) (((char*) ar_ptr) - ((char*) hb));
+        first_seg_bott_offs__ = (size_t) (candidate - ((char*) hb));
+        if(verbose)
+        {
+            heap_printf(
+                "ma_finder() calibrated the heap segment bottom offsets:\n"
+                "   1st heap segment of an arena ...: 0x%lX\n"
+                "   any other heap segment .........: 0x%lX\n",
+                first_seg_bott_offs__,
+                seg_bott_offs__);
+        }
+    }
+
+    //Find the arena's mutex, which is the first field of the malloc_state_t.
+    //It's a glibc low-level lock (an int: 0 = unlocked, 1 = locked, 2 =
+    //locked with waiters), not a pthread_mutex_t. It's followed by the
+    //flags, have_fastchunks (since glibc 2.27) and the fastbins, which end
+    //at the 'top' field, so the layout is checked by the index of 'top':
+    static void find_arena_mutex__(gen_ar_t* ar_ptr,unsigned char verbose)
+    {
+        mutex_idx__ = -1;
+        if(((top_idx__ != (int) NFASTBINS + 1) &&
+            (top_idx__ != (int) NFASTBINS + 2)) ||
+           *((int*) &ar_ptr->addr[0])) //the finder's own arena is unlocked
+        {
+            if(verbose)
+                heap_printf("ma_finder() could not find the arena mutex\n");
+            return;
+        }
+        mutex_idx__ = 0;
+        if(verbose)
+        {
+            heap_printf(
+                "ma_finder() found the arena's mutex at address %p "
+                "(index %d)\n",
+                &ar_ptr->addr[mutex_idx__],
+                mutex_idx__);
+        }
+    }
+
     //-------------------------------------------------------------------------
     // Find the main arena:
     //-------------------------------------------------------------------------
@@ -246,8 +716,8 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
         //Allocate memory in a small chunk (32 bytes on 64 bit OS):
         if(verbose)
         {
-            printf("ma_finder() thread goes allocating memory...");
-            fflush(stdout);
+            heap_printf("ma_finder() thread goes allocating memory...");
+            flush_heap_sink();
         }
         mem_ptr[0] = malloc(4 * sizeof(size_t));
         chunk_ptr[0] = get_chunk(mem_ptr[0]);
@@ -259,13 +729,14 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
         mem_ptr[3] = malloc(4 * sizeof(size_t));
         strcpy((char*) mem_ptr[3],"!! Markus\n");
         if(verbose)
-            printf("done.\n");
+            heap_printf("done.\n");
 
         //Get the all the other chunk pointers:
         if(verbose)
         {
-            printf("ma_finder() thread goes determining top chunk pointer...");
-            fflush(stdout);
+            heap_printf(
+                "ma_finder() thread goes determining top chunk pointer...");
+            flush_heap_sink();
         }
         chunk_ptr[1] = get_chunk(mem_ptr[1]);
         chunk_ptr[2] = get_chunk(mem_ptr[2]);
@@ -274,14 +745,14 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
         size_t* bottom_chunk_ptr = chunk_ptr[0];
         size_t* top_chunk_ptr = chunk_ptr[4];
         if(verbose)
-            printf("done.\n");
+            heap_printf("done.\n");
 
         //Access the struct heap_bott_t at the heap segment start:
         heap_bott_t* heap_info_ptr =
                         get_start_of_allocated_heap_segment(bottom_chunk_ptr);
         if(verbose)
         {
-            printf(
+            heap_printf(
                 "ma_finder() thread got heap info from heap segment start...\n"
                 "heap_info_ptr ..............: %p (heap segment start)\n"
                 "   heap_info_ptr->ar_ptr ...: %p (heap arena)\n"
@@ -297,13 +768,14 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
         //Try to find the link to our top chunk:
         if(verbose)
         {
-            printf(
+            heap_printf(
                 "ma_finder() thread tries to find the "
                 "arena top chunk entry...");
-            fflush(stdout);
+            flush_heap_sink();
         }
         top_idx__ = -1;
         next_idx__ = -1;
+        mutex_idx__ = -1;
         gen_ar_t* ar_ptr = (gen_ar_t*) heap_info_ptr->ar_ptr;
         uint32 i = 0;
         for(;i < NUM_ADDR_FIELDS;++i)
@@ -317,8 +789,8 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
                     if(verbose)
                     {
                         size_t* p = (size_t*) &ar_ptr->addr[top_idx__];
-                        printf("done.\n");
-                        printf(
+                        heap_printf("done.\n");
+                        heap_printf(
                             "ma_finder() found the arena's top field "
                             "(entry = 0x%012lX)\n"
                             "at address %p (index %u)...\n"
@@ -363,8 +835,8 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
                             (size_t) *(p + 6));
 
                         p = (size_t*) &ar_ptr->addr[next_idx__];
-                        printf("done.\n");
-                        printf(
+                        heap_printf("done.\n");
+                        heap_printf(
                             "ma_finder() found the arena's next field "
                             "(entry = 0x%012lX)\n"
                             "at address %p (index %u)...\n"
@@ -412,21 +884,32 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
                 }
             }
         }
+        //Calibrate the bottom chunk offsets of heap segments:
+        if(next_idx__ >= 0)
+        {
+            calibrate_segment_bottoms__(
+                                    heap_info_ptr,
+                                    bottom_chunk_ptr,
+                                    verbose);
+        }
+        if(top_idx__ >= 0)
+            find_arena_mutex__(ar_ptr,verbose);
+
         //Try to find the main arena:
         if((top_idx__ < 0) || (next_idx__ < 0))
         {
             if(verbose)
-                printf("FAILED!\n");
+                heap_printf("FAILED!\n");
         }
         else
         {
             if(verbose)
             {
-                printf(
+                heap_printf(
                     "ma_finder() thread will step forward (using "
                     "the 'next' field) searching\n"
                     "for the main arena...\n");
-                fflush(stdout);
+                flush_heap_sink();
             }
             gen_ar_t* start_ar_ptr = ar_ptr;
             for(;ar_ptr;)
@@ -439,7 +922,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
                         if(verbose)
                         {
                             size_t* p = (size_t*) main_arena_ptr__;
-                            printf(
+                            heap_printf(
                                 "ma_finder() found the main arena "
                                 "at address %p...\n"
                                 "  %p: 0x%012lX\n"
@@ -479,7 +962,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
                                 (size_t) *(p + 5),
                                 p + 6,
                                 (size_t) *(p + 6));
-                            printf(
+                            heap_printf(
                                 "ma_finder() thread found the main arena:\n"
                                 "   &main_arena ....: %p\n"
                                 "          top .....: %p (sbrk(0) = %p)\n"
@@ -493,7 +976,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
                     }
                     if(verbose)
                     {
-                        printf(
+                        heap_printf(
                             "ma_finder() thread found a thread arena:\n"
                             "   ar_ptr .........: %p\n"
                             "          top .....: %p\n"
@@ -512,15 +995,15 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
             if(!main_arena_ptr__)
             {
                 if(verbose)
-                    printf("FAILED!\n");
+                    heap_printf("FAILED!\n");
             }
         }
 
         //Free all heap memory:
         if(verbose)
         {
-            printf("ma_finder() thread frees the memory again...");
-            fflush(stdout);
+            heap_printf("ma_finder() thread frees the memory again...");
+            flush_heap_sink();
         }
         for(i = 0;i < (NUM_CHUNKS - 1);++i)
         {
@@ -528,13 +1011,14 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
             mem_ptr[i] = (void*) 0;
         }
         if(verbose)
-            printf("done.\n");
+            heap_printf("done.\n");
 
         return (void*) 0;
     }
 
     void init_heapdump(unsigned char verbose)
     {
+        sink_flush_t flush_at_return;
         if(heap_bottom_chunk__)
             return;
 
@@ -584,7 +1068,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
             chunk_ptr[4] = get_next_chunk(chunk_ptr[3]); //should be TOP CHUNK
 
             //Dump the chunks:
-            printf(
+            heap_printf(
                 "Verbose heap bottom determination...\n"
                 "\n"
                 "A few malloc() allocations have been made at the start \n"
@@ -597,7 +1081,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
             dump_chunk(chunk_ptr[2]);
             dump_chunk(chunk_ptr[3]);
             dump_chunk(chunk_ptr[4]);
-            printf("\n");
+            heap_printf("\n");
 
             //Free all heap memory:
             uint32 i = 0;
@@ -611,7 +1095,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
         //Start a thread to find the main arena:
         if(verbose)
         {
-            printf(
+            heap_printf(
                 "+---------------------------------------"
                 "---------------------------------------\n"
                 "| ma_finder() thread will be started "
@@ -626,13 +1110,13 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
         {
             if(main_arena_ptr__)
             {
-                printf(
+                heap_printf(
                     "+---------------------------------------"
                     "---------------------------------------\n"
                     "| ma_finder() thread terminated successful!\n"
                     "+---------------------------------------"
                     "---------------------------------------\n");
-                printf(
+                heap_printf(
                     "The main arena was found:\n"
                     "\n"
                     "   &main_arena ....: %p\n"
@@ -647,7 +1131,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
             }
             else
             {
-                printf(
+                heap_printf(
                     "+---------------------------------------"
                     "---------------------------------------\n"
                     "| ma_finder() thread terminated without "
@@ -655,7 +1139,7 @@ static size_t* heap_bottom_chunk__ = (size_t*) 0;
                     "+---------------------------------------"
                     "---------------------------------------\n");
             }
-            printf("\n");
+            heap_printf("\n");
         }
     }
 
@@ -752,7 +1236,8 @@ bool get_memory_dimenions(
                                 size_t** heap_top_end,
                                 size_t** heap_top_chunk)
     {
-        *heap_top_end = (size_t*) sbrk(0);
+        size_t* top = (size_t*) sbrk(0);
+        *heap_top_end = top;
         *heap_top_chunk = (size_t*) 0;
 
         size_t heap_size = 0;
@@ -765,12 +1250,12 @@ bool get_memory_dimenions(
             heap_size += chunk_size;
 
             next_chunk_ptr = get_next_chunk(chunk_ptr);
-            if(next_chunk_ptr == sbrk(0))
+            if(next_chunk_ptr == top)
             {
                 *heap_top_chunk = chunk_ptr;
                 break; //top reached
             }
-            if(next_chunk_ptr > sbrk(0))
+            if(next_chunk_ptr > top)
             {
                 heap_size = 0;
                 break; //error
@@ -850,699 +1335,6958 @@ bool get_memory_dimenions(
 #endif
 
 //-----------------------------------------------------------------------------
-// Dump the total heap footprint:
+// Chunk cursor (walk over all chunks of all arenas):
 //-----------------------------------------------------------------------------
 // Attention: do not allocate heap inside (no STL) -> only use stack!!!
 //-----------------------------------------------------------------------------
 
-#if defined(_WIN32) || defined(_WIN64)
-
-    void dump_heap_footprint()
-    {
-        size_t* heap_top_end = (size_t*) 0;
-        size_t* heap_top_chunk = (size_t*) 0;
-        size_t* heap_bottom_chunk = (size_t*) 0;
-
-        printf("\n");
+#if !defined(_WIN32) && !defined(_WIN64)
 
-        _HEAPINFO hi;
-        hi._pentry = NULL; //initate _heapwalk()
+    //Distance of the prefetch in front of the walk (heap is contiguous):
+    #define WALK_PREFETCH_DIST 2048
 
-        size_t used_total = 0;
-        size_t free_total = 0;
-        #ifdef _DEBUG
-            size_t* mem_ptr = (size_t*) 0;
+    //Decode the chunk the cursor points to:
+    //
+    //  The size field of the chunk and the size field of the next chunk are
+    //  read exactly once. The top chunk is detected by the segment end that
+    //  was taken when entering the heap segment, so no sbrk(0) call and no
+    //  heap info access is needed per chunk. As the chunks of a heap segment
+    //  are contiguous, the memory a few chunks ahead is prefetched, so the
+    //  walk is not stalled by a cache miss on every next chunk header.
+    //
+    static bool load_chunk_cursor__(chunk_cursor_t* cur)
+    {
+        size_t* chunk_ptr = cur->chunk_ptr;
+        size_t size_field = ((chunk_t*) chunk_ptr)->size;
+        size_t chunk_size = size_field & ~FLAGS_MASK;
+        size_t* next = (size_t*) (((char*) chunk_ptr) + chunk_size);
+        #ifdef __GNUC__
+            __builtin_prefetch(((char*) chunk_ptr) + WALK_PREFETCH_DIST);
         #endif
-        size_t* chunk_ptr = (size_t*) 0;
-        size_t heap_size = 0;
-        int heap_status = 0;
-        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+        if(!chunk_size && ((chunk_ptr + 2) == cur->seg_end))
         {
-            chunk_ptr = (size_t*) ((char*) hi._pentry);
-            if(!heap_bottom_chunk || (heap_bottom_chunk > chunk_ptr))
-                heap_bottom_chunk = chunk_ptr;
-            if(heap_top_chunk < chunk_ptr)
-            {
-                heap_top_chunk = chunk_ptr;
-                heap_top_end = (size_t*) (((char*) heap_top_chunk) + hi._size);
-            }
-            heap_size += hi._size;
-
-            #ifdef _DEBUG
-                mem_ptr = (size_t*) (((char*) chunk_ptr) + DBG_HDR_SIZE);
-                printf(
-                    "%8p  mem: %8p  %10u bytes %s\n",
-                    chunk_ptr,
-                    mem_ptr,
-                    hi._size,
-                    hi._useflag == _USEDENTRY ? "USED" : "FREE");
-            #else
-                printf(
-                    "%8p   %10u bytes %s\n",
-                    chunk_ptr,
-                    hi._size,
-                    hi._useflag == _USEDENTRY ? "USED" : "FREE");
-            #endif
-            if(hi._useflag == _USEDENTRY)
-                used_total += hi._size;
-            else
-                free_total += hi._size;
+            //Fencepost at the end of an older heap segment of an arena
+            //(glibc puts a zero sized chunk header into the last 2 words):
+            cur->chunk_size = 2 * sizeof(size_t);
+            cur->flags = size_field & FLAGS_MASK;
+            cur->next_chunk_ptr = cur->seg_end;
+            cur->is_top = true;
+            cur->in_use = true;
+            return true;
         }
+        if(!chunk_size || (next > cur->seg_end))
+        {
+            cur->bad_chunk_ptr = chunk_ptr;
+            cur->chunk_ptr = (size_t*) 0;
+            return false;
+        }
+        cur->chunk_size = chunk_size;
+        cur->flags = size_field & FLAGS_MASK;
+        cur->next_chunk_ptr = next;
+        if(next == cur->seg_end)
+        {
+            cur->is_top = true; //top is always a free chunk
+            cur->in_use = false;
+        }
+        else if(((next + 2) == cur->seg_end) &&
+                !(((chunk_t*) next)->size & ~FLAGS_MASK))
+        {
+            //The chunk in front of the zero sized header (the old top
+            //chunk cut to 2 words) is a part of the fencepost:
+            cur->chunk_size = (size_t) (((char*) cur->seg_end) -
+                                        ((char*) chunk_ptr));
+            cur->next_chunk_ptr = cur->seg_end;
+            cur->is_top = true;
+            cur->in_use = true;
+        }
+        else
+        {
+            cur->is_top = false;
+            cur->in_use = (((chunk_t*) next)->size & P__) ? true : false;
+        }
+        return true;
+    }
 
-        switch(heap_status)
+    //Set the cursor to the bottom chunk of a heap segment:
+    static void enter_heap_segment__(chunk_cursor_t* cur,size_t* bottom_chunk)
+    {
+        cur->chunk_ptr = bottom_chunk;
+        cur->new_segment = true;
+        cur->prev_hb = (heap_bott_t*) 0;
+        if(bottom_chunk < cur->main_heap_end)
         {
-            case _HEAPEMPTY:
-                printf("Heap is empty\n");
-                break;
+            cur->hb = (heap_bott_t*) 0;
+            cur->seg_end = cur->main_heap_end;
+        }
+        else
+        {
+            cur->hb = get_start_of_allocated_heap_segment(bottom_chunk);
+            cur->seg_end = (size_t*) (((char*) cur->hb) + cur->hb->size);
+
+            //Remember the next (older) heap segment of the same arena:
+            heap_bott_t* prev_hb = cur->hb->prev;
+            if(prev_hb && (prev_hb->ar_ptr == cur->hb->ar_ptr))
+                cur->prev_hb = prev_hb;
+        }
+    }
+
+    //Get the bottom chunk of the heap segment holding an arena's top chunk:
+    static size_t* get_top_segment_bottom__(
+                                         chunk_cursor_t* cur,
+                                         gen_ar_t* ar_ptr)
+    {
+        size_t* top_chunk_ptr = ar_ptr->addr[top_idx__];
+        if(!top_chunk_ptr)
+            return (size_t*) 0;
+        if(top_chunk_ptr < cur->main_heap_end)
+            return heap_bottom_chunk__;
+        return get_segment_bottom_chunk__(
+                        get_start_of_allocated_heap_segment(top_chunk_ptr),
+                        top_chunk_ptr);
+    }
+
+    //Set the cursor to a chunk of a known arena (no arena index access):
+    static bool init_segment_cursor__(
+                                    chunk_cursor_t* cur,
+                                    size_t* start_chunk,
+                                    gen_ar_t* ar_ptr,
+                                    size_t* main_heap_end)
+    {
+        memset(cur,0,sizeof(chunk_cursor_t));
+        cur->main_heap_end = main_heap_end;
+        cur->ar_ptr = ar_ptr;
+        cur->new_arena = true;
+        enter_heap_segment__(cur,start_chunk);
+
+        return load_chunk_cursor__(cur);
+    }
+
+    bool init_chunk_cursor(chunk_cursor_t* cur,size_t* start_chunk)
+    {
+        memset(cur,0,sizeof(chunk_cursor_t));
+        if(!heap_bottom_chunk__)
+            return false;
+        if(!start_chunk)
+            start_chunk = heap_bottom_chunk__;
+
+        size_t* main_heap_end = (size_t*) sbrk(0); //once per walk
+        build_arena_index(); //once per walk
+        return init_segment_cursor__(
+                                cur,
+                                start_chunk,
+                                (gen_ar_t*) get_arena(start_chunk),
+                                main_heap_end);
+    }
+
+    bool step_chunk_cursor(chunk_cursor_t* cur)
+    {
+        if(!cur->chunk_ptr)
+            return false;
+
+        cur->new_arena = false;
+        cur->new_segment = false;
+
+        if(!cur->is_top)
+        {
+            cur->chunk_ptr = cur->next_chunk_ptr;
+            return load_chunk_cursor__(cur);
+        }
+
+        //Top chunk reached -> go ahead with the next heap or arena:
+        if(cur->ar_ptr)
+        {
+            //Try to get the bottom of the next (older) heap of the arena:
+            for(;cur->prev_hb;)
+            {
+                heap_bott_t* hb = cur->prev_hb;
+                size_t* bottom = get_segment_bottom_chunk__(hb,(size_t*) 0);
+                if(bottom)
+                {
+                    ++cur->seg_no;
+                    enter_heap_segment__(cur,bottom);
+                    return load_chunk_cursor__(cur);
+                }
+                cur->prev_hb = (hb->prev && (hb->prev->ar_ptr == hb->ar_ptr)) ?
+                                                hb->prev : (heap_bott_t*) 0;
+            }
+
+            //Try to get another arena:
+            cur->ar_ptr = (gen_ar_t*) get_next_arena((size_t*) cur->ar_ptr);
+            for(;cur->ar_ptr;)
+            {
+                size_t* bottom = get_top_segment_bottom__(cur,cur->ar_ptr);
+                if(bottom)
+                {
+                    ++cur->arena_no;
+                    cur->seg_no = 0;
+                    cur->new_arena = true;
+                    enter_heap_segment__(cur,bottom);
+                    return load_chunk_cursor__(cur);
+                }
+                cur->ar_ptr = (gen_ar_t*)
+                                    get_next_arena((size_t*) cur->ar_ptr);
+            }
+        }
+
+        cur->chunk_ptr = (size_t*) 0;
+        return false;
+    }
+
+    size_t walk_heap(chunk_visitor_t visitor,void* user_data)
+    {
+        size_t num_chunks = 0;
+        chunk_cursor_t cur;
+        bool ok = init_chunk_cursor(&cur,heap_bottom_chunk__);
+        for(;ok;ok = step_chunk_cursor(&cur))
+        {
+            ++num_chunks;
+            if(visitor && !visitor(&cur,user_data))
+                break;
+        }
+        return num_chunks;
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Chunk size sketches per arena:
+//-----------------------------------------------------------------------------
+// With size_stats__, the footprint walks add every chunk to the sketch of
+// its arena (see CHUNK SIZE SKETCH in heapdump.h). As the number of arenas
+// is not known before the walk, the sketches are kept in a table indexed by
+// the arena number, which grows in an anonymous mapping (mremap() doubles
+// it), not on the heap, which is walked.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    #define ARENA_TABLE_MIN_ARENAS 16 //first mapping of a per-arena table
+
+    static bool size_stats__ = false; //footprint dumps sketch the sizes
+
+    struct size_table_t //growing anonymous mapping
+    {
+        chunk_sizes_t* sizes; //sketch per arena
+        size_t num_arenas; //arenas walked so far
+        size_t cap; //arenas mapped
+        chunk_sizes_t* cur; //sketch of the current arena or NULL
+        bool failed; //the table could not grow
+    };
+
+    void set_heap_dump_size_stats(bool size_stats)
+    {
+        size_stats__ = size_stats;
+    }
+
+    size_t get_size_hist_quantile(const size_hist_t* hist,double quantile)
+    {
+        if(!hist->count)
+            return 0;
+        if(quantile < 0.0)
+            quantile = 0.0;
+        double rank_d = quantile * (double) hist->count;
+        size_t rank = (size_t) rank_d;
+        if((double) rank < rank_d)
+            ++rank; //the smallest rank covering the quantile
+        if(!rank)
+            rank = 1;
+        if(rank > hist->count)
+            rank = hist->count;
+
+        size_t seen = 0;
+        size_t i = 0;
+        for(;i < (SIZE_HIST_BUCKETS - 1);++i)
+        {
+            seen += hist->bucket[i];
+            if(seen >= rank)
+                break;
+        }
+
+        //Largest size of the bucket (the buckets below the first split
+        //hold a single size):
+        size_t last = i;
+        if(i > SIZE_HIST_SUB_MASK)
+        {
+            size_t shift = (i >> SIZE_HIST_SUB_BITS) - 1;
+            size_t first = ((SIZE_HIST_SUB_MASK + 1) +
+                            (i & SIZE_HIST_SUB_MASK)) << shift;
+            last = first + ((1UL << shift) - 1);
+        }
+        return (last < hist->max) ? last : hist->max;
+    }
+
+    //Get a quantile as a chunk size (a multiple of the malloc alignment):
+    static size_t get_chunk_size_quantile__(
+                                    const size_hist_t* hist,
+                                    double quantile)
+    {
+        return get_size_hist_quantile(hist,quantile) & ~MALLOC_ALIGN_MASK;
+    }
+
+    //Grow a per-arena table in an anonymous mapping up to an arena number
+    //(the new entries are zero):
+    static bool reserve_arena_table__(
+                                    void** base,
+                                    size_t* cap, //arenas mapped
+                                    size_t entry_size,
+                                    size_t arena_no)
+    {
+        if(arena_no < *cap)
+            return true;
+        size_t new_cap = *cap ? *cap : ARENA_TABLE_MIN_ARENAS;
+        while(new_cap <= arena_no)
+            new_cap *= 2;
+        void* new_base = *base ?
+                        mremap(
+                            *base,
+                            *cap * entry_size,
+                            new_cap * entry_size,
+                            MREMAP_MAYMOVE) :
+                        mmap(
+                            (void*) 0,
+                            new_cap * entry_size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+        if(new_base == MAP_FAILED)
+            return false;
+        *base = new_base;
+        *cap = new_cap;
+        return true;
+    }
+
+    //Add the chunk of a cursor to the sketch of its arena:
+    static inline void add_size_table__(
+                                    size_table_t* tab,
+                                    const chunk_cursor_t* cur)
+    {
+        if(cur->new_arena || !tab->cur)
+        {
+            tab->cur = (chunk_sizes_t*) 0;
+            if(tab->failed ||
+               !reserve_arena_table__(
+                                (void**) &tab->sizes,
+                                &tab->cap,
+                                sizeof(chunk_sizes_t),
+                                cur->arena_no))
+            {
+                tab->failed = true;
+                return;
+            }
+            tab->cur = &tab->sizes[cur->arena_no];
+            if(cur->arena_no >= tab->num_arenas)
+                tab->num_arenas = cur->arena_no + 1;
+        }
+        if(!(cur->is_top && cur->in_use)) //no fencepost
+            add_chunk_size(tab->cur,cur->chunk_size,cur->in_use);
+    }
+
+    static void free_size_table__(size_table_t* tab)
+    {
+        if(tab->sizes)
+            munmap(tab->sizes,tab->cap * sizeof(chunk_sizes_t));
+        memset(tab,0,sizeof(size_table_t));
+    }
+
+    static void print_arena_sizes__(size_t arena_no,const chunk_sizes_t* sizes)
+    {
+        heap_printf(
+            "ARENA %4lu USED %9lu chunks  p50 %6lu  p99 %6lu  max %6lu\n"
+            "           FREE %9lu chunks  p50 %6lu  p99 %6lu  max %6lu\n",
+            arena_no,
+            sizes->used.count,
+            get_chunk_size_quantile__(&sizes->used,0.50),
+            get_chunk_size_quantile__(&sizes->used,0.99),
+            sizes->used.max,
+            sizes->free.count,
+            get_chunk_size_quantile__(&sizes->free,0.50),
+            get_chunk_size_quantile__(&sizes->free,0.99),
+            sizes->free.max);
+    }
+
+    //Print the sketches of all arenas (after the totals):
+    static void print_all_arena_sizes__(
+                                    const chunk_sizes_t* sizes,
+                                    size_t num_arenas)
+    {
+        heap_printf("CHUNK SIZES PER ARENA (bytes):\n\n");
+        size_t i = 0;
+        for(;i < num_arenas;++i)
+            print_arena_sizes__(i,&sizes[i]);
+        heap_printf("\n");
+    }
+
+    static void print_size_table__(const size_table_t* tab)
+    {
+        if(tab->failed)
+        {
+            heap_printf("ERROR - cannot map the chunk size table\n");
+            return;
+        }
+        print_all_arena_sizes__(tab->sizes,tab->num_arenas);
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Walk the own heap under the arena locks:
+//-----------------------------------------------------------------------------
+// Without locks, a walk races with the threads calling malloc() and free()
+// and may read torn chunk headers. With arena_locks__, the walk holds the
+// mutex of an arena while it walks one heap segment of it and releases it
+// between two segments, so each critical section is short, and the other
+// arenas keep on allocating meanwhile:
+//
+//      arena 0 [== main heap ==]    arena 1 [== seg 0 ==]  [== seg 1 ==]
+//      locked  |<->|<->|<->|<->|    locked  |<- pause ->|  |<- pause ->|
+//
+// A heap segment of a thread arena is at most HEAP_MAX_SIZE, but the main
+// heap is one segment of any size. So the main arena's lock is released
+// and taken again every LOCK_WALK_CHUNKS chunks, and the walk goes on at
+// the last chunk walked, if its header is still valid (not merged into a
+// free chunk meanwhile), else at the first chunk behind it.
+//
+// The mutex is a glibc low-level lock (see find_arena_mutex__()), so it is
+// taken by the same futex protocol as glibc does. The time every lock is
+// held (the pause of the arena's threads) is put into a sketch per arena
+// (see CHUNK SIZE SKETCH in heapdump.h), which is printed after the dump.
+//
+// Attention: the walking thread must not call malloc() while it holds an
+// arena lock (the dumps write by the sink, which doesn't allocate). And it
+// must not block on the output: the lines are spooled into a mapping while
+// a lock is held and written after the unlock, so the spool takes as much
+// memory as the output of the largest heap segment. The pipeline (-async)
+// has its own rings instead, so its walk waits under a lock, when all the
+// buffers of the pipeline are full.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    typedef bool (*cursor_step_t)(chunk_cursor_t* cur);
+
+    struct lock_walk_t
+    {
+        size_hist_t* pauses; //lock hold times per arena in ns (mapped)
+        size_t cap; //arenas mapped
+        size_t num_arenas; //arenas locked so far
+        bool failed; //the table could not grow
+        int* lock; //arena lock held by the walk or NULL
+        size_t arena_no; //arena of the lock held
+        uint64 locked_ns; //time stamp of taking the lock
+        size_t num_chunks; //chunks walked under the lock held
+        heap_sink_t spool; //output while a lock is held (kind 0 = none)
+        heap_sink_t* out; //sink the spool is drained into
+        heap_sink_t* prev; //sink set before the walk
+    };
+
+    //Chunks walked in the main heap, before its lock is released:
+    #define LOCK_WALK_CHUNKS 1024
+
+    static bool arena_locks__ = false; //walk the own heap under the locks
+    static lock_walk_t lock_walk__;
+
+    void set_heap_dump_arena_locks(bool arena_locks)
+    {
+        arena_locks__ = arena_locks;
+    }
+
+    static inline uint64 get_time_ns__()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return (uint64) ts.tv_sec * 1000000000ULL + (uint64) ts.tv_nsec;
+    }
+
+    //Take a glibc low-level lock (as lll_lock() does):
+    static void lock_arena_mutex__(int* lock)
+    {
+        if(__sync_bool_compare_and_swap(lock,0,1))
+            return;
+        for(;__atomic_exchange_n(lock,2,__ATOMIC_ACQUIRE);)
+        {
+            syscall(
+                SYS_futex,
+                lock,
+                FUTEX_WAIT_PRIVATE,
+                2,
+                (struct timespec*) 0,
+                (int*) 0,
+                0);
+        }
+    }
+
+    //Release a glibc low-level lock (as lll_unlock() does):
+    static void unlock_arena_mutex__(int* lock)
+    {
+        if(__atomic_exchange_n(lock,0,__ATOMIC_RELEASE) > 1)
+        {
+            syscall(
+                SYS_futex,
+                lock,
+                FUTEX_WAKE_PRIVATE,
+                1,
+                (struct timespec*) 0,
+                (int*) 0,
+                0);
+        }
+    }
+
+    static void lock_walk_arena__(gen_ar_t* ar_ptr,size_t arena_no)
+    {
+        int* lock = (int*) &ar_ptr->addr[mutex_idx__];
+        lock_arena_mutex__(lock);
+        lock_walk__.lock = lock;
+        lock_walk__.arena_no = arena_no;
+        lock_walk__.num_chunks = 0;
+        lock_walk__.locked_ns = get_time_ns__();
+    }
+
+    //Write the spooled lines (no lock may be held, the write may block):
+    static void drain_walk_spool__()
+    {
+        heap_sink_t* spool = &lock_walk__.spool;
+        if(!spool->kind || !spool->len)
+            return;
+        write_sink__(lock_walk__.out,spool->buf,spool->len);
+        spool->len = 0;
+    }
+
+    static void unlock_walk_arena__()
+    {
+        if(!lock_walk__.lock)
+            return;
+        uint64 pause_ns = get_time_ns__() - lock_walk__.locked_ns;
+        unlock_arena_mutex__(lock_walk__.lock);
+        lock_walk__.lock = (int*) 0;
+        drain_walk_spool__();
+
+        //Count the pause (after the unlock, since mremap() may be called):
+        size_t arena_no = lock_walk__.arena_no;
+        if(lock_walk__.failed ||
+           !reserve_arena_table__(
+                                (void**) &lock_walk__.pauses,
+                                &lock_walk__.cap,
+                                sizeof(size_hist_t),
+                                arena_no))
+        {
+            lock_walk__.failed = true;
+            return;
+        }
+        add_size_hist(&lock_walk__.pauses[arena_no],(size_t) pause_ns);
+        if(arena_no >= lock_walk__.num_arenas)
+            lock_walk__.num_arenas = arena_no + 1;
+    }
+
+    //Check the header of a main heap chunk that was walked before the lock
+    //was released (under the lock): it must be below the top chunk and not
+    //be merged into a free chunk in front of it:
+    static bool is_main_chunk_valid__(size_t* chunk_ptr)
+    {
+        size_t* top_chunk_ptr = main_arena_ptr__->addr[top_idx__];
+        if(!top_chunk_ptr || (chunk_ptr >= top_chunk_ptr))
+            return false;
+        chunk_t* c = (chunk_t*) chunk_ptr;
+        if(c->size & P__)
+            return true;
+        size_t* prev = (size_t*) (((char*) chunk_ptr) - c->overhead);
+        return (prev >= heap_bottom_chunk__) &&
+               (prev < chunk_ptr) &&
+               ((((chunk_t*) prev)->size & ~FLAGS_MASK) == c->overhead);
+    }
+
+    //Release the main arena's lock within the main heap and take it again,
+    //then load the last chunk walked again, or the chunk holding its header
+    //(from the heap bottom), if it was merged meanwhile (true if the cursor
+    //is on a chunk walked already):
+    static bool relock_main_heap__(chunk_cursor_t* cur)
+    {
+        size_t* last = cur->chunk_ptr;
+        unlock_walk_arena__();
+        lock_walk_arena__(main_arena_ptr__,cur->arena_no);
+        cur->main_heap_end = (size_t*) sbrk(0); //top may have moved
+        cur->seg_end = cur->main_heap_end;
+        if(is_main_chunk_valid__(last) && load_chunk_cursor__(cur))
+            return true;
+
+        cur->bad_chunk_ptr = (size_t*) 0;
+        cur->chunk_ptr = heap_bottom_chunk__;
+        for(;load_chunk_cursor__(cur);cur->chunk_ptr = cur->next_chunk_ptr)
+        {
+            if(cur->is_top)
+                return false; //last chunk was merged into the top chunk
+            if(cur->next_chunk_ptr > last)
+                return true;
+        }
+        return true; //bad chunk, the step ends the walk
+    }
+
+    //Step the cursor, leaving a heap segment releases its arena's lock and
+    //takes the lock of the arena of the next heap segment:
+    static bool step_locked_cursor__(chunk_cursor_t* cur)
+    {
+        if(!cur->chunk_ptr || !cur->is_top || !cur->ar_ptr)
+        {
+            if(cur->chunk_ptr && !cur->is_top && !cur->hb &&
+               (cur->ar_ptr == main_arena_ptr__) && lock_walk__.lock &&
+               (++lock_walk__.num_chunks >= LOCK_WALK_CHUNKS) &&
+               !relock_main_heap__(cur))
+            {
+                return true; //top chunk of the main heap
+            }
+            if(step_chunk_cursor(cur))
+                return true;
+            unlock_walk_arena__(); //end of the walk or bad chunk
+            return false;
+        }
+
+        //The next heap segment is the next (older) one of the arena or the
+        //top one of the next arena:
+        unlock_walk_arena__();
+        gen_ar_t* ar_ptr = cur->ar_ptr;
+        size_t arena_no = cur->arena_no;
+        if(!cur->prev_hb)
+        {
+            ar_ptr = (gen_ar_t*) get_next_arena((size_t*) ar_ptr);
+            ++arena_no;
+        }
+        if(ar_ptr)
+            lock_walk_arena__(ar_ptr,arena_no);
+        if(!step_chunk_cursor(cur))
+        {
+            unlock_walk_arena__();
+            return false;
+        }
+
+        //The cursor skipped an arena without chunks (or the older heap
+        //segments were gone) ---> read the heap segment again under the
+        //lock of its arena:
+        if(cur->ar_ptr != ar_ptr)
+        {
+            unlock_walk_arena__();
+            lock_walk_arena__(cur->ar_ptr,cur->arena_no);
+            enter_heap_segment__(cur,cur->chunk_ptr);
+            if(!load_chunk_cursor__(cur))
+            {
+                unlock_walk_arena__();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //Start a walk of the own heap, under the arena locks if wanted (false
+    //if the walk can't be done, ok is the result of the cursor init), the
+    //output is spooled while a lock is held, if wanted:
+    static bool begin_own_walk__(
+                                chunk_cursor_t* cur,
+                                bool* ok,
+                                cursor_step_t* step,
+                                bool spool)
+    {
+        *step = step_chunk_cursor;
+        if(!arena_locks__)
+        {
+            *ok = init_chunk_cursor(cur,heap_bottom_chunk__);
+            return true;
+        }
+        if((mutex_idx__ < 0) || !main_arena_ptr__)
+        {
+            heap_printf("ERROR - the arena mutex was not found\n");
+            return false;
+        }
+
+        memset(&lock_walk__,0,sizeof(lock_walk_t));
+        lock_walk__.out = get_sink__();
+        flush_sink__(lock_walk__.out); //no write under the lock
+        if(spool && open_spool_sink__(&lock_walk__.spool))
+            lock_walk__.prev = set_heap_sink(&lock_walk__.spool);
+        *step = step_locked_cursor__;
+        lock_walk_arena__(main_arena_ptr__,0);
+        *ok = init_chunk_cursor(cur,heap_bottom_chunk__);
+        if(!*ok)
+            unlock_walk_arena__();
+        return true;
+    }
+
+    //End a walk of the own heap, print the pauses of the arenas:
+    static void end_own_walk__(bool print_pauses)
+    {
+        if(!arena_locks__)
+            return;
+        unlock_walk_arena__(); //the caller stopped the walk early
+        if(lock_walk__.spool.kind)
+        {
+            drain_walk_spool__(); //lines printed behind the walk
+            set_heap_sink(lock_walk__.prev);
+            if(lock_walk__.spool.lost)
+            {
+                heap_printf(
+                    "ERROR - %lu bytes of output lost, the spool could not "
+                    "grow\n",
+                    lock_walk__.spool.lost);
+            }
+            close_heap_sink(&lock_walk__.spool);
+        }
+        if(print_pauses && lock_walk__.failed)
+        {
+            heap_printf("ERROR - cannot map the arena pause table\n");
+        }
+        else if(print_pauses)
+        {
+            heap_printf("ARENA LOCK PAUSES (one per heap segment or per %d "
+                        "main heap chunks):\n\n",
+                        LOCK_WALK_CHUNKS);
+            size_t i = 0;
+            for(;i < lock_walk__.num_arenas;++i)
+            {
+                const size_hist_t* hist = &lock_walk__.pauses[i];
+                heap_printf(
+                    "ARENA %4lu %6lu pauses  p50 %9.1f us  p99 %9.1f us  "
+                    "max %9.1f us\n",
+                    i,
+                    hist->count,
+                    get_size_hist_quantile(hist,0.50) / 1000.0,
+                    get_size_hist_quantile(hist,0.99) / 1000.0,
+                    hist->max / 1000.0);
+            }
+            heap_printf("\n");
+        }
+        if(lock_walk__.pauses)
+        {
+            munmap(
+                lock_walk__.pauses,
+                lock_walk__.cap * sizeof(size_hist_t));
+        }
+        memset(&lock_walk__,0,sizeof(lock_walk_t));
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Pipelined footprint dump:
+//-----------------------------------------------------------------------------
+// The footprint lines are made by three stages, which run at the same time:
+//
+//      walker (caller) --recs--> formatter --bufs--> writer ---> sink
+//
+// Each ring has a single producer and a single consumer, so no lock is
+// needed: only the producer moves head and only the consumer moves tail.
+// The records and the buffers are mapped once (bounded memory), so a slow
+// output (e.g. a terminal) stalls the walk just when all buffers are full,
+// and the dump takes the time of the slowest stage instead of the sum.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    #define PIPE_NUM_RECS 8192 //records in the walker ---> formatter ring
+    #define PIPE_REC_BATCH 64 //records handed over at once
+    #define PIPE_NUM_BUFS 4 //buffers in the formatter ---> writer ring
+    #define PIPE_BUF_SIZE (512 * 1024)
+    #define PIPE_LINE_MAX 256 //room for the longest line
+    #define PIPE_SPINS 128 //busy waits before yielding the CPU
+
+    static const unsigned char PIPE_REC_USED = 1;
+    static const unsigned char PIPE_REC_FREE = 2;
+    static const unsigned char PIPE_REC_TOP  = 3; //free top chunk
+    static const unsigned char PIPE_REC_END  = 4; //the walk is done
+    static const unsigned char PIPE_REC_FENCE = 5; //end of an older segment
+
+    static const unsigned char PIPE_SEP_ARENA   = 1; //"NEXT ARENA" in front
+    static const unsigned char PIPE_SEP_SEGMENT = 2; //empty line in front
+
+    static bool pipelined__ = false; //footprint dumps run the pipeline
+
+    struct pipe_rec_t
+    {
+        size_t* chunk_ptr;
+        size_t chunk_size;
+        size_t run_cnt; //chunks of the same size and state (see compact__)
+        unsigned char kind; //PIPE_REC_...
+        unsigned char sep; //PIPE_SEP_... or 0
+    };
+
+    //Counters of a single producer/single consumer ring, slots [tail, head)
+    //are filled (each counter in its own cache line):
+    struct pipe_ring_t
+    {
+        size_t head __attribute__((aligned(64))); //moved by the producer
+        size_t tail __attribute__((aligned(64))); //moved by the consumer
+    };
+
+    struct pipe_buf_t
+    {
+        char* data; //PIPE_BUF_SIZE bytes
+        size_t len;
+        bool last; //the writer stops behind this buffer
+    };
+
+    struct heap_pipe_t
+    {
+        pipe_ring_t recs; //walker ---> formatter
+        pipe_ring_t bufs; //formatter ---> writer
+        pipe_rec_t* rec; //PIPE_NUM_RECS slots
+        pipe_buf_t buf[PIPE_NUM_BUFS];
+        heap_sink_t* sink; //written by the writer only
+        void* map; //records and buffers
+        size_t map_size;
+        pthread_t writer;
+        pthread_t formatter;
+        bool walked; //the walker handed over the end record
+    };
+
+    void set_heap_dump_pipelined(bool pipelined)
+    {
+        pipelined__ = pipelined;
+    }
+
+    //Wait for the other side of a ring (spin, yield, then sleep):
+    static void pipe_backoff__(uint32* spins)
+    {
+        ++(*spins);
+        if(*spins < PIPE_SPINS)
+        {
+            #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+                _mm_pause();
+            #endif
+        }
+        else if(*spins < (2 * PIPE_SPINS))
+        {
+            sched_yield();
+        }
+        else
+        {
+            struct timespec ts = {0,20000}; //20 us
+            nanosleep(&ts,(struct timespec*) 0);
+        }
+    }
+
+    //Wait until the slot at tail is filled, return the new head:
+    static size_t wait_ring_filled__(pipe_ring_t* ring,size_t tail)
+    {
+        uint32 spins = 0;
+        size_t head = 0;
+        while((head = __atomic_load_n(&ring->head,__ATOMIC_ACQUIRE)) == tail)
+            pipe_backoff__(&spins);
+        return head;
+    }
+
+    //Wait until a full ring of num_slots has room, return the new tail:
+    static size_t wait_ring_room__(
+                                pipe_ring_t* ring,
+                                size_t head,
+                                size_t num_slots)
+    {
+        uint32 spins = 0;
+        size_t tail = 0;
+        while((head - (tail = __atomic_load_n(&ring->tail,__ATOMIC_ACQUIRE)))
+              == num_slots)
+        {
+            pipe_backoff__(&spins);
+        }
+        return tail;
+    }
+
+    //Writer: drain the buffers into the sink by large writes:
+    static void* pipe_write_thread__(void* arg)
+    {
+        heap_pipe_t* pipe = (heap_pipe_t*) arg;
+        size_t tail = 0;
+        size_t head = 0;
+        for(;;)
+        {
+            if(tail == head)
+                head = wait_ring_filled__(&pipe->bufs,tail);
+            pipe_buf_t* b = &pipe->buf[tail % PIPE_NUM_BUFS];
+            write_sink__(pipe->sink,b->data,b->len);
+            bool last = b->last;
+            __atomic_store_n(&pipe->bufs.tail,++tail,__ATOMIC_RELEASE);
+            if(last)
+                break;
+        }
+        return (void*) 0;
+    }
+
+    //Hand the current buffer to the writer, return the next one:
+    static pipe_buf_t* pipe_next_buf__(
+                                heap_pipe_t* pipe,
+                                size_t* head,
+                                size_t* tail)
+    {
+        __atomic_store_n(&pipe->bufs.head,++(*head),__ATOMIC_RELEASE);
+        if((*head - *tail) == PIPE_NUM_BUFS)
+            *tail = wait_ring_room__(&pipe->bufs,*head,PIPE_NUM_BUFS);
+        pipe_buf_t* b = &pipe->buf[*head % PIPE_NUM_BUFS];
+        b->len = 0;
+        b->last = false;
+        return b;
+    }
+
+    //Formatter: turn the chunk records into footprint lines:
+    static void* pipe_format_thread__(void* arg)
+    {
+        heap_pipe_t* pipe = (heap_pipe_t*) arg;
+        size_t rec_tail = 0;
+        size_t rec_head = 0;
+        size_t buf_head = 0;
+        size_t buf_tail = 0;
+        pipe_buf_t* b = &pipe->buf[0];
+        b->len = 0;
+        b->last = false;
+        for(;;)
+        {
+            if(rec_tail == rec_head)
+                rec_head = wait_ring_filled__(&pipe->recs,rec_tail);
+            const pipe_rec_t* r = &pipe->rec[rec_tail % PIPE_NUM_RECS];
+            if(r->kind == PIPE_REC_END)
+                break;
+
+            if((PIPE_BUF_SIZE - b->len) < PIPE_LINE_MAX)
+                b = pipe_next_buf__(pipe,&buf_head,&buf_tail);
+            char* o = b->data + b->len;
+            size_t room = PIPE_BUF_SIZE - b->len;
+            int n = 0;
+            if(r->sep == PIPE_SEP_ARENA)
+                n = snprintf(o,room,"\n--------- NEXT ARENA: ---------\n\n");
+            else if(r->sep == PIPE_SEP_SEGMENT)
+                n = snprintf(o,room,"\n");
+            o += n;
+            room -= (size_t) n;
+            if(r->kind == PIPE_REC_TOP)
+            {
+                n += snprintf(
+                        o,
+                        room,
+                        "%14p  * !HEAP TOP CHUNK! * %10lu bytes FREE\n",
+                        r->chunk_ptr,
+                        r->chunk_size);
+            }
+            else if(r->kind == PIPE_REC_FENCE)
+            {
+                n += snprintf(
+                        o,
+                        room,
+                        "%14p  * !FENCEPOST!      * %10lu bytes\n",
+                        r->chunk_ptr,
+                        r->chunk_size);
+            }
+            else if(r->run_cnt > 1)
+            {
+                n += snprintf(
+                        o,
+                        room,
+                        "%14p  x%-18lu  %10lu bytes %s\n",
+                        r->chunk_ptr,
+                        r->run_cnt,
+                        r->chunk_size,
+                        (r->kind == PIPE_REC_USED) ? "USED" : "FREE");
+            }
+            else
+            {
+                n += snprintf(
+                        o,
+                        room,
+                        "%14p  mem: %14p  %10lu bytes %s\n",
+                        r->chunk_ptr,
+                        get_mem_ptr(r->chunk_ptr),
+                        r->chunk_size,
+                        (r->kind == PIPE_REC_USED) ? "USED" : "FREE");
+            }
+            b->len += (size_t) n;
+
+            //Give the slots back in batches (or when all are done):
+            if(!(++rec_tail % PIPE_REC_BATCH) || (rec_tail == rec_head))
+                __atomic_store_n(&pipe->recs.tail,rec_tail,__ATOMIC_RELEASE);
+        }
+        b->last = true;
+        __atomic_store_n(&pipe->bufs.head,buf_head + 1,__ATOMIC_RELEASE);
+        return (void*) 0;
+    }
+
+    //Map the rings and start the formatter and the writer (false if the
+    //pipeline could not be set up). The threads must exist before the walk
+    //starts, since pthread_create() itself may allocate heap memory, which
+    //waits forever for an arena lock held by the walk (see -locked):
+    static bool open_footprint_pipe__(heap_pipe_t* pipe)
+    {
+        memset(pipe,0,sizeof(heap_pipe_t));
+        size_t rec_size = PIPE_NUM_RECS * sizeof(pipe_rec_t);
+        size_t map_size = rec_size + PIPE_NUM_BUFS * PIPE_BUF_SIZE;
+        void* map = mmap(
+                    (void*) 0,
+                    map_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+        if(map == MAP_FAILED)
+            return false;
+        pipe->map = map;
+        pipe->map_size = map_size;
+        pipe->rec = (pipe_rec_t*) map;
+        uint32 i = 0;
+        for(;i < PIPE_NUM_BUFS;++i)
+            pipe->buf[i].data = ((char*) map) + rec_size + i * PIPE_BUF_SIZE;
+        pipe->sink = get_sink__();
+
+        if(pthread_create(
+                    &pipe->writer,
+                    (pthread_attr_t*) 0,
+                    pipe_write_thread__,
+                    pipe))
+        {
+            munmap(map,map_size);
+            return false;
+        }
+        if(pthread_create(
+                    &pipe->formatter,
+                    (pthread_attr_t*) 0,
+                    pipe_format_thread__,
+                    pipe))
+        {
+            pipe->buf[0].last = true; //stop the writer by an empty buffer
+            __atomic_store_n(&pipe->bufs.head,1,__ATOMIC_RELEASE);
+            pthread_join(pipe->writer,(void**) 0);
+            munmap(map,map_size);
+            return false;
+        }
+        return true;
+    }
+
+    //Wait for the formatter and the writer and unmap the rings (a pipeline
+    //without a walk is stopped by an end record):
+    static void close_footprint_pipe__(heap_pipe_t* pipe)
+    {
+        if(!pipe->walked)
+        {
+            pipe->rec[0].kind = PIPE_REC_END;
+            __atomic_store_n(&pipe->recs.head,1,__ATOMIC_RELEASE);
+        }
+        pthread_join(pipe->formatter,(void**) 0);
+        pthread_join(pipe->writer,(void**) 0);
+        munmap(pipe->map,pipe->map_size);
+    }
+
+    //Walk the chunks of an initialized cursor and let the running pipeline
+    //print them, sum up the totals and the size sketches (the pipeline is
+    //closed when all lines are written):
+    static void pipe_footprint_walk__(
+                                heap_pipe_t* pipe,
+                                chunk_cursor_t* cur,
+                                bool ok, //result of the cursor init
+                                bool (*step)(chunk_cursor_t* cur),
+                                heap_stats_t* st,
+                                size_table_t* sizes) //NULL = no sketches
+    {
+        memset(st,0,sizeof(heap_stats_t));
+        size_t head = 0;
+        size_t tail = 0;
+        pipe_rec_t* r = (pipe_rec_t*) 0; //record at head, not handed over
+        for(;;ok = step(cur))
+        {
+            if(ok && !(cur->is_top && cur->in_use)) //no fencepost
+            {
+                st->heap_size += cur->chunk_size;
+                ++st->num_chunks;
+                if(cur->in_use)
+                    st->used_total += cur->chunk_size;
+                else
+                    st->free_total += cur->chunk_size;
+                if(sizes)
+                    add_size_table__(sizes,cur);
+            }
+            if(ok && r && compact__ &&
+               !cur->new_arena && !cur->new_segment && !cur->is_top &&
+               (cur->chunk_size == r->chunk_size) &&
+               (r->kind == (cur->in_use ? PIPE_REC_USED : PIPE_REC_FREE)))
+            {
+                ++r->run_cnt;
+                continue;
+            }
+            if(r && !(++head % PIPE_REC_BATCH))
+                __atomic_store_n(&pipe->recs.head,head,__ATOMIC_RELEASE);
+            if((head - tail) == PIPE_NUM_RECS)
+            {
+                __atomic_store_n(&pipe->recs.head,head,__ATOMIC_RELEASE);
+                tail = wait_ring_room__(&pipe->recs,head,PIPE_NUM_RECS);
+            }
+            r = &pipe->rec[head % PIPE_NUM_RECS];
+            if(!ok)
+            {
+                r->kind = PIPE_REC_END;
+                ++head;
+                break;
+            }
+
+            r->chunk_ptr = cur->chunk_ptr;
+            r->chunk_size = cur->chunk_size;
+            r->run_cnt = 1;
+            r->sep = 0;
+            if(cur->new_arena && cur->arena_no)
+                r->sep = PIPE_SEP_ARENA;
+            else if(cur->new_segment && cur->seg_no)
+                r->sep = PIPE_SEP_SEGMENT;
+            if(cur->is_top)
+                r->kind = cur->in_use ? PIPE_REC_FENCE : PIPE_REC_TOP;
+            else
+                r->kind = cur->in_use ? PIPE_REC_USED : PIPE_REC_FREE;
+        }
+        __atomic_store_n(&pipe->recs.head,head,__ATOMIC_RELEASE);
+        pipe->walked = true;
+        st->bad_chunk_ptr = cur->bad_chunk_ptr;
+        close_footprint_pipe__(pipe);
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the total heap footprint:
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if defined(_WIN32) || defined(_WIN64)
+
+    void dump_heap_footprint()
+    {
+        size_t* heap_top_end = (size_t*) 0;
+        size_t* heap_top_chunk = (size_t*) 0;
+        size_t* heap_bottom_chunk = (size_t*) 0;
+
+        printf("\n");
+
+        _HEAPINFO hi;
+        hi._pentry = NULL; //initate _heapwalk()
+
+        size_t used_total = 0;
+        size_t free_total = 0;
+        #ifdef _DEBUG
+            size_t* mem_ptr = (size_t*) 0;
+        #endif
+        size_t* chunk_ptr = (size_t*) 0;
+        size_t heap_size = 0;
+        int heap_status = 0;
+        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+        {
+            chunk_ptr = (size_t*) ((char*) hi._pentry);
+            if(!heap_bottom_chunk || (heap_bottom_chunk > chunk_ptr))
+                heap_bottom_chunk = chunk_ptr;
+            if(heap_top_chunk < chunk_ptr)
+            {
+                heap_top_chunk = chunk_ptr;
+                heap_top_end = (size_t*) (((char*) heap_top_chunk) + hi._size);
+            }
+            heap_size += hi._size;
+
+            #ifdef _DEBUG
+                mem_ptr = (size_t*) (((char*) chunk_ptr) + DBG_HDR_SIZE);
+                printf(
+                    "%8p  mem: %8p  %10u bytes %s\n",
+                    chunk_ptr,
+                    mem_ptr,
+                    hi._size,
+                    hi._useflag == _USEDENTRY ? "USED" : "FREE");
+            #else
+                printf(
+                    "%8p   %10u bytes %s\n",
+                    chunk_ptr,
+                    hi._size,
+                    hi._useflag == _USEDENTRY ? "USED" : "FREE");
+            #endif
+            if(hi._useflag == _USEDENTRY)
+                used_total += hi._size;
+            else
+                free_total += hi._size;
+        }
+
+        switch(heap_status)
+        {
+            case _HEAPEMPTY:
+                printf("Heap is empty\n");
+                break;
             case _HEAPEND:
                 printf(
-                    "\n"
-                    "         +--------------------------+ STACK TOP\n"
-                    "         |          STACK           |\n"
-                    "         +---||------||-------||----+\n"
-                    "         |   \\/      \\/       \\/    |\n"
-                    "         |        Free Space        |\n"
-                    "         |   /\\      /\\       /\\    |\n"
-                    "%8p +---||------||-------||----+ HEAP TOP\n"
-                    "         |                          |\n"
-                    "         |          HEAP            |\n"
-                    "         | %10lu %s size       |\n"
-                    "         |                          |\n"
-                    "         | %10lu %s used       |\n"
-                    "         | %10lu %s free       |\n"
-                    "         |                          |\n"
-                    "%8p +--------------------------+ HEAP BOTTOM\n"
-                    "\n",
-                    heap_top_end,
-                    HUMAN_READABLE_MEM_SIZE__(heap_size),
-                    HUMAN_READABLE_MEM_UNIT_2__(heap_size),
-                    HUMAN_READABLE_MEM_SIZE__(used_total),
-                    HUMAN_READABLE_MEM_UNIT_2__(used_total),
-                    HUMAN_READABLE_MEM_SIZE__(free_total),
-                    HUMAN_READABLE_MEM_UNIT_2__(free_total),
-                    heap_bottom_chunk);
+                    "\n"
+                    "         +--------------------------+ STACK TOP\n"
+                    "         |          STACK           |\n"
+                    "         +---||------||-------||----+\n"
+                    "         |   \\/      \\/       \\/    |\n"
+                    "         |        Free Space        |\n"
+                    "         |   /\\      /\\       /\\    |\n"
+                    "%8p +---||------||-------||----+ HEAP TOP\n"
+                    "         |                          |\n"
+                    "         |          HEAP            |\n"
+                    "         | %10lu %s size       |\n"
+                    "         |                          |\n"
+                    "         | %10lu %s used       |\n"
+                    "         | %10lu %s free       |\n"
+                    "         |                          |\n"
+                    "%8p +--------------------------+ HEAP BOTTOM\n"
+                    "\n",
+                    heap_top_end,
+                    HUMAN_READABLE_MEM_SIZE__(heap_size),
+                    HUMAN_READABLE_MEM_UNIT_2__(heap_size),
+                    HUMAN_READABLE_MEM_SIZE__(used_total),
+                    HUMAN_READABLE_MEM_UNIT_2__(used_total),
+                    HUMAN_READABLE_MEM_SIZE__(free_total),
+                    HUMAN_READABLE_MEM_UNIT_2__(free_total),
+                    heap_bottom_chunk);
+                break;
+            case _HEAPBADPTR:
+                printf("ERROR - bad pointer to heap\n");
+                break;
+            case _HEAPBADBEGIN:
+                printf("ERROR - bad start of heap\n");
+                break;
+            case _HEAPBADNODE:
+                printf("ERROR - bad node in heap\n");
+                break;
+        }
+    }
+
+#else
+
+    //Print the heap totals as a picture:
+    static void print_heap_footprint_totals__(
+                                        size_t heap_size,
+                                        size_t used_total,
+                                        size_t free_total,
+                                        size_t* heap_bottom)
+    {
+        heap_printf(
+            "\n"
+            "                 +--------------------------+ STACK TOP\n"
+            "                 |          STACK           |\n"
+            "                 +---||------||-------||----+\n"
+            "                 |   \\/      \\/       \\/    |\n"
+            "                 |        Free Space        |\n"
+            "                 |   /\\      /\\       /\\    |\n"
+            "                 +---||------||-------||----+\n"
+            "                 |                          |\n"
+            "                 |          HEAP            |\n"
+            "                 | %10lu %s size       |\n"
+            "                 |                          |\n"
+            "                 | %10lu %s used       |\n"
+            "                 | %10lu %s free       |\n"
+            "                 |                          |\n"
+            "%16p +--------------------------+ HEAP BOTTOM\n"
+            "\n",
+            HUMAN_READABLE_MEM_SIZE__(heap_size),
+            HUMAN_READABLE_MEM_UNIT_2__(heap_size),
+            HUMAN_READABLE_MEM_SIZE__(used_total),
+            HUMAN_READABLE_MEM_UNIT_2__(used_total),
+            HUMAN_READABLE_MEM_SIZE__(free_total),
+            HUMAN_READABLE_MEM_UNIT_2__(free_total),
+            heap_bottom);
+    }
+
+    void set_heap_dump_compact(bool compact)
+    {
+        compact__ = compact;
+    }
+
+    //Print a chunk, or a run of run_cnt chunks of the same size and state:
+    static void print_heap_footprint_run__(
+                                   size_t* chunk_ptr,
+                                   size_t chunk_size,
+                                   bool in_use,
+                                   size_t run_cnt)
+    {
+        if(run_cnt > 1)
+        {
+            heap_printf(
+                "%14p  x%-18lu  %10lu bytes %s\n",
+                chunk_ptr,
+                run_cnt,
+                chunk_size,
+                in_use ? "USED" : "FREE");
+            return;
+        }
+        heap_printf(
+            "%14p  mem: %14p  %10lu bytes %s\n",
+            chunk_ptr,
+            get_mem_ptr(chunk_ptr),
+            chunk_size,
+            in_use ? "USED" : "FREE");
+    }
+
+    //Print the footprint of all chunks of an initialized cursor (the cursor
+    //is stepped by 'step', so the walk may as well read another process),
+    //return the number of chunks:
+    static size_t print_heap_footprint_walk__(
+                                   chunk_cursor_t* cur,
+                                   bool ok, //result of the cursor init
+                                   bool (*step)(chunk_cursor_t* cur),
+                                   size_t* heap_bottom,
+                                   heap_pipe_t* pipe) //open or NULL
+    {
+        size_t used_total = 0;
+        size_t free_total = 0;
+        size_t heap_size = 0;
+        size_t num_chunks = 0;
+        heap_printf("--------- MAIN ARENA: ---------\n\n");
+
+        size_table_t tab;
+        memset(&tab,0,sizeof(size_table_t));
+        size_table_t* sizes = size_stats__ ? &tab : (size_table_t*) 0;
+
+        heap_stats_t st;
+        if(pipe)
+        {
+            pipe_footprint_walk__(pipe,cur,ok,step,&st,sizes);
+            used_total = st.used_total;
+            free_total = st.free_total;
+            heap_size = st.heap_size;
+            num_chunks = st.num_chunks;
+            ok = false; //walked by the pipeline
+        }
+        size_t* run_ptr = (size_t*) 0; //run of chunks, not yet printed
+        size_t run_size = 0;
+        bool run_in_use = false;
+        size_t run_cnt = 0;
+        for(;ok;ok = step(cur))
+        {
+            bool fencepost = cur->is_top && cur->in_use; //no chunk
+            if(!fencepost)
+            {
+                heap_size += cur->chunk_size;
+                ++num_chunks;
+                if(cur->in_use)
+                    used_total += cur->chunk_size;
+                else
+                    free_total += cur->chunk_size;
+                if(sizes)
+                    add_size_table__(sizes,cur);
+            }
+
+            if(run_cnt && compact__ &&
+               !cur->new_arena && !cur->new_segment && !cur->is_top &&
+               (cur->chunk_size == run_size) && (cur->in_use == run_in_use))
+            {
+                ++run_cnt;
+                continue;
+            }
+            if(run_cnt)
+            {
+                print_heap_footprint_run__(
+                                    run_ptr,
+                                    run_size,
+                                    run_in_use,
+                                    run_cnt);
+            }
+            run_cnt = 0;
+
+            if(cur->new_arena && cur->arena_no)
+            {
+                heap_printf("\n");
+                heap_printf("--------- NEXT ARENA: ---------\n\n");
+            }
+            else if(cur->new_segment && cur->seg_no)
+            {
+                heap_printf("\n");
+            }
+
+            if(fencepost)
+            {
+                heap_printf(
+                    "%14p  * !FENCEPOST!      * %10lu bytes\n",
+                    cur->chunk_ptr,
+                    cur->chunk_size);
+                continue;
+            }
+            if(cur->is_top)
+            {
+                heap_printf(
+                    "%14p  * !HEAP TOP CHUNK! * %10lu bytes FREE\n",
+                    cur->chunk_ptr,
+                    cur->chunk_size);
+                continue;
+            }
+            run_ptr = cur->chunk_ptr;
+            run_size = cur->chunk_size;
+            run_in_use = cur->in_use;
+            run_cnt = 1;
+        }
+        if(run_cnt)
+            print_heap_footprint_run__(run_ptr,run_size,run_in_use,run_cnt);
+        if(cur->bad_chunk_ptr)
+        {
+            heap_printf("ERROR - bad chunk at %p\n",cur->bad_chunk_ptr);
+            free_size_table__(&tab);
+            return num_chunks;
+        }
+
+        print_heap_footprint_totals__(
+                                heap_size,
+                                used_total,
+                                free_total,
+                                heap_bottom);
+        if(sizes)
+            print_size_table__(sizes);
+        free_size_table__(&tab);
+        return num_chunks;
+    }
+
+    void dump_heap_footprint()
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return;
+        }
+
+        //The pipeline is started before the walk takes an arena lock:
+        heap_pipe_t pipe;
+        bool piped = pipelined__ && open_footprint_pipe__(&pipe);
+
+        //Walk all chunks, starting with the main arena:
+        chunk_cursor_t cur;
+        bool ok = false;
+        cursor_step_t step = step_chunk_cursor;
+        if(!begin_own_walk__(&cur,&ok,&step,!piped))
+        {
+            if(piped)
+                close_footprint_pipe__(&pipe);
+            return;
+        }
+        print_heap_footprint_walk__(
+                                &cur,
+                                ok,
+                                step,
+                                heap_bottom_chunk__,
+                                piped ? &pipe : (heap_pipe_t*) 0);
+        end_own_walk__(true);
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the heap footprint per arena, walked by a pool of threads:
+//-----------------------------------------------------------------------------
+// The heap segments are independent address ranges, so every (arena, heap
+// segment) pair is a work item of its own. A shared enumerator hands out the
+// items (under a mutex) to the walker threads, which count the chunks of the
+// heap segment into stack-local totals. These totals are merged into the
+// per-arena totals when the item is done. The per-arena table is mmapped,
+// since the number of arenas is not limited. After all threads are joined,
+// the arenas are printed and merged in the arena ring order, so the output
+// does not depend on the scheduling of the threads.
+//
+// The main heap is one large heap segment, so it is split into slices of
+// the same size, which are walked speculatively in parallel:
+//
+//   heap_bottom_chunk__                                             sbrk(0)
+//   |         slice 0        |        slice 1        |      slice 2       |
+//   +-----+----------+----+--+----+-----------+------+------+---------+---+
+//   |     |          |    |     | |           |      |  |   |         |top|
+//   +-----+----------+----+--+--|-+-----------+------+--|---+---------+---+
+//                       exit 0 -+- resync 1     exit 1 -+- resync 2
+//
+// Every slice but the first starts at its resync chunk, which is the first
+// address in the slice showing a plausible chain of chunk headers (aligned
+// size, no A|M flag, next chunk in range, P bit of the next chunk agreeing
+// with the prev_size field). Every slice walks until it reaches a chunk at
+// or behind its end, the exit chunk. Afterwards the slices are validated in
+// order: if the exit chunk of a slice isn't the resync chunk of the next
+// slice, the speculation failed and the next slice is walked once more
+// (sequentially) from the exit chunk, which is always a real chunk.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    //Maximum number of walker threads and cursors (lanes) per thread:
+    #define MAX_WALK_THREADS 256
+    #define MAX_WALK_LANES 64
+
+    //Slices of the main heap:
+    #define MAX_MAIN_SLICES 1024
+    #define MIN_MAIN_SLICE_SIZE (1024 * 1024) //bytes
+    #define RESYNC_CHAIN_LEN 4 //plausible chunk headers in a row
+
+    struct main_slice_t
+    {
+        size_t* start; //nominal start of the slice (aligned)
+        size_t* end; //nominal end of the slice (= start of the next slice)
+        size_t* resync_chunk; //first plausible chunk in the slice or NULL
+        size_t* exit_chunk; //first chunk at or behind end or NULL
+        heap_stats_t stats; //totals of the chunks in [resync, exit)
+    };
+
+    struct walk_pool_t
+    {
+        pthread_mutex_t mutex; //guards all fields below
+        size_t* main_heap_end; //sbrk(0), taken once per walk
+        gen_ar_t* ar_ptr; //arena to hand out heap segments of
+        size_t arena_no; //0 = main arena, 1 = next arena, ...
+        bool ar_started; //the arena's top heap segment was handed out
+        heap_bott_t* hb; //next (older) heap segment to hand out or NULL
+        size_t* top_chunk_ptr; //top chunk of hb (if known) or NULL
+        size_t num_arenas; //number of entries in arena_stats
+        heap_stats_t* arena_stats; //totals per arena (mmapped)
+        gen_ar_t** arena_ptrs; //arena pointers (mmapped)
+        chunk_sizes_t* arena_sizes; //size sketches per arena (mmapped) or
+                                    //NULL (see size_stats__)
+        chunk_sizes_t* slice_sizes; //size sketches per main heap slice
+        uint32 num_lanes; //cursors per walker thread
+        size_t num_slices; //slices of the main heap (0 = not sliced)
+        size_t next_slice; //next slice to hand out
+        main_slice_t slices[MAX_MAIN_SLICES];
+        pthread_barrier_t barrier; //all walker threads incl. the caller
+    };
+
+    struct walk_item_t
+    {
+        size_t* bottom_chunk; //bottom chunk of the heap segment
+        gen_ar_t* ar_ptr;
+        size_t arena_no;
+        main_slice_t* slice; //slice of the main heap or NULL
+    };
+
+    struct walk_lane_t //a cursor walking one item (on the stack)
+    {
+        chunk_cursor_t cur;
+        walk_item_t item;
+        heap_stats_t stats; //totals of the item so far
+        chunk_sizes_t sizes; //size sketches of the item so far
+        bool with_sizes; //the pool has size sketches
+        bool ok; //lane is walking an item
+    };
+
+    //Get the next (arena, heap segment) pair (call with locked mutex):
+    static bool get_next_walk_item__(walk_pool_t* pool,walk_item_t* item)
+    {
+        //Hand out the slices of the main heap first (largest work items):
+        if(pool->next_slice < pool->num_slices)
+        {
+            item->slice = &pool->slices[pool->next_slice++];
+            item->bottom_chunk = item->slice->start;
+            item->ar_ptr = main_arena_ptr__;
+            item->arena_no = 0;
+            return true;
+        }
+        item->slice = (main_slice_t*) 0;
+
+        for(;pool->ar_ptr && (pool->arena_no < pool->num_arenas);)
+        {
+            //Start with the heap segment holding the arena's top chunk:
+            if(!pool->ar_started)
+            {
+                pool->ar_started = true;
+                pool->hb = (heap_bott_t*) 0;
+                pool->top_chunk_ptr = pool->ar_ptr->addr[top_idx__];
+                if(pool->top_chunk_ptr &&
+                   ((pool->ar_ptr == main_arena_ptr__) || //no heap segments
+                    (pool->top_chunk_ptr < pool->main_heap_end)))
+                {
+                    if(pool->num_slices)
+                        continue; //main heap was handed out in slices
+                    item->bottom_chunk = heap_bottom_chunk__;
+                    item->ar_ptr = pool->ar_ptr;
+                    item->arena_no = pool->arena_no;
+                    return true;
+                }
+                if(pool->top_chunk_ptr)
+                {
+                    pool->hb = get_start_of_allocated_heap_segment(
+                                                        pool->top_chunk_ptr);
+                }
+            }
+
+            //Go on with the older heap segments of the arena:
+            if(pool->hb)
+            {
+                heap_bott_t* hb = pool->hb;
+                size_t* bottom =
+                          get_segment_bottom_chunk__(hb,pool->top_chunk_ptr);
+                pool->top_chunk_ptr = (size_t*) 0;
+                pool->hb = (hb->prev && (hb->prev->ar_ptr == hb->ar_ptr)) ?
+                                                hb->prev : (heap_bott_t*) 0;
+                if(bottom)
+                {
+                    item->bottom_chunk = bottom;
+                    item->ar_ptr = pool->ar_ptr;
+                    item->arena_no = pool->arena_no;
+                    return true;
+                }
+                continue;
+            }
+
+            //Go on with the next arena:
+            pool->ar_ptr = (gen_ar_t*) get_next_arena((size_t*) pool->ar_ptr);
+            pool->ar_started = false;
+            ++pool->arena_no;
+        }
+        return false;
+    }
+
+    //Test if a main heap chunk header looks valid (A and M flag not set,
+    //aligned size, next chunk in range and agreeing with a free chunk):
+    static bool is_plausible_main_chunk__(size_t* chunk_ptr,size_t* heap_end)
+    {
+        size_t size_field = ((chunk_t*) chunk_ptr)->size;
+        size_t chunk_size = (size_t) (size_field & ~FLAGS_MASK);
+        if((size_field & (A__ | M__)) ||
+           (chunk_size < MINSIZE) ||
+           (chunk_size & MALLOC_ALIGN_MASK))
+        {
+            return false;
+        }
+        size_t* next = (size_t*) (((char*) chunk_ptr) + chunk_size);
+        if(next == heap_end)
+            return true; //top chunk
+        if((next + 2) > heap_end)
+            return false;
+        size_t next_size_field = ((chunk_t*) next)->size;
+        if(next_size_field & (A__ | M__))
+            return false;
+        if(!(next_size_field & P__)) //chunk is free ---> footer is set
+            return ((chunk_t*) next)->overhead == chunk_size;
+        return true;
+    }
+
+    //Find the first address of a slice starting a plausible chunk chain:
+    static size_t* find_resync_chunk__(main_slice_t* slice,size_t* heap_end)
+    {
+        size_t* candidate = slice->start;
+        for(;candidate < slice->end;candidate += 2)
+        {
+            size_t* p = candidate;
+            uint32 i = 0;
+            for(;i < RESYNC_CHAIN_LEN;++i)
+            {
+                if(!is_plausible_main_chunk__(p,heap_end))
+                    break;
+                p = (size_t*) (((char*) p) +
+                                (((chunk_t*) p)->size & ~FLAGS_MASK));
+                if(p == heap_end)
+                {
+                    i = RESYNC_CHAIN_LEN; //chain ends at the top chunk
+                    break;
+                }
+            }
+            if(i == RESYNC_CHAIN_LEN)
+                return candidate;
+        }
+        return (size_t*) 0;
+    }
+
+    //Get the size sketches of a main heap slice (NULL if not sketched):
+    static chunk_sizes_t* get_slice_sizes__(
+                                walk_pool_t* pool,
+                                main_slice_t* slice)
+    {
+        if(!pool->slice_sizes)
+            return (chunk_sizes_t*) 0;
+        return &pool->slice_sizes[slice - pool->slices];
+    }
+
+    //Count the chunks of the main heap from a chunk up to the end address:
+    static void walk_main_range__(
+                                walk_pool_t* pool,
+                                size_t* chunk_ptr,
+                                main_slice_t* slice)
+    {
+        memset(&slice->stats,0,sizeof(heap_stats_t));
+        slice->exit_chunk = (size_t*) 0;
+        chunk_sizes_t* sizes = get_slice_sizes__(pool,slice);
+        if(sizes)
+            memset(sizes,0,sizeof(chunk_sizes_t));
+
+        chunk_cursor_t cur;
+        bool ok = init_segment_cursor__(
+                                    &cur,
+                                    chunk_ptr,
+                                    main_arena_ptr__,
+                                    pool->main_heap_end);
+        for(;ok;ok = step_chunk_cursor(&cur))
+        {
+            if(cur.chunk_ptr >= slice->end)
+            {
+                slice->exit_chunk = cur.chunk_ptr;
+                return;
+            }
+            ++slice->stats.num_chunks;
+            slice->stats.heap_size += cur.chunk_size;
+            if(cur.in_use)
+                slice->stats.used_total += cur.chunk_size;
+            else
+                slice->stats.free_total += cur.chunk_size;
+            if(sizes)
+                add_chunk_size(sizes,cur.chunk_size,cur.in_use);
+            if(cur.is_top)
+                break; //end of the main heap
+        }
+        slice->stats.bad_chunk_ptr = cur.bad_chunk_ptr;
+    }
+
+    //Validate the slices in order and merge them (after all items):
+    static size_t merge_main_slices__(walk_pool_t* pool,heap_stats_t* stats)
+    {
+        size_t num_rewalked = 0;
+        size_t* exit_chunk = heap_bottom_chunk__;
+        size_t i = 0;
+        for(;(i < pool->num_slices) && exit_chunk;++i)
+        {
+            main_slice_t* slice = &pool->slices[i];
+            if(slice->resync_chunk != exit_chunk)
+            {
+                //Speculation failed ---> walk again from the real chunk:
+                walk_main_range__(pool,exit_chunk,slice);
+                ++num_rewalked;
+            }
+            slice->stats.num_segments = i ? 0 : 1;
+            merge_heap_stats(stats,&slice->stats);
+            if(pool->slice_sizes)
+            {
+                merge_chunk_sizes(
+                            &pool->arena_sizes[0],
+                            &pool->slice_sizes[i]);
+            }
+            exit_chunk = slice->exit_chunk; //NULL after top or bad chunk
+        }
+        return num_rewalked;
+    }
+
+    //Count the chunk of a lane and step ahead, false at the item's end:
+    static bool step_walk_lane__(walk_lane_t* lane)
+    {
+        chunk_cursor_t* cur = &lane->cur;
+        main_slice_t* slice = lane->item.slice;
+        if(slice && (cur->chunk_ptr >= slice->end))
+        {
+            slice->exit_chunk = cur->chunk_ptr;
+            return false;
+        }
+
+        if(cur->is_top && cur->in_use)
+            return false; //fencepost (no chunk), end of the heap segment
+        ++lane->stats.num_chunks;
+        lane->stats.heap_size += cur->chunk_size;
+        if(cur->in_use)
+            lane->stats.used_total += cur->chunk_size;
+        else
+            lane->stats.free_total += cur->chunk_size;
+        if(lane->with_sizes)
+            add_chunk_size(&lane->sizes,cur->chunk_size,cur->in_use);
+        if(cur->is_top || !step_chunk_cursor(cur))
+            return false; //end of the heap segment or bad chunk
+
+        //The header of the next chunk was read with the current one, so
+        //the header behind it is known and is fetched while the other
+        //lanes are stepped:
+        #ifdef __GNUC__
+            if(!cur->is_top)
+            {
+                size_t* next = cur->next_chunk_ptr;
+                __builtin_prefetch(
+                            ((char*) next) +
+                            (((chunk_t*) next)->size & ~FLAGS_MASK));
+            }
+        #endif
+        return true;
+    }
+
+    //Store the totals of the item a lane has finished:
+    static void finish_walk_lane__(walk_pool_t* pool,walk_lane_t* lane)
+    {
+        lane->ok = false;
+        lane->stats.bad_chunk_ptr = lane->cur.bad_chunk_ptr;
+        if(lane->item.slice)
+        {
+            lane->item.slice->stats = lane->stats; //merged after all items
+            if(lane->with_sizes)
+                *get_slice_sizes__(pool,lane->item.slice) = lane->sizes;
+            return;
+        }
+        pthread_mutex_lock(&pool->mutex);
+        merge_heap_stats(&pool->arena_stats[lane->item.arena_no],&lane->stats);
+        if(lane->with_sizes)
+        {
+            merge_chunk_sizes(
+                        &pool->arena_sizes[lane->item.arena_no],
+                        &lane->sizes);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    //Start the next item on a lane, false if there are no items left:
+    static bool start_walk_lane__(walk_pool_t* pool,walk_lane_t* lane)
+    {
+        for(;;)
+        {
+            pthread_mutex_lock(&pool->mutex);
+            bool got_item = get_next_walk_item__(pool,&lane->item);
+            pthread_mutex_unlock(&pool->mutex);
+            if(!got_item)
+                break;
+
+            memset(&lane->stats,0,sizeof(heap_stats_t));
+            lane->with_sizes = pool->arena_sizes ? true : false;
+            if(lane->with_sizes)
+                memset(&lane->sizes,0,sizeof(chunk_sizes_t));
+            size_t* start_chunk = lane->item.bottom_chunk;
+            main_slice_t* slice = lane->item.slice;
+            if(slice)
+            {
+                //Walk a slice of the main heap speculatively:
+                if(slice->start != heap_bottom_chunk__)
+                {
+                    start_chunk =
+                            find_resync_chunk__(slice,pool->main_heap_end);
+                }
+                slice->resync_chunk = start_chunk;
+                slice->exit_chunk = (size_t*) 0;
+                memset(&slice->stats,0,sizeof(heap_stats_t));
+                if(lane->with_sizes)
+                {
+                    memset(
+                        get_slice_sizes__(pool,slice),
+                        0,
+                        sizeof(chunk_sizes_t));
+                }
+                if(!start_chunk)
+                    continue; //validated after all items
+            }
+            else
+            {
+                lane->stats.num_segments = 1;
+            }
+
+            lane->ok = init_segment_cursor__(
+                                        &lane->cur,
+                                        start_chunk,
+                                        lane->item.ar_ptr,
+                                        pool->main_heap_end);
+            if(lane->ok)
+                return true;
+            finish_walk_lane__(pool,lane); //bad chunk at the start
+        }
+        lane->ok = false;
+        return false;
+    }
+
+    //Walk the items handed out by the pool until all are done, using
+    //several cursors (lanes) in round robin, so the cache misses of the
+    //lanes overlap instead of following each other:
+    static void run_walk_items__(walk_pool_t* pool,uint32 num_lanes)
+    {
+        if(!num_lanes)
+            num_lanes = 1;
+        if(num_lanes > MAX_WALK_LANES)
+            num_lanes = MAX_WALK_LANES;
+
+        walk_lane_t lanes[MAX_WALK_LANES];
+        uint32 num_active = 0;
+        uint32 i = 0;
+        for(;i < num_lanes;++i)
+        {
+            if(start_walk_lane__(pool,&lanes[i]))
+                ++num_active;
+        }
+
+        for(;num_active;)
+        {
+            for(i = 0;i < num_lanes;++i)
+            {
+                walk_lane_t* lane = &lanes[i];
+                if(!lane->ok || step_walk_lane__(lane))
+                    continue;
+                finish_walk_lane__(pool,lane);
+                if(!start_walk_lane__(pool,lane))
+                    --num_active;
+            }
+        }
+    }
+
+    static void* walk_pool_thread__(void* pool_ptr)
+    {
+        walk_pool_t* pool = (walk_pool_t*) pool_ptr;
+        run_walk_items__(pool,pool->num_lanes);
+
+        //Keep the thread alive until the main heap slices are merged, since
+        //the exit of a thread frees heap memory (e.g. its thread local
+        //storage), which would change the heap while it's walked:
+        pthread_barrier_wait(&pool->barrier); //all items are walked
+        pthread_barrier_wait(&pool->barrier); //main heap slices are merged
+        return (void*) 0;
+    }
+
+    //Split the main heap into slices (one per lane, if large enough):
+    static void slice_main_heap__(walk_pool_t* pool,size_t max_num_slices)
+    {
+        size_t heap_size = (size_t) (((char*) pool->main_heap_end) -
+                                     ((char*) heap_bottom_chunk__));
+        size_t num_slices = heap_size / MIN_MAIN_SLICE_SIZE;
+        if(num_slices > max_num_slices)
+            num_slices = max_num_slices;
+        if(num_slices > MAX_MAIN_SLICES)
+            num_slices = MAX_MAIN_SLICES;
+        if(num_slices < 2)
+            return; //walk the main heap in one piece
+
+        size_t slice_size = (heap_size / num_slices) & ~MALLOC_ALIGN_MASK;
+        size_t i = 0;
+        for(;i < num_slices;++i)
+        {
+            main_slice_t* slice = &pool->slices[i];
+            slice->start = (size_t*)
+                            (((char*) heap_bottom_chunk__) + i * slice_size);
+            slice->end = (size_t*) (((char*) slice->start) + slice_size);
+        }
+        pool->slices[num_slices - 1].end = pool->main_heap_end;
+        pool->num_slices = num_slices;
+    }
+
+    void dump_heap_footprint_parallel(uint32 num_threads,uint32 num_lanes)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__ || !main_arena_ptr__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return;
+        }
+        if(!num_threads)
+            num_threads = 1;
+        if(num_threads > MAX_WALK_THREADS)
+            num_threads = MAX_WALK_THREADS;
+        if(!num_lanes)
+            num_lanes = 1;
+        if(num_lanes > MAX_WALK_LANES)
+            num_lanes = MAX_WALK_LANES;
+
+        //Count the arenas:
+        size_t num_arenas = 0;
+        size_t* ar_ptr = (size_t*) main_arena_ptr__;
+        for(;ar_ptr;ar_ptr = get_next_arena(ar_ptr))
+            ++num_arenas;
+
+        //Map the per-arena table (not on the heap, which is walked):
+        size_t table_size =
+                    num_arenas * (sizeof(heap_stats_t) + sizeof(gen_ar_t*));
+        void* table = mmap(
+                        (void*) 0,
+                        table_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+        if(table == MAP_FAILED)
+        {
+            heap_printf("ERROR - cannot map the arena table (%lu arenas)\n",
+                        num_arenas);
+            return;
+        }
+
+        walk_pool_t pool;
+        memset(&pool,0,sizeof(walk_pool_t));
+        pthread_mutex_init(&pool.mutex,(pthread_mutexattr_t*) 0);
+        pool.ar_ptr = main_arena_ptr__;
+        pool.num_lanes = num_lanes;
+        pool.num_arenas = num_arenas;
+        pool.arena_stats = (heap_stats_t*) table;
+        pool.arena_ptrs = (gen_ar_t**) (pool.arena_stats + num_arenas);
+
+        size_t i = 0;
+        ar_ptr = (size_t*) main_arena_ptr__;
+        for(;ar_ptr && (i < num_arenas);ar_ptr = get_next_arena(ar_ptr))
+            pool.arena_ptrs[i++] = (gen_ar_t*) ar_ptr;
+        size_t max_num_slices = (size_t) num_threads * num_lanes;
+        if(max_num_slices > MAX_MAIN_SLICES)
+            max_num_slices = MAX_MAIN_SLICES;
+
+        //Map the size sketches per arena and per main heap slice (room for
+        //all slices, the main heap is sliced when the threads exist):
+        size_t sizes_size = 0;
+        if(size_stats__)
+        {
+            sizes_size =
+                    (num_arenas + max_num_slices) * sizeof(chunk_sizes_t);
+            void* sizes = mmap(
+                            (void*) 0,
+                            sizes_size,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+            if(sizes == MAP_FAILED)
+            {
+                heap_printf("ERROR - cannot map the chunk size table\n");
+                pthread_mutex_destroy(&pool.mutex);
+                munmap(table,table_size);
+                return;
+            }
+            pool.arena_sizes = (chunk_sizes_t*) sizes;
+            pool.slice_sizes = pool.arena_sizes + num_arenas;
+        }
+
+        //Run the walker threads (the calling thread is one of them), the
+        //walk starts when all threads exist, since pthread_create() itself
+        //may allocate heap memory (e.g. for the thread local storage), which
+        //may move the main heap's top above the sbrk(0) taken before. So
+        //sbrk(0) is taken and the main heap is sliced behind the creation,
+        //before the threads get the mutex to take their first item:
+        pthread_t threads[MAX_WALK_THREADS];
+        uint32 num_started = 0;
+        pthread_mutex_lock(&pool.mutex);
+        for(;(num_started + 1) < num_threads;++num_started)
+        {
+            if(pthread_create(
+                        &threads[num_started],
+                        (pthread_attr_t*) 0,
+                        walk_pool_thread__,
+                        &pool))
+            {
+                break;
+            }
+        }
+        pool.main_heap_end = (size_t*) sbrk(0); //once per walk
+        slice_main_heap__(&pool,max_num_slices);
+        pthread_barrier_init(
+                        &pool.barrier,
+                        (pthread_barrierattr_t*) 0,
+                        num_started + 1);
+        pthread_mutex_unlock(&pool.mutex);
+        run_walk_items__(&pool,num_lanes);
+        pthread_barrier_wait(&pool.barrier); //all items are walked
+        size_t num_rewalked = 0;
+        if(pool.num_slices)
+            num_rewalked = merge_main_slices__(&pool,&pool.arena_stats[0]);
+        pthread_barrier_wait(&pool.barrier); //main heap slices are merged
+        uint32 t = 0;
+        for(;t < num_started;++t)
+            pthread_join(threads[t],(void**) 0);
+        pthread_barrier_destroy(&pool.barrier);
+        pthread_mutex_destroy(&pool.mutex);
+
+        //Print and merge the totals in the arena ring order:
+        heap_stats_t total;
+        memset(&total,0,sizeof(heap_stats_t));
+        for(i = 0;i < num_arenas;++i)
+        {
+            heap_stats_t* stats = &pool.arena_stats[i];
+            heap_printf(
+                "%s ARENA %4lu at %14p: %4lu heaps %10lu chunks "
+                "%10lu %s size %10lu %s used %10lu %s free\n",
+                i ? "ALLOCATED" : "     MAIN",
+                i,
+                pool.arena_ptrs[i],
+                stats->num_segments,
+                stats->num_chunks,
+                HUMAN_READABLE_MEM_SIZE__(stats->heap_size),
+                HUMAN_READABLE_MEM_UNIT_2__(stats->heap_size),
+                HUMAN_READABLE_MEM_SIZE__(stats->used_total),
+                HUMAN_READABLE_MEM_UNIT_2__(stats->used_total),
+                HUMAN_READABLE_MEM_SIZE__(stats->free_total),
+                HUMAN_READABLE_MEM_UNIT_2__(stats->free_total));
+            merge_heap_stats(&total,stats);
+        }
+        munmap(table,table_size);
+
+        heap_printf(
+            "\n"
+            "%lu arenas, %lu heaps, %lu chunks (walked by %u threads)\n",
+            num_arenas,
+            total.num_segments,
+            total.num_chunks,
+            num_started + 1);
+        if(pool.num_slices)
+        {
+            heap_printf(
+                "main heap walked in %lu slices (%lu re-walked)\n",
+                pool.num_slices,
+                num_rewalked);
+        }
+        if(total.bad_chunk_ptr)
+        {
+            heap_printf("ERROR - bad chunk at %p\n",total.bad_chunk_ptr);
+            if(pool.arena_sizes)
+                munmap(pool.arena_sizes,sizes_size);
+            return;
+        }
+
+        print_heap_footprint_totals__(
+                                total.heap_size,
+                                total.used_total,
+                                total.free_total,
+                                heap_bottom_chunk__);
+        if(pool.arena_sizes)
+        {
+            print_all_arena_sizes__(pool.arena_sizes,num_arenas);
+            munmap(pool.arena_sizes,sizes_size);
+        }
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Benchmark the heap walk:
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    //Get a monotonic time stamp in seconds:
+    static double get_time_sec__()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        return (double) ts.tv_sec + ((double) ts.tv_nsec) / 1000000000.0;
+    }
+
+    //Walk the main heap with the single chunk accessors (reference):
+    static size_t walk_main_heap_by_accessors__(size_t* used_total)
+    {
+        size_t num_chunks = 0;
+        size_t chunk_size = 0;
+        size_t* chunk_ptr = heap_bottom_chunk__;
+        for(;chunk_ptr;)
+        {
+            chunk_size = get_chunk_size(chunk_ptr);
+            if(!chunk_size)
+                break;
+            ++num_chunks;
+            if(is_top_chunk(chunk_ptr))
+                break;
+            if(is_in_use(chunk_ptr))
+                *used_total += chunk_size;
+            chunk_ptr = get_next_chunk(chunk_ptr);
+        }
+        return num_chunks;
+    }
+
+    //Walk the main heap with interleaved cursors (lanes) over its slices:
+    static size_t walk_main_heap_interleaved__(
+                                            uint32 num_lanes,
+                                            size_t* used_total)
+    {
+        heap_stats_t stats;
+        memset(&stats,0,sizeof(heap_stats_t));
+        gen_ar_t* ar_ptr = main_arena_ptr__;
+
+        walk_pool_t pool;
+        memset(&pool,0,sizeof(walk_pool_t));
+        pthread_mutex_init(&pool.mutex,(pthread_mutexattr_t*) 0);
+        pool.main_heap_end = (size_t*) sbrk(0); //once per walk
+        pool.ar_ptr = main_arena_ptr__;
+        pool.num_lanes = num_lanes;
+        pool.num_arenas = 1; //just the main arena
+        pool.arena_stats = &stats;
+        pool.arena_ptrs = &ar_ptr;
+        slice_main_heap__(&pool,num_lanes);
+
+        run_walk_items__(&pool,num_lanes);
+        if(pool.num_slices)
+            merge_main_slices__(&pool,&stats);
+        pthread_mutex_destroy(&pool.mutex);
+
+        *used_total += stats.used_total;
+        return stats.num_chunks;
+    }
+
+    //Walk the main heap with the chunk cursor (fused decoder):
+    static size_t walk_main_heap_by_cursor__(size_t* used_total)
+    {
+        size_t num_chunks = 0;
+        chunk_cursor_t cur;
+        bool ok = init_chunk_cursor(&cur,heap_bottom_chunk__);
+        for(;ok;ok = step_chunk_cursor(&cur))
+        {
+            ++num_chunks;
+            if(cur.is_top)
+                break;
+            if(cur.in_use)
+                *used_total += cur.chunk_size;
+        }
+        return num_chunks;
+    }
+
+    void bench_heap_walk(uint32 num_loops,uint32 num_lanes)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return;
+        }
+        if(!num_loops)
+            num_loops = 1;
+        if(!num_lanes)
+            num_lanes = 1;
+        if(num_lanes > MAX_WALK_LANES)
+            num_lanes = MAX_WALK_LANES;
+
+        size_t num_chunks = 0;
+        size_t used_ref = 0;
+        size_t used_fused = 0;
+        size_t used_lanes = 0;
+        uint32 i = 0;
+
+        double t0 = get_time_sec__();
+        for(i = 0;i < num_loops;++i)
+            num_chunks = walk_main_heap_by_accessors__(&used_ref);
+        double t_ref = get_time_sec__() - t0;
+
+        t0 = get_time_sec__();
+        for(i = 0;i < num_loops;++i)
+            walk_main_heap_by_cursor__(&used_fused);
+        double t_fused = get_time_sec__() - t0;
+
+        t0 = get_time_sec__();
+        for(i = 0;i < num_loops;++i)
+            walk_main_heap_interleaved__(num_lanes,&used_lanes);
+        double t_lanes = get_time_sec__() - t0;
+
+        double n = (double) num_chunks * (double) num_loops;
+        double cps_ref = t_ref > 0.0 ? n / t_ref : 0.0;
+        double cps_fused = t_fused > 0.0 ? n / t_fused : 0.0;
+        double cps_lanes = t_lanes > 0.0 ? n / t_lanes : 0.0;
+        heap_printf(
+            "HEAP WALK BENCHMARK (main heap, %lu chunks, %u loops):\n"
+            "\n"
+            "   accessor walk ....: %14.0lf chunks/s\n"
+            "   fused cursor .....: %14.0lf chunks/s (x %.2lf)%s\n"
+            "   %2u interleaved ...: %14.0lf chunks/s (x %.2lf)%s\n"
+            "\n",
+            num_chunks,
+            num_loops,
+            cps_ref,
+            cps_fused,
+            cps_ref > 0.0 ? cps_fused / cps_ref : 0.0,
+            used_ref == used_fused ? "" : " RESULT MISMATCH!",
+            num_lanes,
+            cps_lanes,
+            cps_ref > 0.0 ? cps_lanes / cps_ref : 0.0,
+            used_ref == used_lanes ? "" : " RESULT MISMATCH!");
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump heap details for debugging:
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if defined(_WIN32) || defined(_WIN64)
+
+    void dump_heap_details(
+                    size_t* /* start_chunk */,
+                    size_t* /* heap_top_end */) //first invalid address
+    {
+        _HEAPINFO hi;
+        hi._pentry = NULL; //initate _heapwalk()
+
+        size_t* chunk_ptr = (size_t*) 0;
+        int heap_status = 0;
+        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+        {
+            chunk_ptr = (size_t*) ((char*) hi._pentry);
+            dump_chunk(chunk_ptr,hi._size);
+        }
+        printf("\n");
+    }
+
+#else
+
+    void dump_heap_details(
+                    size_t* start_chunk,
+                    size_t* heap_top_end) //first invalid address
+    {
+        sink_flush_t flush_at_return;
+        if(!start_chunk)
+        {
+            heap_printf("ERROR - start_chunk address is missing\n");
+            return;
+        }
+        if(!heap_top_end)
+        {
+            heap_printf("ERROR - heap top address is missing\n");
+            return;
+        }
+        if(start_chunk >= heap_top_end)
+        {
+            heap_printf("ERROR - start chunk address is too big\n");
+            return;
+        }
+
+        //Walk all chunks, starting with the arena of the start chunk:
+        chunk_cursor_t cur;
+        bool ok = init_chunk_cursor(&cur,start_chunk);
+        for(;ok;ok = step_chunk_cursor(&cur))
+        {
+            if(cur.new_segment)
+            {
+                if(cur.arena_no || cur.seg_no)
+                {
+                    heap_top_end = cur.seg_end;
+                    heap_printf("\n");
+                }
+                if(!cur.hb)
+                {
+                    heap_printf(
+                        "--------- MAIN ARENA at %p:\n\n",
+                        main_arena_ptr__);
+                    heap_printf(
+                        "          HEAP at %p:\n\n",
+                        heap_bottom_chunk__);
+                }
+                else
+                {
+                    if(cur.new_arena)
+                    {
+                        heap_printf(
+                            "--------- ALLOCATED ARENA at %p:\n\n",
+                            cur.ar_ptr);
+                    }
+                    heap_printf("          HEAP at %p:\n\n",(size_t*) cur.hb);
+                    dump_heap_info(cur.chunk_ptr);
+                }
+            }
+
+            if(cur.chunk_ptr >= heap_top_end)
+                break;
+
+            //Zero sized fencepost at the end of an older heap segment:
+            if(cur.is_top && cur.in_use)
+            {
+                heap_printf(
+                    "%14p +-----------------------------------\n"
+                    "               | FENCEPOST (end of heap segment)\n"
+                    "               +-----------------------------------\n",
+                    cur.chunk_ptr);
+                continue;
+            }
+
+            dump_chunk(cur.chunk_ptr);
+        }
+        if(cur.bad_chunk_ptr)
+        {
+            heap_printf("ERROR - bad chunk at %p\n",cur.bad_chunk_ptr);
+            return;
+        }
+        heap_printf("\n");
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// HEX dump of the heap:
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if defined(_WIN32) || defined(_WIN64)
+
+    void dump_heap_hex(
+                    size_t* /* start_chunk */,
+                    size_t* /* heap_top_end */, //first invalid address
+                    uint32 max_kb)
+    {
+        _HEAPINFO hi;
+        hi._pentry = NULL; //initate _heapwalk()
+
+        size_t max_bytes = max_kb * 1024; //KB ---> bytes
+        size_t output_cnt = 0;
+
+        char* ptr = (char*) 0;
+        size_t* this_chunk_top = (size_t*) 0;
+        int heap_status = 0;
+        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+        {
+            ptr = (char*) hi._pentry;
+            this_chunk_top = (size_t*) (ptr + hi._size);
+
+            for(;((size_t*) ptr) < this_chunk_top;ptr += 8)
+            {
+                printf(
+                    "%02X %02X %02X %02X   %02X %02X %02X %02X | "
+                    "%c%c%c%c %c%c%c%c %12p ... %12p\n",
+                    (unsigned char) ptr[0],
+                    (unsigned char) ptr[1],
+                    (unsigned char) ptr[2],
+                    (unsigned char) ptr[3],
+                    (unsigned char) ptr[4],
+                    (unsigned char) ptr[5],
+                    (unsigned char) ptr[6],
+                    (unsigned char) ptr[7],
+                    human_readable__(ptr[0]),
+                    human_readable__(ptr[1]),
+                    human_readable__(ptr[2]),
+                    human_readable__(ptr[3]),
+                    human_readable__(ptr[4]),
+                    human_readable__(ptr[5]),
+                    human_readable__(ptr[6]),
+                    human_readable__(ptr[7]),
+                    &ptr[0],
+                    &ptr[7]);
+            }
+
+            if(max_bytes)
+            {
+                output_cnt += hi._size;
+                if(output_cnt >= max_bytes)
+                {
+                    printf("\n");
+                    printf(">>> INTERRUPTED after %u KB <<<\n",max_kb);
+                    break;
+                }
+            }
+        }
+        if(output_cnt < max_bytes)
+        {
+            printf("\n");
+            if(output_cnt < (100 * 1024))
+            {
+                printf(
+                    "TOTAL: %5.3lf KB\n",
+                    (double) (((double) output_cnt)/1024.0));
+            }
+            else
+            {
+                printf("TOTAL: %lu KB\n",output_cnt/1024);
+            }
+        }
+        printf("\n");
+    }
+
+#else
+
+    #define HEX_OUT_BUF_SIZE (64 * 1024) //output buffer (on the stack)
+    #define HEX_LINE_MAX 128 //longest line of the dump
+    #define HEX_ZERO_BLOCK 64 //bytes tested for zero at once
+
+    //State of a HEX dump (runs of zero words are collapsed):
+    struct hex_dump_t
+    {
+        size_t max_bytes; //output limit or 0
+        size_t output_cnt; //bytes dumped so far
+        size_t zero_word_cnt; //zero words in a row
+        uint32 max_kb;
+        heap_sink_t* sink; //output or NULL (lines are kept in out)
+        char* out; //formatted lines, not yet written
+        size_t out_size; //size of out
+        size_t out_len; //bytes in out
+    };
+
+    //Lookup tables, filled once:
+    static char hex_pairs__[256][2]; //"00" ... "FF"
+    static char hex_ascii__[256]; //human_readable__() of every byte
+    static bool (*is_zero_block__)(const char* p) = 0; //HEX_ZERO_BLOCK
+
+    #define RESIDENT_MAP_PAGES 256 //pages asked by one mincore() call
+
+    void set_heap_dump_resident_only(bool resident_only)
+    {
+        resident_only__ = resident_only;
+    }
+
+    //Residency of a window of pages, filled by mincore():
+    struct resident_map_t
+    {
+        size_t first_page; //address of the first page
+        size_t num_pages; //0 = empty
+        unsigned char vec[RESIDENT_MAP_PAGES];
+    };
+
+    static bool is_page_resident__(resident_map_t* rm,const char* addr)
+    {
+        size_t page = ((size_t) addr) & ~(PAGE - 1);
+        if(!rm->num_pages ||
+           (page < rm->first_page) ||
+           (page >= (rm->first_page + rm->num_pages * PAGE)))
+        {
+            //A window reaching behind the mapping fails with ENOMEM:
+            rm->first_page = page;
+            rm->num_pages = RESIDENT_MAP_PAGES;
+            while(mincore((void*) page,rm->num_pages * PAGE,rm->vec))
+            {
+                rm->num_pages /= 2;
+                if(!rm->num_pages)
+                    return true; //unknown ---> read it
+            }
+        }
+        return (rm->vec[(page - rm->first_page) / PAGE] & 1) ? true : false;
+    }
+
+    //Get the end of the run of pages at addr having the same residency:
+    static char* get_resident_run_end__(
+                                    resident_map_t* rm,
+                                    char* addr,
+                                    char* end,
+                                    bool* resident)
+    {
+        *resident = is_page_resident__(rm,addr);
+        char* p = (char*) ((((size_t) addr) & ~(PAGE - 1)) + PAGE);
+        for(;(p < end) && (is_page_resident__(rm,p) == *resident);p += PAGE)
+            ;
+        return (p < end) ? p : end;
+    }
+
+    //Test HEX_ZERO_BLOCK bytes for zero (as many words at once as the CPU
+    //can compare):
+    #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        __attribute__((target("avx2")))
+        static bool is_zero_block_avx2__(const char* p)
+        {
+            __m256i v = _mm256_or_si256(
+                            _mm256_loadu_si256((const __m256i*) p),
+                            _mm256_loadu_si256((const __m256i*) (p + 32)));
+            return _mm256_testz_si256(v,v) ? true : false;
+        }
+    #endif
+
+    #if defined(__SSE2__)
+        static bool is_zero_block_sse2__(const char* p)
+        {
+            __m128i v = _mm_or_si128(
+                            _mm_or_si128(
+                                _mm_loadu_si128((const __m128i*) p),
+                                _mm_loadu_si128((const __m128i*) (p + 16))),
+                            _mm_or_si128(
+                                _mm_loadu_si128((const __m128i*) (p + 32)),
+                                _mm_loadu_si128((const __m128i*) (p + 48))));
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(v,_mm_setzero_si128())) ==
+                                                                        0xffff;
+        }
+    #endif
+
+    static bool is_zero_block_scalar__(const char* p)
+    {
+        size_t v = 0;
+        size_t i = 0;
+        for(;i < HEX_ZERO_BLOCK;i += sizeof(size_t))
+        {
+            size_t w;
+            memcpy(&w,p + i,sizeof(size_t));
+            v |= w;
+        }
+        return !v;
+    }
+
+    static void init_hex_tables__()
+    {
+        if(is_zero_block__)
+            return;
+        static const char digits[] = "0123456789ABCDEF";
+        uint32 i = 0;
+        for(;i < 256;++i)
+        {
+            hex_pairs__[i][0] = digits[i >> 4];
+            hex_pairs__[i][1] = digits[i & 15];
+            hex_ascii__[i] = human_readable__((char) i);
+        }
+        is_zero_block__ = is_zero_block_scalar__;
+        #if defined(__SSE2__)
+            is_zero_block__ = is_zero_block_sse2__;
+        #endif
+        #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+            __builtin_cpu_init();
+            if(__builtin_cpu_supports("avx2"))
+                is_zero_block__ = is_zero_block_avx2__;
+        #endif
+    }
+
+    //Init a HEX dump into the buffer out (fd = -1: never flushed, so out
+    //must be large enough for all lines):
+    static void init_hex_dump__(
+                            hex_dump_t* hd,
+                            uint32 max_kb,
+                            heap_sink_t* sink,
+                            char* out,
+                            size_t out_size)
+    {
+        init_hex_tables__();
+        hd->max_bytes = max_kb * 1024; //KB ---> bytes
+        hd->output_cnt = 0;
+        hd->zero_word_cnt = 0;
+        hd->max_kb = max_kb;
+        hd->sink = sink;
+        hd->out = out;
+        hd->out_size = out_size;
+        hd->out_len = 0;
+    }
+
+    static void flush_hex_dump__(hex_dump_t* hd)
+    {
+        if(!hd->sink)
+            return;
+        write_sink__(hd->sink,hd->out,hd->out_len);
+        hd->out_len = 0;
+    }
+
+    //Get room for a line in the output buffer:
+    static inline char* get_hex_line__(hex_dump_t* hd)
+    {
+        if(hd->out_len > (hd->out_size - HEX_LINE_MAX))
+            flush_hex_dump__(hd);
+        return hd->out + hd->out_len;
+    }
+
+    //Put a pointer like printf("%14p"):
+    static inline char* put_hex_ptr__(char* o,size_t value)
+    {
+        static const char digits[] = "0123456789abcdef";
+        char rev[2 * sizeof(size_t)];
+        size_t n = 0;
+        do
+        {
+            rev[n++] = digits[value & 15];
+            value >>= 4;
+        } while(value);
+        size_t len = n + 2;
+        for(;len < 14;++len)
+            *o++ = ' ';
+        *o++ = '0';
+        *o++ = 'x';
+        while(n)
+            *o++ = rev[--n];
+        return o;
+    }
+
+    //Put the line of the 8 bytes at p, which show the heap memory at addr:
+    //
+    //  "XX XX XX XX   XX XX XX XX | cccc cccc %14p ... %14p\n"
+    //
+    static inline void put_hex_line__(
+                                    hex_dump_t* hd,
+                                    const unsigned char* p,
+                                    char* addr)
+    {
+        char* line = get_hex_line__(hd);
+        char* o = line;
+        uint32 i = 0;
+        for(;i < 8;++i)
+        {
+            o[0] = hex_pairs__[p[i]][0];
+            o[1] = hex_pairs__[p[i]][1];
+            o[2] = ' ';
+            o += 3;
+            if(i == 3)
+            {
+                o[0] = ' ';
+                o[1] = ' ';
+                o += 2;
+            }
+        }
+        o[0] = '|';
+        o[1] = ' ';
+        o += 2;
+        for(i = 0;i < 8;++i)
+        {
+            *o++ = hex_ascii__[p[i]];
+            if(i == 3)
+                *o++ = ' ';
+        }
+        *o++ = ' ';
+        o = put_hex_ptr__(o,(size_t) &addr[0]);
+        memcpy(o," ... ",5);
+        o = put_hex_ptr__(o + 5,(size_t) &addr[7]);
+        *o++ = '\n';
+        hd->out_len += (size_t) (o - line);
+    }
+
+    //Put the end of a collapsed run of zero words in front of addr:
+    static void put_hex_zero_run__(hex_dump_t* hd,char* addr)
+    {
+        char* line = get_hex_line__(hd);
+        size_t num_hidden_zero_blocks =
+                        (hd->zero_word_cnt - 9) * sizeof(size_t);
+        if(num_hidden_zero_blocks)
+        {
+            hd->out_len += snprintf(
+                            line,
+                            HEX_LINE_MAX,
+                            "%lu more zero words "
+                            "-> total zero block size: %lu bytes\n",
+                            num_hidden_zero_blocks,
+                            hd->zero_word_cnt*sizeof(size_t));
+        }
+        else
+        {
+            hd->out_len += snprintf(
+                            line,
+                            HEX_LINE_MAX,
+                            "-> total zero block size: %lu bytes\n",
+                            hd->zero_word_cnt*sizeof(size_t));
+        }
+        static const unsigned char zeros[8] = {0};
+        put_hex_line__(hd,zeros,addr - 8);
+    }
+
+    //Dump the 8 bytes at ptr, which show the heap memory at addr (the same
+    //address for the own heap), return false if the output limit is hit:
+    static bool dump_hex_word__(hex_dump_t* hd,const char* ptr,char* addr)
+    {
+        size_t word;
+        memcpy(&word,ptr,sizeof(word));
+        if(!word)
+        {
+            ++hd->zero_word_cnt;
+        }
+        else
+        {
+            if(hd->zero_word_cnt >= 9)
+                put_hex_zero_run__(hd,addr);
+            hd->zero_word_cnt = 0;
+        }
+        if(hd->zero_word_cnt < 9)
+            put_hex_line__(hd,(const unsigned char*) ptr,addr);
+
+        if(hd->max_bytes)
+        {
+            hd->output_cnt += 8;
+            if(hd->output_cnt >= hd->max_bytes)
+            {
+                flush_hex_dump__(hd);
+                heap_printf("\n");
+                heap_printf(">>> INTERRUPTED after %u KB <<<\n",hd->max_kb);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //Dump len bytes (a multiple of 8) at ptr, which show the heap memory at
+    //addr, return false if the output limit is hit. Inside of a collapsed
+    //run of zero words, whole zero blocks are skipped at once:
+    static bool dump_hex_block__(
+                            hex_dump_t* hd,
+                            const char* ptr,
+                            char* addr,
+                            size_t len)
+    {
+        const char* end = ptr + len;
+        while(ptr < end)
+        {
+            if((hd->zero_word_cnt >= 9) &&
+               ((size_t) (end - ptr) >= HEX_ZERO_BLOCK) &&
+               (!hd->max_bytes ||
+                    ((hd->output_cnt + HEX_ZERO_BLOCK) < hd->max_bytes)) &&
+               is_zero_block__(ptr))
+            {
+                hd->zero_word_cnt += HEX_ZERO_BLOCK / 8;
+                if(hd->max_bytes)
+                    hd->output_cnt += HEX_ZERO_BLOCK;
+                ptr += HEX_ZERO_BLOCK;
+                addr += HEX_ZERO_BLOCK;
+                continue;
+            }
+            if(!dump_hex_word__(hd,ptr,addr))
+                return false;
+            ptr += 8;
+            addr += 8;
+        }
+        return true;
+    }
+
+    //Dump len bytes (a multiple of 8) at ptr of the own heap, the pages not
+    //in RAM are not read (that would fault them in), but put as one line:
+    static bool dump_hex_resident__(hex_dump_t* hd,char* ptr,size_t len)
+    {
+        resident_map_t rm;
+        rm.num_pages = 0;
+        char* end = ptr + len;
+        while(ptr < end)
+        {
+            bool resident = true;
+            char* run_end = get_resident_run_end__(&rm,ptr,end,&resident);
+            if(resident)
+            {
+                if(!dump_hex_block__(hd,ptr,ptr,(size_t) (run_end - ptr)))
+                    return false;
+            }
+            else
+            {
+                if(hd->zero_word_cnt >= 9)
+                    put_hex_zero_run__(hd,ptr);
+                hd->zero_word_cnt = 0;
+                char* line = get_hex_line__(hd);
+                hd->out_len += snprintf(
+                                line,
+                                HEX_LINE_MAX,
+                                "%lu bytes not resident "
+                                "-> %14p ... %14p\n",
+                                (size_t) (run_end - ptr),
+                                ptr,
+                                run_end - 1);
+            }
+            ptr = run_end;
+        }
+        return true;
+    }
+
+    static void dump_hex_total__(hex_dump_t* hd)
+    {
+        flush_hex_dump__(hd);
+        if(hd->output_cnt < hd->max_bytes)
+        {
+            heap_printf("\n");
+            if(hd->output_cnt < (100 * 1024))
+            {
+                heap_printf(
+                    "TOTAL: %5.3lf KB\n",
+                    (double) (((double) hd->output_cnt)/1024.0));
+            }
+            else
+            {
+                heap_printf("TOTAL: %lu KB\n",hd->output_cnt/1024);
+            }
+        }
+        heap_printf("\n");
+    }
+
+    //Dump the 8 bytes at ptr by printf() (reference for the benchmark):
+    static void dump_hex_word_printf__(const char* ptr)
+    {
+        printf(
+            "%02X %02X %02X %02X   %02X %02X %02X %02X | "
+            "%c%c%c%c %c%c%c%c %14p ... %14p\n",
+            (unsigned char) ptr[0],
+            (unsigned char) ptr[1],
+            (unsigned char) ptr[2],
+            (unsigned char) ptr[3],
+            (unsigned char) ptr[4],
+            (unsigned char) ptr[5],
+            (unsigned char) ptr[6],
+            (unsigned char) ptr[7],
+            human_readable__(ptr[0]),
+            human_readable__(ptr[1]),
+            human_readable__(ptr[2]),
+            human_readable__(ptr[3]),
+            human_readable__(ptr[4]),
+            human_readable__(ptr[5]),
+            human_readable__(ptr[6]),
+            human_readable__(ptr[7]),
+            &ptr[0],
+            &ptr[7]);
+    }
+
+    //Check the range of a HEX dump and print the starting arena:
+    static bool start_heap_hex__(size_t* start_chunk,size_t* heap_top_end)
+    {
+        if(!start_chunk)
+        {
+            heap_printf("ERROR - start_chunk address is missing\n");
+            return false;
+        }
+        if(!heap_top_end)
+        {
+            heap_printf("ERROR - heap top address is missing\n");
+            return false;
+        }
+        if(start_chunk >= heap_top_end)
+        {
+            heap_printf("ERROR - start chunk address is too big\n");
+            return false;
+        }
+
+        //Starting arena:
+        gen_ar_t* ar_ptr = (gen_ar_t*) get_arena(start_chunk);
+        heap_bott_t* hb = (heap_bott_t*) 0;
+        if(ar_ptr == main_arena_ptr__)
+        {
+            heap_printf(
+                "MAIN ARENA at %p (MAIN HEAP at %p):\n\n",
+                main_arena_ptr__,
+                heap_bottom_chunk__);
+        }
+        else
+        {
+            hb = get_start_of_allocated_heap_segment(start_chunk);
+            heap_printf(
+                "ALLOCATED ARENA at %p (HEAP at %p):\n\n",
+                ar_ptr,
+                (size_t*) hb);
+        }
+        return true;
+    }
+
+    void dump_heap_hex(
+                    size_t* start_chunk,
+                    size_t* heap_top_end, //first invalid address
+                    uint32 max_kb)
+    {
+        sink_flush_t flush_at_return;
+        if(!start_heap_hex__(start_chunk,heap_top_end))
+            return;
+
+        hex_dump_t hd;
+        char out[HEX_OUT_BUF_SIZE];
+        init_hex_dump__(&hd,max_kb,get_sink__(),out,sizeof(out));
+        char* ptr = (char*) start_chunk;
+        size_t len = (size_t) (((char*) heap_top_end) - ptr) & ~((size_t) 7);
+        if(resident_only__)
+            dump_hex_resident__(&hd,ptr,len);
+        else
+            dump_hex_block__(&hd,ptr,ptr,len);
+        dump_hex_total__(&hd);
+    }
+
+    //Blocks of the parallel HEX dump:
+    #define HEX_PAR_BLOCK_SIZE (256 * 1024) //input bytes per block
+    #define HEX_PAR_SLOTS_PER_THREAD 2 //formatted blocks in flight
+    #define HEX_PAR_SLOT_SIZE ((HEX_PAR_BLOCK_SIZE / 8 + 2) * HEX_LINE_MAX)
+
+    //A block formatted by a worker thread. The summary of a run of zero
+    //words reaching into the block from the blocks in front is left out,
+    //since just the writer knows the length of the run:
+    struct hex_slot_t
+    {
+        bool done; //formatted, not yet written
+        size_t head_len; //output in front of the first non-zero word
+        size_t lead_words; //zero words in front of the first non-zero word
+        size_t tail_words; //zero words behind the last non-zero word
+        bool all_zero; //no non-zero word in the block
+        size_t out_len; //output of the block
+        char* out; //HEX_PAR_SLOT_SIZE bytes (mmapped)
+    };
+
+    struct hex_pool_t
+    {
+        pthread_mutex_t mutex; //guards all fields below
+        pthread_cond_t formatted; //a slot is done
+        pthread_cond_t written; //a slot is free again
+        char* start; //first word of the dump
+        size_t len; //bytes to dump (multiple of 8)
+        size_t num_blocks;
+        size_t next_block; //next block to format
+        size_t num_written; //blocks written so far
+        size_t num_slots; //block n goes to slot n % num_slots
+        hex_slot_t* slots; //mmapped
+    };
+
+    //Format a block into its slot (worker thread):
+    static void format_hex_block__(hex_pool_t* pool,size_t block_no)
+    {
+        hex_slot_t* slot = &pool->slots[block_no % pool->num_slots];
+        char* ptr = pool->start + block_no * HEX_PAR_BLOCK_SIZE;
+        char* end = pool->start + pool->len;
+        if((size_t) (end - ptr) > HEX_PAR_BLOCK_SIZE)
+            end = ptr + HEX_PAR_BLOCK_SIZE;
+
+        //Zero words in front of the block (up to 9 decide about the lines
+        //of the leading zero words):
+        size_t zero_word_cnt = 0;
+        char* p = ptr;
+        for(;(zero_word_cnt < 9) && (p > pool->start);++zero_word_cnt)
+        {
+            p -= 8;
+            if(*((size_t*) p))
+                break;
+        }
+
+        hex_dump_t hd;
+        init_hex_dump__(&hd,0,(heap_sink_t*) 0,slot->out,HEX_PAR_SLOT_SIZE);
+        hd.zero_word_cnt = zero_word_cnt;
+        char* first = ptr; //first non-zero word
+        while((first < end) && !*((size_t*) first))
+            first += 8;
+        dump_hex_block__(&hd,ptr,ptr,(size_t) (first - ptr));
+        slot->head_len = hd.out_len;
+        slot->lead_words = (size_t) (first - ptr) / 8;
+        slot->all_zero = (first == end);
+        slot->tail_words = 0;
+        if(!slot->all_zero)
+        {
+            if(hd.zero_word_cnt >= 9)
+                hd.zero_word_cnt = 0; //run summary is put by the writer
+            dump_hex_block__(&hd,first,first,(size_t) (end - first));
+            slot->tail_words = hd.zero_word_cnt;
+        }
+        slot->out_len = hd.out_len;
+    }
+
+    static void* hex_pool_thread__(void* arg)
+    {
+        hex_pool_t* pool = (hex_pool_t*) arg;
+        pthread_mutex_lock(&pool->mutex);
+        while(pool->next_block < pool->num_blocks)
+        {
+            size_t block_no = pool->next_block++;
+            while(block_no >= (pool->num_written + pool->num_slots))
+                pthread_cond_wait(&pool->written,&pool->mutex);
+            pthread_mutex_unlock(&pool->mutex);
+            format_hex_block__(pool,block_no);
+            pthread_mutex_lock(&pool->mutex);
+            pool->slots[block_no % pool->num_slots].done = true;
+            pthread_cond_broadcast(&pool->formatted);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+        return (void*) 0;
+    }
+
+    void dump_heap_hex_parallel(
+                            size_t* start_chunk,
+                            size_t* heap_top_end, //first invalid address
+                            uint32 num_threads,
+                            uint32 max_kb)
+    {
+        sink_flush_t flush_at_return;
+        if(!num_threads || resident_only__) //see dump_hex_resident__()
+        {
+            dump_heap_hex(start_chunk,heap_top_end,max_kb);
+            return;
+        }
+        if(num_threads > MAX_WALK_THREADS)
+            num_threads = MAX_WALK_THREADS;
+        if(!start_heap_hex__(start_chunk,heap_top_end))
+            return;
+
+        //The output limit just cuts the range:
+        size_t len = (size_t) (((char*) heap_top_end) - ((char*) start_chunk))
+                                                        & ~((size_t) 7);
+        size_t max_bytes = ((size_t) max_kb) * 1024; //KB ---> bytes
+        bool interrupted = false;
+        if(max_bytes && (len >= max_bytes))
+        {
+            len = max_bytes;
+            interrupted = true;
+        }
+
+        //Map the slots (not on the heap, which is dumped):
+        hex_pool_t pool;
+        memset(&pool,0,sizeof(hex_pool_t));
+        pool.start = (char*) start_chunk;
+        pool.len = len;
+        pool.num_blocks = (len + HEX_PAR_BLOCK_SIZE - 1) / HEX_PAR_BLOCK_SIZE;
+        pool.num_slots = (size_t) num_threads * HEX_PAR_SLOTS_PER_THREAD;
+        if(pool.num_slots > pool.num_blocks)
+            pool.num_slots = pool.num_blocks;
+        size_t slots_size = pool.num_slots * sizeof(hex_slot_t);
+        size_t map_size = slots_size + pool.num_slots * HEX_PAR_SLOT_SIZE;
+        void* map = mmap(
+                        (void*) 0,
+                        map_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                        -1,
+                        0);
+        if(map == MAP_FAILED)
+        {
+            heap_printf("ERROR - cannot map the output of %lu blocks\n",
+                        pool.num_slots);
+            return;
+        }
+        pool.slots = (hex_slot_t*) map;
+        size_t i = 0;
+        for(;i < pool.num_slots;++i)
+        {
+            pool.slots[i].out =
+                    ((char*) map) + slots_size + i * HEX_PAR_SLOT_SIZE;
+        }
+        pthread_mutex_init(&pool.mutex,(pthread_mutexattr_t*) 0);
+        pthread_cond_init(&pool.formatted,(pthread_condattr_t*) 0);
+        pthread_cond_init(&pool.written,(pthread_condattr_t*) 0);
+
+        //Run the worker threads, the formatting starts when all threads
+        //exist, since pthread_create() itself may allocate heap memory:
+        hex_dump_t hd;
+        char out[HEX_OUT_BUF_SIZE];
+        init_hex_dump__(&hd,max_kb,get_sink__(),out,sizeof(out));
+        pthread_t threads[MAX_WALK_THREADS];
+        uint32 num_started = 0;
+        pthread_mutex_lock(&pool.mutex);
+        for(;num_started < num_threads;++num_started)
+        {
+            if(pthread_create(
+                        &threads[num_started],
+                        (pthread_attr_t*) 0,
+                        hex_pool_thread__,
+                        &pool))
+            {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&pool.mutex);
+        if(!num_started)
+            hex_pool_thread__(&pool); //format all blocks in this thread
+
+        //Write the blocks in address order (this thread):
+        size_t zero_word_cnt = 0; //zero words in front of the block
+        size_t block_no = 0;
+        for(;block_no < pool.num_blocks;++block_no)
+        {
+            hex_slot_t* slot = &pool.slots[block_no % pool.num_slots];
+            pthread_mutex_lock(&pool.mutex);
+            while(!slot->done)
+                pthread_cond_wait(&pool.formatted,&pool.mutex);
+            pthread_mutex_unlock(&pool.mutex);
+
+            write_sink__(hd.sink,slot->out,slot->head_len);
+            zero_word_cnt += slot->lead_words;
+            if(!slot->all_zero)
+            {
+                if(zero_word_cnt >= 9)
+                {
+                    hd.zero_word_cnt = zero_word_cnt;
+                    put_hex_zero_run__(
+                                &hd,
+                                pool.start + block_no * HEX_PAR_BLOCK_SIZE
+                                           + slot->lead_words * 8);
+                    flush_hex_dump__(&hd);
+                }
+                zero_word_cnt = slot->tail_words;
+            }
+            write_sink__(
+                    hd.sink,
+                    slot->out + slot->head_len,
+                    slot->out_len - slot->head_len);
+
+            pthread_mutex_lock(&pool.mutex);
+            slot->done = false;
+            ++pool.num_written;
+            pthread_cond_broadcast(&pool.written);
+            pthread_mutex_unlock(&pool.mutex);
+        }
+
+        uint32 t = 0;
+        for(;t < num_started;++t)
+            pthread_join(threads[t],(void**) 0);
+        pthread_cond_destroy(&pool.written);
+        pthread_cond_destroy(&pool.formatted);
+        pthread_mutex_destroy(&pool.mutex);
+        munmap(map,map_size);
+
+        if(interrupted)
+        {
+            heap_printf("\n");
+            heap_printf(">>> INTERRUPTED after %u KB <<<\n",max_kb);
+        }
+        if(max_bytes)
+            hd.output_cnt = len;
+        dump_hex_total__(&hd);
+    }
+
+    void bench_heap_hex(uint32 num_loops)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return;
+        }
+        if(!num_loops)
+            num_loops = 1;
+        int null_fd = open("/dev/null",O_WRONLY);
+        if(null_fd < 0)
+        {
+            heap_printf("ERROR - can't open /dev/null\n");
+            return;
+        }
+
+        char* start = (char*) heap_bottom_chunk__;
+        char* end = (char*) sbrk(0);
+        size_t len = (size_t) (end - start) & ~((size_t) 7);
+
+        //printf() reference, one line per word (stdout ---> /dev/null):
+        flush_heap_sink(); //and stdout
+        int stdout_fd = dup(STDOUT_FILENO);
+        dup2(null_fd,STDOUT_FILENO);
+        uint32 i = 0;
+        double t0 = get_time_sec__();
+        for(i = 0;i < num_loops;++i)
+        {
+            char* ptr = start;
+            for(;ptr < (start + len);ptr += 8)
+                dump_hex_word_printf__(ptr);
+            fflush(stdout);
+        }
+        double t_ref = get_time_sec__() - t0;
+        dup2(stdout_fd,STDOUT_FILENO);
+        close(stdout_fd);
+
+        //Lookup tables, zero blocks and the output buffer (sink):
+        heap_sink_t null_sink;
+        open_heap_sink_fd(&null_sink,null_fd);
+        t0 = get_time_sec__();
+        for(i = 0;i < num_loops;++i)
+        {
+            hex_dump_t hd;
+            char out[HEX_OUT_BUF_SIZE];
+            init_hex_dump__(&hd,0,&null_sink,out,sizeof(out));
+            dump_hex_block__(&hd,start,start,len);
+            flush_hex_dump__(&hd);
+            flush_sink__(&null_sink);
+        }
+        double t_fast = get_time_sec__() - t0;
+        close_heap_sink(&null_sink);
+        close(null_fd);
+
+        double mb = ((double) len * (double) num_loops) / (1024.0 * 1024.0);
+        double mbps_ref = t_ref > 0.0 ? mb / t_ref : 0.0;
+        double mbps_fast = t_fast > 0.0 ? mb / t_fast : 0.0;
+        heap_printf(
+            "HEX DUMP BENCHMARK (main heap, %lu KB, %u loops):\n"
+            "\n"
+            "   printf() per word ............: %10.1lf MB/s\n"
+            "   tables + %-6s zero blocks ..: %10.1lf MB/s (x %.2lf)\n"
+            "\n",
+            len / 1024,
+            num_loops,
+            mbps_ref,
+            #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+                is_zero_block__ == is_zero_block_avx2__ ? "AVX2" :
+            #endif
+            #if defined(__SSE2__)
+                is_zero_block__ == is_zero_block_sse2__ ? "SSE2" :
+            #endif
+                "scalar",
+            mbps_fast,
+            mbps_ref > 0.0 ? mbps_fast / mbps_ref : 0.0);
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Raw heap dump:
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if defined(_WIN32) || defined(_WIN64)
+
+    void dump_heap_raw(
+                    size_t* /* start_chunk */,
+                    size_t* /* heap_top_end */, //first invalid address
+                    uint32 max_kb)
+    {
+        _HEAPINFO hi;
+        hi._pentry = NULL; //initate _heapwalk()
+
+        size_t max_bytes = max_kb * 1024; //KB ---> bytes
+        size_t output_cnt = 0;
+
+        char* ptr = (char*) 0;
+        size_t* this_chunk_top = (size_t*) 0;
+        int heap_status = 0;
+        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+        {
+            ptr = (char*) hi._pentry;
+            this_chunk_top = (size_t*) (ptr + hi._size);
+
+            for(;ptr < (char*) this_chunk_top;++ptr)
+                printf("%c",*ptr);
+
+            if(max_bytes)
+            {
+                output_cnt += hi._size;
+                if(output_cnt >= max_bytes)
+                    break;
+            }
+        }
+        fflush(stdout);
+    }
+
+#else
+
+    #define RAW_SPAN_SIZE (1024 * 1024) //bytes per write() or vmsplice()
+
+    //State of a raw dump:
+    struct raw_dump_t
+    {
+        int fd; //output file descriptor or -1 (memory sink)
+        bool is_pipe; //vmsplice() the heap pages into the pipe fd
+        bool is_sparse; //fd is a file ---> lseek() over zero pages
+        size_t max_bytes; //output limit or 0
+        size_t output_cnt; //bytes written so far (holes included)
+        size_t hole_cnt; //bytes skipped by lseek()
+        size_t not_resident_cnt; //bytes not in RAM (see resident_only__)
+        bool failed; //output error
+    };
+
+    //vmsplice() is used by the forked child only: its heap pages are a
+    //frozen copy-on-write image, but live pages would be referenced by the
+    //pipe and change until the reader has read them:
+    static void init_raw_dump__(raw_dump_t* rd,uint32 max_kb,int fd)
+    {
+        rd->fd = fd;
+        struct stat st;
+        rd->is_pipe = fork_child__ && (fd >= 0) &&
+                      !fstat(fd,&st) && S_ISFIFO(st.st_mode);
+        rd->is_sparse = false;
+        rd->max_bytes = ((size_t) max_kb) * 1024; //KB ---> bytes
+        rd->output_cnt = 0;
+        rd->hole_cnt = 0;
+        rd->not_resident_cnt = 0;
+        rd->failed = false;
+    }
+
+    //Get the fd of the current sink for a raw dump (-1 ---> write into the
+    //memory sink), its buffered bytes come first:
+    static int get_raw_sink_fd__()
+    {
+        heap_sink_t* sink = get_sink__();
+        flush_sink__(sink);
+        return sink->fd;
+    }
+
+    //Hand len bytes at ptr to the output. vmsplice() just references the
+    //heap pages (no copy), so the reader sees them as they are when it
+    //reads, which is the frozen image of the forked child:
+    static bool write_raw__(raw_dump_t* rd,const char* ptr,size_t len)
+    {
+        if(rd->fd < 0)
+        {
+            heap_sink_t* sink = get_sink__();
+            write_sink__(sink,ptr,len);
+            return !sink->failed;
+        }
+        while(len && rd->is_pipe)
+        {
+            struct iovec iov;
+            iov.iov_base = (void*) ptr;
+            iov.iov_len = len;
+            ssize_t n = vmsplice(rd->fd,&iov,1,0);
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                rd->is_pipe = false; //e.g. no vmsplice() ---> write()
+                break;
+            }
+            ptr += n;
+            len -= (size_t) n;
+        }
+        return write_all__(rd->fd,ptr,len);
+    }
+
+    //Test len bytes at ptr for zero (HEX_ZERO_BLOCK bytes at once):
+    static bool is_zero_range__(const char* ptr,size_t len)
+    {
+        const char* end = ptr + len;
+        for(;(ptr + HEX_ZERO_BLOCK) <= end;ptr += HEX_ZERO_BLOCK)
+        {
+            if(!is_zero_block__(ptr))
+                return false;
+        }
+        for(;ptr < end;++ptr)
+        {
+            if(*ptr)
+                return false;
+        }
+        return true;
+    }
+
+    //Write len bytes at ptr to a file, zero pages are skipped by lseek(),
+    //so they become holes of the file:
+    static bool write_sparse__(raw_dump_t* rd,const char* ptr,size_t len)
+    {
+        const char* end = ptr + len;
+        const char* data = ptr; //start of the pages not written yet
+        while(ptr < end)
+        {
+            const char* page_end =
+                    (const char*) ((((size_t) ptr) & ~(PAGE - 1)) + PAGE);
+            if(page_end > end)
+                page_end = end;
+            if(is_zero_range__(ptr,(size_t) (page_end - ptr)))
+            {
+                if(!write_all__(rd->fd,data,(size_t) (ptr - data)))
+                    return false;
+                if(lseek(rd->fd,(off_t) (page_end - ptr),SEEK_CUR) < 0)
+                    return false;
+                rd->hole_cnt += (size_t) (page_end - ptr);
+                data = page_end;
+            }
+            ptr = page_end;
+        }
+        return write_all__(rd->fd,data,(size_t) (end - data));
+    }
+
+    //Dump [ptr, end) in page aligned spans, return false if the output
+    //limit is hit or the output failed:
+    static bool dump_raw_pages__(
+                                raw_dump_t* rd,
+                                const char* ptr,
+                                const char* end)
+    {
+        while(ptr < end)
+        {
+            const char* span_end = (const char*)
+                            ((((size_t) ptr) + RAW_SPAN_SIZE) & ~(PAGE - 1));
+            if(span_end > end)
+                span_end = end;
+            size_t n = (size_t) (span_end - ptr);
+            if(rd->max_bytes && ((rd->output_cnt + n) > rd->max_bytes))
+                n = rd->max_bytes - rd->output_cnt;
+            if(rd->is_sparse ? !write_sparse__(rd,ptr,n) :
+                               !write_raw__(rd,ptr,n))
+            {
+                rd->failed = true;
+                return false;
+            }
+            rd->output_cnt += n;
+            ptr += n;
+            if(rd->max_bytes && (rd->output_cnt >= rd->max_bytes))
+                return false;
+        }
+        return true;
+    }
+
+    //Put len zero bytes for pages not in RAM (a hole of a file):
+    static bool skip_raw_pages__(raw_dump_t* rd,size_t len)
+    {
+        static const char zeros[PAGE] = {0};
+        if(rd->max_bytes && ((rd->output_cnt + len) > rd->max_bytes))
+            len = rd->max_bytes - rd->output_cnt;
+        bool ok = true;
+        if(rd->is_sparse)
+        {
+            ok = lseek(rd->fd,(off_t) len,SEEK_CUR) >= 0;
+            rd->hole_cnt += len;
+        }
+        else
+        {
+            size_t n = 0;
+            for(;ok && (n < len);n += PAGE)
+            {
+                size_t m = ((len - n) < PAGE) ? (len - n) : PAGE;
+                ok = write_raw__(rd,zeros,m);
+            }
+        }
+        if(!ok)
+        {
+            rd->failed = true;
+            return false;
+        }
+        rd->not_resident_cnt += len;
+        rd->output_cnt += len;
+        return !rd->max_bytes || (rd->output_cnt < rd->max_bytes);
+    }
+
+    //Dump [ptr, end), return false if the output limit is hit or the output
+    //failed. With resident_only__, the pages not in RAM are not read:
+    static bool dump_raw_range__(
+                                raw_dump_t* rd,
+                                const char* ptr,
+                                const char* end)
+    {
+        if(!resident_only__)
+            return dump_raw_pages__(rd,ptr,end);
+        resident_map_t rm;
+        rm.num_pages = 0;
+        while(ptr < end)
+        {
+            bool resident = true;
+            char* run_end = get_resident_run_end__(
+                                            &rm,
+                                            (char*) ptr,
+                                            (char*) end,
+                                            &resident);
+            if(resident ? !dump_raw_pages__(rd,ptr,run_end) :
+                          !skip_raw_pages__(rd,(size_t) (run_end - ptr)))
+            {
+                return false;
+            }
+            ptr = run_end;
+        }
+        return true;
+    }
+
+    void dump_heap_raw(
+                    size_t* start_chunk,
+                    size_t* heap_top_end, //first invalid address
+                    uint32 max_kb)
+    {
+        sink_flush_t flush_at_return;
+        if(!start_chunk)
+        {
+            heap_printf("ERROR - start_chunk address is missing\n");
+            return;
+        }
+        if(!heap_top_end)
+        {
+            heap_printf("ERROR - heap top address is missing\n");
+            return;
+        }
+        if(start_chunk >= heap_top_end)
+        {
+            heap_printf("ERROR - start chunk address is too big\n");
+            return;
+        }
+
+        raw_dump_t rd;
+        init_raw_dump__(&rd,max_kb,get_raw_sink_fd__());
+        dump_raw_range__(&rd,(char*) start_chunk,(char*) heap_top_end);
+    }
+
+    //Dump a heap segment and add its line to the index (idx_fd >= 0):
+    static bool dump_raw_segment__(
+                                raw_dump_t* rd,
+                                int idx_fd,
+                                size_t arena_no,
+                                const char* ptr,
+                                const char* end)
+    {
+        //A sparse image puts the segment at a file offset on the same page
+        //offset as its address (a hole in front), so its pages lie on page
+        //aligned file offsets and the zero pages are whole file blocks:
+        if(rd->is_sparse)
+        {
+            size_t pad = (((size_t) ptr) - rd->output_cnt) & (PAGE - 1);
+            if(rd->max_bytes && ((rd->output_cnt + pad) >= rd->max_bytes))
+                return false;
+            if(pad && (lseek(rd->fd,(off_t) pad,SEEK_CUR) < 0))
+            {
+                rd->failed = true;
+                return false;
+            }
+            rd->hole_cnt += pad;
+            rd->output_cnt += pad;
+        }
+
+        size_t offset = rd->output_cnt;
+        bool ok = dump_raw_range__(rd,ptr,end);
+        if(idx_fd >= 0) //not by dprintf(), which allocates its buffer
+        {
+            char line[80];
+            int len = snprintf(
+                            line,
+                            sizeof(line),
+                            "%12lu %14p %12lu %6lu\n",
+                            offset,
+                            ptr,
+                            rd->output_cnt - offset,
+                            arena_no);
+            if(!write_all__(idx_fd,line,(size_t) len))
+                rd->failed = true;
+        }
+        return ok;
+    }
+
+    //Dump the main heap and the heap segments of the allocated arenas (top
+    //segment first):
+    static void dump_raw_heaps__(raw_dump_t* rd,int idx_fd)
+    {
+        bool ok = dump_raw_segment__(
+                                rd,
+                                idx_fd,
+                                0,
+                                (char*) heap_bottom_chunk__,
+                                (char*) sbrk(0));
+        size_t arena_no = 1;
+        size_t* ar_ptr = get_next_arena((size_t*) main_arena_ptr__);
+        for(;ok && ar_ptr;ar_ptr = get_next_arena(ar_ptr),++arena_no)
+        {
+            size_t* top_chunk_ptr = ((gen_ar_t*) ar_ptr)->addr[top_idx__];
+            if(!top_chunk_ptr)
+                continue;
+            heap_bott_t* hb =
+                        get_start_of_allocated_heap_segment(top_chunk_ptr);
+            while(ok && hb)
+            {
+                ok = dump_raw_segment__(
+                                rd,
+                                idx_fd,
+                                arena_no,
+                                (char*) hb,
+                                ((char*) hb) + hb->size);
+                hb = (hb->prev && (hb->prev->ar_ptr == hb->ar_ptr)) ?
+                                                hb->prev : (heap_bott_t*) 0;
+            }
+        }
+    }
+
+    void dump_heap_raw_all(uint32 max_kb)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__ || !main_arena_ptr__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return;
+        }
+
+        raw_dump_t rd;
+        init_raw_dump__(&rd,max_kb,get_raw_sink_fd__());
+        dump_raw_heaps__(&rd,-1);
+    }
+
+    bool write_heap_image(const char* path,uint32 max_kb)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__ || !main_arena_ptr__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return false;
+        }
+        char idx_path[PATH_MAX];
+        if(snprintf(idx_path,sizeof(idx_path),"%s.idx",path) >=
+                                                    (int) sizeof(idx_path))
+        {
+            heap_printf("ERROR - path too long: %s\n",path);
+            return false;
+        }
+        int fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+        if(fd < 0)
+        {
+            heap_printf("ERROR - can't create %s\n",path);
+            return false;
+        }
+        int idx_fd = open(idx_path,O_WRONLY | O_CREAT | O_TRUNC,0644);
+        if(idx_fd < 0)
+        {
+            heap_printf("ERROR - can't create %s\n",idx_path);
+            close(fd);
+            return false;
+        }
+
+        double t0 = get_time_sec__();
+        init_hex_tables__(); //is_zero_block__
+        raw_dump_t rd;
+        init_raw_dump__(&rd,max_kb,fd);
+        rd.is_pipe = false;
+        rd.is_sparse = true;
+        static const char idx_header[] =
+                        "#     offset        address         size  arena\n";
+        write_all__(idx_fd,idx_header,sizeof(idx_header) - 1);
+        dump_raw_heaps__(&rd,idx_fd);
+
+        //Trailing holes are not written, so set the size of the file:
+        bool ok = !rd.failed && !ftruncate(fd,(off_t) rd.output_cnt);
+        ok = !close(fd) && ok;
+        ok = !close(idx_fd) && ok;
+        if(!ok)
+        {
+            heap_printf("ERROR - can't write %s\n",path);
+            return false;
+        }
+        heap_printf(
+            "heap image %s: %lu KB (%lu KB data, %lu KB holes), "
+            "%.3lf ms, index in %s\n",
+            path,
+            rd.output_cnt / 1024,
+            (rd.output_cnt - rd.hole_cnt) / 1024,
+            rd.hole_cnt / 1024,
+            (get_time_sec__() - t0) * 1000.0,
+            idx_path);
+        if(resident_only__)
+        {
+            heap_printf(
+                "heap image %s: %lu KB not resident (holes, not read)\n",
+                path,
+                rd.not_resident_cnt / 1024);
+        }
+        return true;
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump a copy-on-write snapshot of the heap by a forked child:
+//-----------------------------------------------------------------------------
+// Walking the heap in-process races with the other threads calling malloc()
+// and free(), and stopping them for a walk of seconds is not an option.
+// fork() takes all arena locks while copying the page tables, so the child
+// gets a consistent image of the heap, which copy-on-write then keeps frozen
+// for it. The child walks this image by the usual dump function and streams
+// the output over a pipe back to the parent, whose other threads keep on
+// serving meanwhile. So the parent is paused just for the fork() itself.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    #define FORK_PIPE_BUF_SIZE (64 * 1024)
+
+    //Run the dump in the forked child (the current sink is the pipe):
+    static void dump_heap_in_child__(
+                                unsigned char what,
+                                uint32 max_kb,
+                                uint32 num_threads,
+                                uint32 num_lanes)
+    {
+        size_t* heap_top_end = (size_t*) 0; //first invalid address
+        size_t* heap_top_chunk = (size_t*) 0; //heap top chunk
+        get_current_contiguous_heap_limit(&heap_top_end,&heap_top_chunk);
+
+        if(what == HEAP_DUMP_FOOTPRINT)
+        {
+            if(num_threads || num_lanes)
+                dump_heap_footprint_parallel(num_threads,num_lanes);
+            else
+                dump_heap_footprint();
+        }
+        else if(what == HEAP_DUMP_DETAILS)
+        {
+            dump_heap_details(heap_bottom_chunk__,heap_top_end);
+        }
+        else if(what == HEAP_DUMP_HEX)
+        {
+            if(num_threads)
+            {
+                dump_heap_hex_parallel(
+                                heap_bottom_chunk__,
+                                heap_top_end,
+                                num_threads,
+                                max_kb);
+            }
+            else
+            {
+                dump_heap_hex(heap_bottom_chunk__,heap_top_end,max_kb);
+            }
+        }
+        else if(what == HEAP_DUMP_RAW)
+        {
+            dump_heap_raw_all(max_kb);
+        }
+    }
+
+    bool dump_heap_fork_snapshot(
+                            unsigned char what,
+                            uint32 max_kb,
+                            uint32 num_threads,
+                            uint32 num_lanes)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return false;
+        }
+
+        int fds[2];
+        if(pipe(fds))
+        {
+            heap_printf("ERROR - pipe() failed: %s\n",strerror(errno));
+            return false;
+        }
+        flush_heap_sink(); //or the child prints the buffered output once more
+
+        double fork_start = get_time_sec__();
+        pid_t child = fork();
+        double fork_end = get_time_sec__();
+        if(child < 0)
+        {
+            heap_printf("ERROR - fork() failed: %s\n",strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if(!child)
+        {
+            close(fds[0]);
+            heap_sink_t pipe_sink;
+            if(!open_heap_sink_fd(&pipe_sink,fds[1]))
+                _exit(1);
+            set_heap_sink(&pipe_sink);
+            fork_child__ = true;
+            dump_heap_in_child__(what,max_kb,num_threads,num_lanes);
+            close_heap_sink(&pipe_sink);
+            _exit(pipe_sink.failed ? 1 : 0);
+        }
+        close(fds[1]);
+
+        char buf[FORK_PIPE_BUF_SIZE];
+        size_t num_bytes = 0;
+        bool ok = true;
+        for(;;)
+        {
+            ssize_t n = read(fds[0],buf,sizeof(buf));
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                    continue;
+                ok = false;
+                break;
+            }
+            if(!n)
+                break;
+            heap_sink_write(buf,(size_t) n); //go on, the child must not block
+            num_bytes += (size_t) n;
+        }
+        close(fds[0]);
+        if(!flush_heap_sink())
+            ok = false;
+
+        int status = 0;
+        while((waitpid(child,&status,0) < 0) && (errno == EINTR))
+            ;
+        double walk_end = get_time_sec__();
+        if(!WIFEXITED(status) || WEXITSTATUS(status))
+            ok = false;
+
+        heap_printf(
+            "fork snapshot: %.3lf ms pause (fork), %.3lf ms walk, "
+            "%lu KB output%s\n"
+            "\n",
+            (fork_end - fork_start) * 1000.0,
+            (walk_end - fork_end) * 1000.0,
+            num_bytes / 1024,
+            ok ? "" : " (ERROR)");
+        return ok;
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Heap of another process (attach by PID or by a core file):
+//-----------------------------------------------------------------------------
+// The memory of a process is read by process_vm_readv() through a small
+// direct mapped cache of pages. A cache miss fetches a run of pages by one
+// system call, with one remote iovec per page, so a run stops cleanly in
+// front of a page that can't be read. The run length doubles as long as the
+// misses are sequential (like the chunk headers of a heap segment) and falls
+// back to a single page after a jump (e.g. over a big chunk), so the payload
+// of a big chunk is not read just to get to the next chunk header:
+//
+//      miss at page n, n + 1, n + 3, n + 7, ... ---> runs of 1, 2, 4, 8, ...
+//
+// A core file is mapped by mmap() instead and every PT_LOAD segment points
+// into that image, so the walk reads the chunk headers in place (no copy).
+// As the kernel is told to read the image randomly (no read-ahead), only the
+// pages holding chunk headers are ever read from disk, also for big cores.
+//
+// The mappings of the process are taken from /proc/<pid>/maps (or from the
+// PT_LOAD segments and the NT_FILE note of the core). The main arena is
+// searched in the writable mappings of files (glibc's .data, or the one of
+// the executable if linked statically) and in the anonymous mapping right
+// behind such a mapping (.bss): its top pointer points to a chunk in [heap]
+// (or in any anonymous mapping of a core), which ends at the end of that
+// mapping, and its next pointers lead back to it. From there the cursor
+// walks all arenas and heap segments, just like the chunk cursor does it for
+// the own heap.
+//
+// The arena layout (top_idx__, next_idx__, heap segment bottom offsets) is
+// the one found for the own glibc by init_heapdump(), so the process must
+// run with the same glibc version.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    #define REMOTE_CACHE_PAGES 256 //direct mapped cache of 1 MB
+    #define REMOTE_MAX_RUN_PAGES 64 //max. pages per process_vm_readv()
+    #define MAX_REMOTE_MAPS 4096
+    #define MAX_REMOTE_ARENAS 4096 //stops a walk along a broken next chain
+
+    #define REMOTE_MAP_READ  0x01
+    #define REMOTE_MAP_WRITE 0x02
+    #define REMOTE_MAP_FILE  0x04
+    #define REMOTE_MAP_HEAP  0x08
+
+    struct remote_map_t
+    {
+        size_t start;
+        size_t end; //first invalid address
+        unsigned char flags; //REMOTE_MAP_...
+        const char* image; //memory at start in the core image or NULL
+        size_t image_end; //end of the memory held by the core image
+    };
+
+    static pid_t remote_pid__ = 0;
+    static remote_map_t remote_maps__[MAX_REMOTE_MAPS];
+    static size_t remote_num_maps__ = 0;
+    static remote_map_t* remote_last_map__ = (remote_map_t*) 0;
+    static char* remote_core__ = (char*) 0; //mapped core file
+    static size_t remote_core_size__ = 0;
+
+    static char remote_cache__[REMOTE_CACHE_PAGES][PAGE];
+    static size_t remote_cache_tag__[REMOTE_CACHE_PAGES]; //page address or 0
+    static size_t remote_run_end__ = 0; //page behind the last run
+    static size_t remote_run_pages__ = 0; //pages of the last run
+    static size_t remote_num_reads__ = 0; //process_vm_readv() calls
+    static size_t remote_num_pages__ = 0; //pages read
+    static int remote_errno__ = 0; //errno of the last failed read
+
+    static gen_ar_t* remote_main_arena__ = (gen_ar_t*) 0;
+    static size_t* remote_heap_bottom__ = (size_t*) 0; //main heap bottom
+    static size_t* remote_main_heap_end__ = (size_t*) 0; //end of the top
+
+    //Steps along the arena ring of a walk (see step_remote_cursor__()):
+    static size_t remote_ring_hops__ = 0; //arenas stepped to
+    static size_t remote_ring_power__ = 1; //hops up to the next mark
+    static gen_ar_t* remote_ring_mark__ = (gen_ar_t*) 0; //arena to compare
+    static bool remote_ring_broken__ = false; //arena repeated or too many
+
+    static remote_map_t* find_remote_map__(size_t addr)
+    {
+        remote_map_t* map = remote_last_map__;
+        if(map && (addr >= map->start) && (addr < map->end))
+            return map;
+
+        size_t lo = 0;
+        size_t hi = remote_num_maps__;
+        while(lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if(addr < remote_maps__[mid].start)
+            {
+                hi = mid;
+            }
+            else if(addr >= remote_maps__[mid].end)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                remote_last_map__ = &remote_maps__[mid];
+                return remote_last_map__;
+            }
+        }
+        return (remote_map_t*) 0;
+    }
+
+    //Read a run of pages into the cache, starting with the missed page:
+    static bool fetch_remote_pages__(size_t page)
+    {
+        remote_map_t* map = find_remote_map__(page);
+        if(!map || !(map->flags & REMOTE_MAP_READ))
+            return false;
+
+        size_t num_pages = 1;
+        if((page == remote_run_end__) && remote_run_pages__)
+        {
+            num_pages = 2 * remote_run_pages__;
+            if(num_pages > REMOTE_MAX_RUN_PAGES)
+                num_pages = REMOTE_MAX_RUN_PAGES;
+        }
+        if(num_pages > (map->end - page) / PAGE)
+            num_pages = (map->end - page) / PAGE;
+
+        struct iovec local_iov[REMOTE_MAX_RUN_PAGES];
+        struct iovec remote_iov[REMOTE_MAX_RUN_PAGES];
+        size_t i = 0;
+        for(;i < num_pages;++i)
+        {
+            size_t addr = page + i * PAGE;
+            size_t slot = (addr / PAGE) % REMOTE_CACHE_PAGES;
+            remote_cache_tag__[slot] = 0;
+            local_iov[i].iov_base = remote_cache__[slot];
+            local_iov[i].iov_len = PAGE;
+            remote_iov[i].iov_base = (void*) addr;
+            remote_iov[i].iov_len = PAGE;
+        }
+        ssize_t num_bytes = process_vm_readv(
+                                        remote_pid__,
+                                        local_iov,
+                                        num_pages,
+                                        remote_iov,
+                                        num_pages,
+                                        0);
+        ++remote_num_reads__;
+        if(num_bytes <= 0)
+        {
+            remote_errno__ = errno;
+            remote_run_pages__ = 0;
+            return false;
+        }
+
+        size_t num_read = ((size_t) num_bytes) / PAGE;
+        for(i = 0;i < num_read;++i)
+        {
+            size_t addr = page + i * PAGE;
+            remote_cache_tag__[(addr / PAGE) % REMOTE_CACHE_PAGES] = addr;
+        }
+        remote_num_pages__ += num_read;
+        remote_run_pages__ = num_read;
+        remote_run_end__ = page + num_read * PAGE;
+        return num_read ? true : false;
+    }
+
+    //Get the cached page holding an address of the process or NULL:
+    static const char* get_remote_page__(size_t addr)
+    {
+        size_t page = addr & ~(PAGE - 1);
+        if(remote_core__)
+        {
+            //The page is part of the mapped core image:
+            remote_map_t* map = find_remote_map__(page);
+            if(!map || !map->image || (page >= map->image_end))
+                return (const char*) 0;
+            return map->image + (page - map->start);
+        }
+
+        size_t slot = (page / PAGE) % REMOTE_CACHE_PAGES;
+        if((remote_cache_tag__[slot] != page) && !fetch_remote_pages__(page))
+            return (const char*) 0;
+        return remote_cache__[slot];
+    }
+
+    //Read an aligned word of the process:
+    static bool peek_remote__(const void* addr,size_t* value)
+    {
+        if(((size_t) addr) & (sizeof(size_t) - 1))
+            return false;
+        const char* page_data = get_remote_page__((size_t) addr);
+        if(!page_data)
+            return false;
+        size_t offs = ((size_t) addr) & (PAGE - 1);
+        *value = *((const size_t*) (page_data + offs));
+        return true;
+    }
+
+    //Read a block of memory of the process:
+    static bool read_remote__(const void* addr,void* buf,size_t len)
+    {
+        size_t src = (size_t) addr;
+        char* dst = (char*) buf;
+        while(len)
+        {
+            const char* page_data = get_remote_page__(src);
+            if(!page_data)
+                return false;
+            size_t offs = src & (PAGE - 1);
+            size_t n = PAGE - offs;
+            if(n > len)
+                n = len;
+            memcpy(dst,page_data + offs,n);
+            src += n;
+            dst += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    //Add a line of /proc/<pid>/maps:
+    //
+    //  55d0c3a2e000-55d0c3a4f000 rw-p 00000000 00:00 0     [heap]
+    //
+    static void add_remote_map__(char* line)
+    {
+        if(remote_num_maps__ >= MAX_REMOTE_MAPS)
+            return;
+
+        char* p = (char*) 0;
+        size_t start = strtoul(line,&p,16);
+        if(*p != '-')
+            return;
+        size_t end = strtoul(p + 1,&p,16);
+        if((*p != ' ') || (strlen(p) < 5))
+            return;
+        ++p;
+
+        unsigned char flags = 0;
+        if(p[0] == 'r')
+            flags |= REMOTE_MAP_READ;
+        if(p[1] == 'w')
+            flags |= REMOTE_MAP_WRITE;
+
+        //Skip permissions, offset, device and inode to get the path name:
+        uint32 num_fields = 0;
+        for(;*p && (num_fields < 4);++num_fields)
+        {
+            while(*p && (*p != ' '))
+                ++p;
+            while(*p == ' ')
+                ++p;
+        }
+        if(*p == '/')
+            flags |= REMOTE_MAP_FILE;
+        else if(!strcmp(p,"[heap]"))
+            flags |= REMOTE_MAP_HEAP;
+
+        remote_map_t* map = &remote_maps__[remote_num_maps__++];
+        map->start = start;
+        map->end = end;
+        map->flags = flags;
+        map->image = (const char*) 0;
+        map->image_end = 0;
+    }
+
+    static bool load_remote_maps__(pid_t pid)
+    {
+        char path[64];
+        snprintf(path,sizeof(path),"/proc/%d/maps",(int) pid);
+        int fd = open(path,O_RDONLY);
+        if(fd < 0)
+            return false;
+
+        char buf[4096];
+        char line[PATH_MAX + 128];
+        size_t line_len = 0;
+        ssize_t num_bytes = 0;
+        while((num_bytes = read(fd,buf,sizeof(buf))) > 0)
+        {
+            ssize_t i = 0;
+            for(;i < num_bytes;++i)
+            {
+                if(buf[i] != '\n')
+                {
+                    if(line_len < (sizeof(line) - 1))
+                        line[line_len++] = buf[i];
+                    continue;
+                }
+                line[line_len] = 0x00;
+                add_remote_map__(line);
+                line_len = 0;
+            }
+        }
+        close(fd);
+        return remote_num_maps__ ? true : false;
+    }
+
+    //Test whether an arena of the process is the main arena:
+    static bool is_remote_main_arena__(gen_ar_t* ar_ptr,remote_map_t* heap)
+    {
+        //The top chunk has to end at the end of [heap] (= sbrk(0)):
+        size_t top = 0;
+        if(!peek_remote__(&ar_ptr->addr[top_idx__],&top))
+            return false;
+        if((top < heap->start) || (top >= heap->end) ||
+           (top & MALLOC_ALIGN_MASK))
+        {
+            return false;
+        }
+        size_t size_field = 0;
+        if(!peek_remote__(&((chunk_t*) top)->size,&size_field))
+            return false;
+        if((size_field & FLAGS_MASK) != P__)
+            return false;
+        size_t top_end = top + (size_field & ~FLAGS_MASK);
+        if((top_end > heap->end) || ((top_end + PAGE) <= heap->end))
+            return false;
+
+        //The next pointers have to lead back to the arena:
+        gen_ar_t* p = ar_ptr;
+        uint32 i = 0;
+        for(;i < MAX_REMOTE_ARENAS;++i)
+        {
+            size_t next = 0;
+            if(!peek_remote__(&p->addr[next_idx__],&next) || !next)
+                return false;
+            if((gen_ar_t*) next == ar_ptr)
+                return true;
+            p = (gen_ar_t*) next;
+        }
+        return false;
+    }
+
+    //Mark the mappings of files listed by the NT_FILE note of a core:
+    //
+    //  count, page size, count * (start, end, file offset), file names
+    //
+    static void mark_core_files__(const char* desc,size_t desc_size)
+    {
+        const uint64* field = (const uint64*) desc;
+        if(desc_size < (2 * sizeof(uint64)))
+            return;
+        uint64 count = field[0];
+        if(count > ((desc_size / sizeof(uint64)) - 2) / 3)
+            return;
+
+        uint64 i = 0;
+        for(;i < count;++i)
+        {
+            size_t start = (size_t) field[2 + 3 * i];
+            size_t end = (size_t) field[3 + 3 * i];
+            remote_map_t* map = find_remote_map__(start);
+            for(;map && (map < &remote_maps__[remote_num_maps__]);++map)
+            {
+                if(map->start >= end)
+                    break;
+                map->flags |= REMOTE_MAP_FILE;
+            }
+        }
+    }
+
+    //Check that size bytes at offs lie inside the core file (subtracted,
+    //since the sum of two fields of a damaged file may overflow):
+    static bool is_core_range__(uint64 offs,uint64 size)
+    {
+        return (offs <= remote_core_size__) &&
+               (size <= (remote_core_size__ - offs));
+    }
+
+    //Take the mappings from the PT_LOAD segments of a mapped core file:
+    static bool load_core_maps__()
+    {
+        const char* core = remote_core__;
+        const Elf64_Ehdr* eh = (const Elf64_Ehdr*) core;
+        if((remote_core_size__ < sizeof(Elf64_Ehdr)) ||
+           memcmp(eh->e_ident,ELFMAG,SELFMAG) ||
+           (eh->e_ident[EI_CLASS] != ELFCLASS64) ||
+           (eh->e_type != ET_CORE) ||
+           (eh->e_phentsize != sizeof(Elf64_Phdr)))
+        {
+            return false;
+        }
+
+        //More than 0xffff program headers are counted by section 0:
+        size_t num_phdrs = eh->e_phnum;
+        if((num_phdrs == PN_XNUM) && eh->e_shoff &&
+           is_core_range__(eh->e_shoff,sizeof(Elf64_Shdr)))
+        {
+            num_phdrs = ((const Elf64_Shdr*) (core + eh->e_shoff))->sh_info;
+        }
+        if((eh->e_phoff > remote_core_size__) ||
+           (num_phdrs >
+                ((remote_core_size__ - eh->e_phoff) / sizeof(Elf64_Phdr))))
+        {
+            return false;
+        }
+
+        const Elf64_Phdr* ph = (const Elf64_Phdr*) (core + eh->e_phoff);
+        size_t i = 0;
+        for(;(i < num_phdrs) && (remote_num_maps__ < MAX_REMOTE_MAPS);++i)
+        {
+            if((ph[i].p_type != PT_LOAD) || !ph[i].p_memsz ||
+               (ph[i].p_memsz > (~((uint64) 0) - ph[i].p_vaddr)))
+            {
+                continue;
+            }
+            if(remote_num_maps__ &&
+               (ph[i].p_vaddr < remote_maps__[remote_num_maps__ - 1].end))
+            {
+                continue; //segments are ordered by address
+            }
+
+            remote_map_t* map = &remote_maps__[remote_num_maps__++];
+            map->start = ph[i].p_vaddr;
+            map->end = ph[i].p_vaddr + ph[i].p_memsz;
+            map->flags = 0;
+            if(ph[i].p_flags & PF_R)
+                map->flags |= REMOTE_MAP_READ;
+            if(ph[i].p_flags & PF_W)
+                map->flags |= REMOTE_MAP_WRITE;
+            map->image = (const char*) 0;
+            map->image_end = 0;
+            if(ph[i].p_filesz && (ph[i].p_filesz <= ph[i].p_memsz) &&
+               is_core_range__(ph[i].p_offset,ph[i].p_filesz))
+            {
+                map->image = core + ph[i].p_offset;
+                map->image_end = map->start + ph[i].p_filesz;
+            }
+        }
+
+        for(i = 0;i < num_phdrs;++i)
+        {
+            if((ph[i].p_type != PT_NOTE) ||
+               !is_core_range__(ph[i].p_offset,ph[i].p_filesz))
+            {
+                continue;
+            }
+            const char* note = core + ph[i].p_offset;
+            size_t offs = 0;
+            while((offs + sizeof(Elf64_Nhdr)) <= ph[i].p_filesz)
+            {
+                const Elf64_Nhdr* nh = (const Elf64_Nhdr*) (note + offs);
+                size_t desc_offs = offs + sizeof(Elf64_Nhdr) +
+                                        (((size_t) nh->n_namesz + 3) & ~3UL);
+                size_t next_offs = desc_offs +
+                                        (((size_t) nh->n_descsz + 3) & ~3UL);
+                if(next_offs > ph[i].p_filesz)
+                    break;
+                if(nh->n_type == NT_FILE)
+                    mark_core_files__(note + desc_offs,nh->n_descsz);
+                offs = next_offs;
+            }
+        }
+
+        //Without names any anonymous, writable mapping may be the [heap]:
+        for(i = 0;i < remote_num_maps__;++i)
+        {
+            if((remote_maps__[i].flags &
+                    (REMOTE_MAP_READ | REMOTE_MAP_WRITE | REMOTE_MAP_FILE)) ==
+                                        (REMOTE_MAP_READ | REMOTE_MAP_WRITE))
+            {
+                remote_maps__[i].flags |= REMOTE_MAP_HEAP;
+            }
+        }
+        return remote_num_maps__ ? true : false;
+    }
+
+    static gen_ar_t* find_remote_main_arena__(remote_map_t** heap_ptr)
+    {
+        size_t i = 0;
+        for(;i < remote_num_maps__;++i)
+        {
+            //Writable data of a file or the anonymous mapping behind it:
+            remote_map_t* map = &remote_maps__[i];
+            if((map->flags & (REMOTE_MAP_READ | REMOTE_MAP_WRITE)) !=
+                                        (REMOTE_MAP_READ | REMOTE_MAP_WRITE))
+            {
+                continue;
+            }
+            if(!(map->flags & REMOTE_MAP_FILE) &&
+               (!i || !(remote_maps__[i - 1].flags & REMOTE_MAP_FILE) ||
+                        (remote_maps__[i - 1].end != map->start)))
+            {
+                continue;
+            }
+
+            size_t addr = map->start;
+            for(;addr < map->end;addr += sizeof(size_t))
+            {
+                size_t value = 0;
+                if(!peek_remote__((size_t*) addr,&value))
+                    break;
+                remote_map_t* heap = find_remote_map__(value);
+                if(!heap || !(heap->flags & REMOTE_MAP_HEAP))
+                    continue;
+                gen_ar_t* ar_ptr = (gen_ar_t*)
+                                (addr - top_idx__ * sizeof(size_t*));
+                if(is_remote_main_arena__(ar_ptr,heap))
+                {
+                    *heap_ptr = heap;
+                    return ar_ptr;
+                }
+            }
+        }
+        return (gen_ar_t*) 0;
+    }
+
+    //Test whether the chunks starting at chunk_ptr lead to the top chunk
+    //(checked for a few steps, main arena chunks have no A and no M flag):
+    static bool is_remote_chunk_chain__(size_t chunk_ptr,size_t top)
+    {
+        #define MAX_CHAIN_STEPS 64
+
+        uint32 i = 0;
+        for(;(i < MAX_CHAIN_STEPS) && (chunk_ptr != top);++i)
+        {
+            size_t size_field = 0;
+            if(!peek_remote__(&((chunk_t*) chunk_ptr)->size,&size_field))
+                return false;
+            if(!i && !(size_field & P__))
+                return false; //the bottom chunk has always P set
+            size_t chunk_size = size_field & ~FLAGS_MASK;
+            if((size_field & (A__ | M__)) || (chunk_size < MINSIZE) ||
+               (chunk_size & MALLOC_ALIGN_MASK) || (chunk_size > top) ||
+               ((chunk_ptr + chunk_size) > top))
+            {
+                return false;
+            }
+            chunk_ptr += chunk_size;
+        }
+        return true;
+    }
+
+    //Find the bottom chunk of the main heap (a static executable has its
+    //TLS in front of it at the start of [heap]):
+    static size_t* find_remote_heap_bottom__(remote_map_t* heap,size_t top)
+    {
+        size_t p = (heap->start + MALLOC_ALIGN_MASK) & ~MALLOC_ALIGN_MASK;
+        for(;p <= top;p += 2 * sizeof(size_t))
+        {
+            if(is_remote_chunk_chain__(p,top))
+                return (size_t*) p;
+        }
+        return (size_t*) 0;
+    }
+
+    //Find the main arena and the main heap after loading the mappings:
+    static bool find_remote_main_heap__(const char* name) //e.g. "process 1"
+    {
+        remote_map_t* heap = (remote_map_t*) 0;
+        remote_main_arena__ = find_remote_main_arena__(&heap);
+        if(!remote_main_arena__)
+        {
+            if(remote_errno__)
+            {
+                heap_printf(
+                    "ERROR - can't read %s: %s\n",
+                    name,
+                    strerror(remote_errno__));
+            }
+            else
+            {
+                heap_printf("ERROR - main arena of %s not found\n",name);
+            }
+            return false;
+        }
+
+        size_t top = 0;
+        size_t size_field = 0;
+        peek_remote__(&remote_main_arena__->addr[top_idx__],&top);
+        peek_remote__(&((chunk_t*) top)->size,&size_field);
+        remote_main_heap_end__ =
+                        (size_t*) (top + (size_field & ~FLAGS_MASK));
+        remote_heap_bottom__ = find_remote_heap_bottom__(heap,top);
+        if(!remote_heap_bottom__)
+        {
+            heap_printf("ERROR - main heap bottom of %s not found\n",name);
+            return false;
+        }
+        return true;
+    }
+
+    bool attach_remote_heap(pid_t pid)
+    {
+        sink_flush_t flush_at_return;
+        detach_remote_heap();
+        if(!main_arena_ptr__)
+        {
+            heap_printf(
+                "ERROR - init_heapdump() did not find the main arena\n");
+            return false;
+        }
+        if(!load_remote_maps__(pid))
+        {
+            heap_printf("ERROR - can't read /proc/%d/maps\n",(int) pid);
+            return false;
+        }
+        remote_pid__ = pid;
+
+        char name[32];
+        snprintf(name,sizeof(name),"process %d",(int) pid);
+        size_t i = 0;
+        for(;i < remote_num_maps__;++i)
+        {
+            if(remote_maps__[i].flags & REMOTE_MAP_HEAP)
                 break;
-            case _HEAPBADPTR:
-                printf("ERROR - bad pointer to heap\n");
+        }
+        if(i == remote_num_maps__)
+        {
+            heap_printf("ERROR - %s has no [heap]\n",name);
+            detach_remote_heap();
+            return false;
+        }
+
+        if(!find_remote_main_heap__(name))
+        {
+            detach_remote_heap();
+            return false;
+        }
+        return true;
+    }
+
+    bool attach_remote_core(const char* core_path)
+    {
+        sink_flush_t flush_at_return;
+        detach_remote_heap();
+        if(!main_arena_ptr__)
+        {
+            heap_printf(
+                "ERROR - init_heapdump() did not find the main arena\n");
+            return false;
+        }
+
+        int fd = open(core_path,O_RDONLY);
+        struct stat st;
+        if((fd < 0) || fstat(fd,&st) || !st.st_size)
+        {
+            heap_printf("ERROR - can't open core file %s\n",core_path);
+            if(fd >= 0)
+                close(fd);
+            return false;
+        }
+        void* core = mmap(
+                        NULL,
+                        (size_t) st.st_size,
+                        PROT_READ,
+                        MAP_PRIVATE,
+                        fd,
+                        0);
+        close(fd);
+        if(core == MAP_FAILED)
+        {
+            heap_printf("ERROR - can't map core file %s\n",core_path);
+            return false;
+        }
+        remote_core__ = (char*) core;
+        remote_core_size__ = (size_t) st.st_size;
+
+        //Only the pages holding chunk headers are to be read from disk:
+        madvise(remote_core__,remote_core_size__,MADV_RANDOM);
+
+        if(!load_core_maps__())
+        {
+            heap_printf("ERROR - %s is not an ELF64 core file\n",core_path);
+            detach_remote_heap();
+            return false;
+        }
+        if(!find_remote_main_heap__(core_path))
+        {
+            detach_remote_heap();
+            return false;
+        }
+        return true;
+    }
+
+    void detach_remote_heap()
+    {
+        if(remote_core__)
+            munmap(remote_core__,remote_core_size__);
+        remote_core__ = (char*) 0;
+        remote_core_size__ = 0;
+        remote_pid__ = 0;
+        remote_num_maps__ = 0;
+        remote_last_map__ = (remote_map_t*) 0;
+        memset(remote_cache_tag__,0,sizeof(remote_cache_tag__));
+        remote_run_end__ = 0;
+        remote_run_pages__ = 0;
+        remote_num_reads__ = 0;
+        remote_num_pages__ = 0;
+        remote_errno__ = 0;
+        remote_main_arena__ = (gen_ar_t*) 0;
+        remote_heap_bottom__ = (size_t*) 0;
+        remote_main_heap_end__ = (size_t*) 0;
+    }
+
+    //Decode the chunk the cursor points to (see load_chunk_cursor__()):
+    static bool load_remote_cursor__(chunk_cursor_t* cur)
+    {
+        size_t* chunk_ptr = cur->chunk_ptr;
+        size_t size_field = 0;
+        if(!peek_remote__(&((chunk_t*) chunk_ptr)->size,&size_field))
+        {
+            cur->bad_chunk_ptr = chunk_ptr;
+            cur->chunk_ptr = (size_t*) 0;
+            return false;
+        }
+        size_t chunk_size = size_field & ~FLAGS_MASK;
+        size_t* next = (size_t*) (((char*) chunk_ptr) + chunk_size);
+        if(!chunk_size && ((chunk_ptr + 2) == cur->seg_end))
+        {
+            //Fencepost at the end of an older heap segment of an arena:
+            cur->chunk_size = 2 * sizeof(size_t);
+            cur->flags = size_field & FLAGS_MASK;
+            cur->next_chunk_ptr = cur->seg_end;
+            cur->is_top = true;
+            cur->in_use = true;
+            return true;
+        }
+        size_t next_size_field = 0;
+        if(!chunk_size || (next > cur->seg_end) ||
+           ((next < cur->seg_end) &&
+                !peek_remote__(&((chunk_t*) next)->size,&next_size_field)))
+        {
+            cur->bad_chunk_ptr = chunk_ptr;
+            cur->chunk_ptr = (size_t*) 0;
+            return false;
+        }
+        cur->chunk_size = chunk_size;
+        cur->flags = size_field & FLAGS_MASK;
+        cur->next_chunk_ptr = next;
+        if(next == cur->seg_end)
+        {
+            cur->is_top = true; //top is always a free chunk
+            cur->in_use = false;
+        }
+        else if(((next + 2) == cur->seg_end) &&
+                !(next_size_field & ~FLAGS_MASK))
+        {
+            //Chunk in front of the zero sized header (part of the fencepost):
+            cur->chunk_size = (size_t) (((char*) cur->seg_end) -
+                                        ((char*) chunk_ptr));
+            cur->next_chunk_ptr = cur->seg_end;
+            cur->is_top = true;
+            cur->in_use = true;
+        }
+        else
+        {
+            cur->is_top = false;
+            cur->in_use = (next_size_field & P__) ? true : false;
+        }
+        return true;
+    }
+
+    //Set the cursor to the bottom chunk of a heap segment of cur->ar_ptr
+    //(hb = NULL for the main heap):
+    static bool enter_remote_segment__(chunk_cursor_t* cur,heap_bott_t* hb)
+    {
+        cur->new_segment = true;
+        cur->hb = hb;
+        cur->prev_hb = (heap_bott_t*) 0;
+        if(!hb)
+        {
+            cur->chunk_ptr = remote_heap_bottom__;
+            cur->seg_end = remote_main_heap_end__;
+            return true;
+        }
+
+        heap_bott_t hi;
+        if(!read_remote__(hb,&hi,sizeof(heap_bott_t)) ||
+           (hi.ar_ptr != cur->ar_ptr) || (hi.size > HEAP_MAX_SIZE) ||
+           !seg_bott_offs__)
+        {
+            return false;
+        }
+        size_t offs = seg_bott_offs__;
+        if((size_t*) hi.ar_ptr == (size_t*) (((char*) hb) + offs))
+            offs = first_seg_bott_offs__; //malloc_state_t is inside
+        cur->chunk_ptr = (size_t*) (((char*) hb) + offs);
+        cur->seg_end = (size_t*) (((char*) hb) + hi.size);
+        cur->prev_hb = hi.prev; //older segment, if of the same arena
+        return true;
+    }
+
+    static bool init_remote_cursor__(chunk_cursor_t* cur)
+    {
+        memset(cur,0,sizeof(chunk_cursor_t));
+        if(!remote_main_arena__)
+            return false;
+        cur->main_heap_end = remote_main_heap_end__;
+        cur->ar_ptr = remote_main_arena__;
+        cur->new_arena = true;
+        remote_ring_hops__ = 0;
+        remote_ring_power__ = 1;
+        remote_ring_mark__ = remote_main_arena__;
+        remote_ring_broken__ = false;
+        enter_remote_segment__(cur,(heap_bott_t*) 0);
+        return load_remote_cursor__(cur);
+    }
+
+    static bool step_remote_cursor__(chunk_cursor_t* cur)
+    {
+        if(!cur->chunk_ptr)
+            return false;
+
+        cur->new_arena = false;
+        cur->new_segment = false;
+
+        if(!cur->is_top)
+        {
+            cur->chunk_ptr = cur->next_chunk_ptr;
+            return load_remote_cursor__(cur);
+        }
+
+        //Top chunk reached -> go ahead with the next (older) heap segment:
+        if(cur->prev_hb && enter_remote_segment__(cur,cur->prev_hb))
+        {
+            ++cur->seg_no;
+            return load_remote_cursor__(cur);
+        }
+
+        //... or with the next arena. The ring of a running process may be
+        //changed behind the check of find_remote_main_arena__(), so a ring
+        //not leading back to the main arena is stopped by a repeated arena
+        //(the mark is moved ahead at hop 1, 2, 4, 8, ... as Brent's cycle
+        //detection does) or by MAX_REMOTE_ARENAS hops:
+        for(;;)
+        {
+            size_t next = 0;
+            size_t top = 0;
+            if(!peek_remote__(&cur->ar_ptr->addr[next_idx__],&next) ||
+               !next || ((gen_ar_t*) next == remote_main_arena__))
+            {
                 break;
-            case _HEAPBADBEGIN:
-                printf("ERROR - bad start of heap\n");
+            }
+            if(((gen_ar_t*) next == remote_ring_mark__) ||
+               (++remote_ring_hops__ > MAX_REMOTE_ARENAS))
+            {
+                remote_ring_broken__ = true;
                 break;
-            case _HEAPBADNODE:
-                printf("ERROR - bad node in heap\n");
+            }
+            if(remote_ring_hops__ == remote_ring_power__)
+            {
+                remote_ring_mark__ = (gen_ar_t*) next;
+                remote_ring_power__ *= 2;
+            }
+            cur->ar_ptr = (gen_ar_t*) next;
+            if(!peek_remote__(&cur->ar_ptr->addr[top_idx__],&top) || !top)
+                continue;
+
+            ++cur->arena_no;
+            cur->seg_no = 0;
+            cur->new_arena = true;
+            if(!enter_remote_segment__(
+                        cur,
+                        get_start_of_allocated_heap_segment((size_t*) top)))
+            {
+                cur->bad_chunk_ptr = (size_t*) top;
+                break;
+            }
+            return load_remote_cursor__(cur);
+        }
+
+        cur->chunk_ptr = (size_t*) 0;
+        return false;
+    }
+
+    //Report a walk stopped on the arena ring (false then):
+    static bool check_remote_ring__()
+    {
+        if(!remote_ring_broken__)
+            return true;
+        heap_printf(
+            "ERROR - the arena ring doesn't lead back to the main arena "
+            "(stopped after %lu arenas)\n",
+            remote_ring_hops__);
+        return false;
+    }
+
+    //Print how many reads were needed:
+    static void print_remote_reads__(size_t num_chunks)
+    {
+        if(remote_core__)
+        {
+            heap_printf(
+                "core file: %lu chunks, %lu MB mapped\n"
+                "\n",
+                num_chunks,
+                remote_core_size__ / (1024 * 1024));
+            return;
+        }
+        heap_printf(
+            "process %d: %lu chunks, %lu process_vm_readv() calls, "
+            "%lu KB read\n"
+            "\n",
+            (int) remote_pid__,
+            num_chunks,
+            remote_num_reads__,
+            (remote_num_pages__ * PAGE) / 1024);
+    }
+
+    void dump_remote_heap_footprint()
+    {
+        sink_flush_t flush_at_return;
+        if(!remote_main_arena__)
+        {
+            heap_printf("ERROR - no process attached\n");
+            return;
+        }
+
+        heap_pipe_t pipe;
+        bool piped = pipelined__ && open_footprint_pipe__(&pipe);
+        chunk_cursor_t cur;
+        bool ok = init_remote_cursor__(&cur);
+        size_t num_chunks = print_heap_footprint_walk__(
+                                        &cur,
+                                        ok,
+                                        step_remote_cursor__,
+                                        remote_heap_bottom__,
+                                        piped ? &pipe : (heap_pipe_t*) 0);
+        check_remote_ring__();
+        print_remote_reads__(num_chunks);
+    }
+
+    void dump_remote_heap_details()
+    {
+        sink_flush_t flush_at_return;
+        if(!remote_main_arena__)
+        {
+            heap_printf("ERROR - no process attached\n");
+            return;
+        }
+
+        chunk_cursor_t cur;
+        bool ok = init_remote_cursor__(&cur);
+        for(;ok;ok = step_remote_cursor__(&cur))
+        {
+            if(cur.new_segment)
+            {
+                if(cur.arena_no || cur.seg_no)
+                    heap_printf("\n");
+                if(!cur.hb)
+                {
+                    heap_printf(
+                        "--------- MAIN ARENA at %p:\n\n",
+                        remote_main_arena__);
+                    heap_printf(
+                        "          HEAP at %p:\n\n",
+                        remote_heap_bottom__);
+                }
+                else
+                {
+                    if(cur.new_arena)
+                    {
+                        heap_printf(
+                            "--------- ALLOCATED ARENA at %p:\n\n",
+                            cur.ar_ptr);
+                    }
+                    heap_printf("          HEAP at %p:\n\n",(size_t*) cur.hb);
+                    heap_bott_t hi;
+                    if(read_remote__(cur.hb,&hi,sizeof(heap_bott_t)))
+                        print_heap_info(cur.hb,&hi);
+                }
+            }
+
+            //Zero sized fencepost at the end of an older heap segment:
+            if(cur.is_top && cur.in_use)
+            {
+                heap_printf(
+                    "%14p +-----------------------------------\n"
+                    "               | FENCEPOST (end of heap segment)\n"
+                    "               +-----------------------------------\n",
+                    cur.chunk_ptr);
+                continue;
+            }
+
+            chunk_t c;
+            if(!read_remote__(cur.chunk_ptr,&c,sizeof(chunk_t)))
+            {
+                cur.bad_chunk_ptr = cur.chunk_ptr;
                 break;
+            }
+            print_chunk(
+                    cur.chunk_ptr,
+                    &c,
+                    cur.is_top,
+                    cur.in_use,
+                    cur.is_top && !cur.hb); //main heap ends at sbrk(0)
+        }
+        if(cur.bad_chunk_ptr)
+        {
+            heap_printf("ERROR - bad chunk at %p\n",cur.bad_chunk_ptr);
+            return;
+        }
+        check_remote_ring__();
+        heap_printf("\n");
+    }
+
+    //Dump the bytes of the remote heap from addr up to end page by page out
+    //of the cache, as HEX (hd) or raw (hd = NULL, up to max_bytes if not 0),
+    //false at the end of the dump (on a page that can't be read or at the
+    //limit):
+    static bool dump_remote_range__(
+                                hex_dump_t* hd,
+                                char* addr,
+                                char* end,
+                                size_t max_bytes,
+                                size_t* output_cnt)
+    {
+        while(addr < end)
+        {
+            const char* ptr = get_remote_page__((size_t) addr);
+            if(!ptr)
+            {
+                if(hd)
+                    flush_hex_dump__(hd);
+                heap_printf("ERROR - can't read %p\n",addr);
+                return false;
+            }
+            ptr += ((size_t) addr) & (PAGE - 1);
+            char* page_end = (char*) ((((size_t) addr) & ~(PAGE - 1)) + PAGE);
+            if(page_end > end)
+                page_end = end;
+            size_t n = (size_t) (page_end - addr);
+            if(hd)
+            {
+                if(!dump_hex_block__(hd,ptr,addr,n))
+                    return false;
+                addr = page_end;
+                continue;
+            }
+            if(max_bytes && ((*output_cnt + n) > max_bytes))
+                n = max_bytes - *output_cnt;
+            heap_sink_write(ptr,n);
+            *output_cnt += n;
+            addr += n;
+            if(max_bytes && (*output_cnt >= max_bytes))
+                return false;
+        }
+        return true;
+    }
+
+    //Dump the main heap and the heap segments of all arenas (the cursor
+    //steps from segment to segment, the chunks are not walked), as HEX (hd)
+    //or raw (hd = NULL):
+    static void dump_remote_segments__(hex_dump_t* hd,uint32 max_kb)
+    {
+        size_t max_bytes = max_kb * 1024; //KB ---> bytes
+        size_t output_cnt = 0;
+        chunk_cursor_t cur;
+        bool ok = init_remote_cursor__(&cur);
+        for(;ok;ok = step_remote_cursor__(&cur))
+        {
+            char* addr = (char*) remote_heap_bottom__;
+            if(cur.hb)
+            {
+                addr = (char*) cur.hb;
+                if(hd)
+                {
+                    if(hd->zero_word_cnt >= 9)
+                        put_hex_zero_run__(hd,addr);
+                    hd->zero_word_cnt = 0;
+                    flush_hex_dump__(hd);
+                    heap_printf(
+                        "\nHEAP at %p (ARENA at %p):\n\n",
+                        cur.hb,
+                        cur.ar_ptr);
+                }
+            }
+            if(!dump_remote_range__(
+                                hd,
+                                addr,
+                                (char*) cur.seg_end,
+                                max_bytes,
+                                &output_cnt))
+            {
+                return;
+            }
+            cur.is_top = true; //go ahead with the next heap segment
+        }
+        if(hd)
+            flush_hex_dump__(hd);
+        if(cur.bad_chunk_ptr)
+            heap_printf("ERROR - bad chunk at %p\n",cur.bad_chunk_ptr);
+        check_remote_ring__();
+    }
+
+    void dump_remote_heap_hex(uint32 max_kb)
+    {
+        sink_flush_t flush_at_return;
+        if(!remote_main_arena__)
+        {
+            heap_printf("ERROR - no process attached\n");
+            return;
+        }
+
+        heap_printf(
+            "MAIN ARENA at %p (MAIN HEAP at %p):\n\n",
+            remote_main_arena__,
+            remote_heap_bottom__);
+
+        hex_dump_t hd;
+        char out[HEX_OUT_BUF_SIZE];
+        init_hex_dump__(&hd,max_kb,get_sink__(),out,sizeof(out));
+        dump_remote_segments__(&hd,max_kb);
+        dump_hex_total__(&hd);
+    }
+
+    void dump_remote_heap_raw(uint32 max_kb)
+    {
+        sink_flush_t flush_at_return;
+        if(!remote_main_arena__)
+        {
+            heap_printf("ERROR - no process attached\n");
+            return;
+        }
+        dump_remote_segments__((hex_dump_t*) 0,max_kb);
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Export the chunks as JSON Lines or CSV:
+//-----------------------------------------------------------------------------
+// A record per chunk, followed by a summary record of its heap segment and
+// of its arena, when the walk leaves them (JSON Lines):
+//
+//   {"record":"chunk","arena":0,"segment":0,"addr":"0x55d0c3a2b000",
+//    "mem_ptr":"0x55d0c3a2b010","size":48,"state":"used","a":0,"m":0,"p":1}
+//   {"record":"segment","arena":0,"segment":0,"addr":"0x55d0c3a2b000",
+//    "size":135168,"chunks":34,"used":1504,"free":133664}
+//   {"record":"arena","arena":0,"addr":"0x7f4b1c9e8c80","size":135168,
+//    "segments":1,"chunks":34,"used":1504,"free":133664}
+//
+// The state is "used", "free" or "top" (free top chunk), the addr of an
+// arena record is its malloc_state. CSV has the same fields in the columns
+// of its header line (empty if not used by the record):
+//
+//   record,arena,segment,addr,mem_ptr,size,state,a,m,p,segments,chunks,...
+//
+// With size_stats__, an arena record has the p50, p99 and max of its used
+// and free chunk sizes too (used_p50,used_p99,used_max,free_p50,...).
+//
+// The lines are put together by hand (no printf()) in a buffer on the stack.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    #define EXPORT_OUT_BUF_SIZE (64 * 1024)
+    #define EXPORT_LINE_MAX 512 //room for the longest record
+
+    struct export_t
+    {
+        unsigned char format; //HEAP_EXPORT_...
+        char* out; //records, not yet written to the sink
+        size_t out_len;
+        heap_stats_t seg; //totals of the current heap segment
+        size_t* seg_start; //first chunk of the current heap segment
+        size_t seg_no;
+        heap_stats_t arena; //totals of the current arena
+        size_t* ar_ptr; //current arena
+        size_t arena_no;
+        bool with_sizes; //arena records have the size quantiles
+        chunk_sizes_t arena_sizes; //size sketches of the current arena
+    };
+
+    static inline char* put_str__(char* o,const char* s)
+    {
+        while(*s)
+            *o++ = *s++;
+        return o;
+    }
+
+    static inline char* put_dec__(char* o,size_t value)
+    {
+        char rev[20]; //2^64 has 20 digits
+        size_t n = 0;
+        do
+        {
+            rev[n++] = (char) ('0' + (value % 10));
+            value /= 10;
+        } while(value);
+        while(n)
+            *o++ = rev[--n];
+        return o;
+    }
+
+    static inline char* put_hex__(char* o,size_t value)
+    {
+        static const char digits[] = "0123456789abcdef";
+        char rev[2 * sizeof(size_t)];
+        size_t n = 0;
+        do
+        {
+            rev[n++] = digits[value & 15];
+            value >>= 4;
+        } while(value);
+        *o++ = '0';
+        *o++ = 'x';
+        while(n)
+            *o++ = rev[--n];
+        return o;
+    }
+
+    //End a CSV record, which has no size quantiles:
+    static inline char* put_csv_eol__(const export_t* ex,char* o)
+    {
+        if(ex->with_sizes)
+            o = put_str__(o,",,,,,,");
+        *o++ = '\n';
+        return o;
+    }
+
+    //Put the p50, p99 and max of a size sketch (JSON Lines or CSV):
+    static char* put_export_quantiles__(
+                                    const export_t* ex,
+                                    char* o,
+                                    const size_hist_t* hist,
+                                    const char* state) //"used" or "free"
+    {
+        const char* names[3] = { "_p50\":", "_p99\":", "_max\":" };
+        size_t values[3];
+        values[0] = get_chunk_size_quantile__(hist,0.50);
+        values[1] = get_chunk_size_quantile__(hist,0.99);
+        values[2] = hist->max;
+        uint32 i = 0;
+        for(;i < 3;++i)
+        {
+            *o++ = ',';
+            if(ex->format == HEAP_EXPORT_JSONL)
+            {
+                *o++ = '"';
+                o = put_str__(o,state);
+                o = put_str__(o,names[i]);
+            }
+            o = put_dec__(o,values[i]);
         }
+        return o;
     }
 
-#else
+    //Get room for a record in the output buffer:
+    static char* get_export_line__(export_t* ex)
+    {
+        if(ex->out_len > (EXPORT_OUT_BUF_SIZE - EXPORT_LINE_MAX))
+        {
+            write_sink__(get_sink__(),ex->out,ex->out_len);
+            ex->out_len = 0;
+        }
+        return ex->out + ex->out_len;
+    }
 
-    void dump_heap_footprint()
+    static void put_export_chunk__(export_t* ex,const chunk_cursor_t* cur)
+    {
+        char* line = get_export_line__(ex);
+        char* o = line;
+        const char* state = cur->in_use ? "used" : "free";
+        if(cur->is_top)
+            state = cur->in_use ? "fencepost" : "top";
+        char a = (cur->flags & A__) ? '1' : '0';
+        char m = (cur->flags & M__) ? '1' : '0';
+        char p = (cur->flags & P__) ? '1' : '0';
+        if(ex->format == HEAP_EXPORT_JSONL)
+        {
+            o = put_str__(o,"{\"record\":\"chunk\",\"arena\":");
+            o = put_dec__(o,cur->arena_no);
+            o = put_str__(o,",\"segment\":");
+            o = put_dec__(o,cur->seg_no);
+            o = put_str__(o,",\"addr\":\"");
+            o = put_hex__(o,(size_t) cur->chunk_ptr);
+            o = put_str__(o,"\",\"mem_ptr\":\"");
+            o = put_hex__(o,(size_t) get_mem_ptr(cur->chunk_ptr));
+            o = put_str__(o,"\",\"size\":");
+            o = put_dec__(o,cur->chunk_size);
+            o = put_str__(o,",\"state\":\"");
+            o = put_str__(o,state);
+            o = put_str__(o,"\",\"a\":");
+            *o++ = a;
+            o = put_str__(o,",\"m\":");
+            *o++ = m;
+            o = put_str__(o,",\"p\":");
+            *o++ = p;
+            o = put_str__(o,"}\n");
+        }
+        else
+        {
+            o = put_str__(o,"chunk,");
+            o = put_dec__(o,cur->arena_no);
+            *o++ = ',';
+            o = put_dec__(o,cur->seg_no);
+            *o++ = ',';
+            o = put_hex__(o,(size_t) cur->chunk_ptr);
+            *o++ = ',';
+            o = put_hex__(o,(size_t) get_mem_ptr(cur->chunk_ptr));
+            *o++ = ',';
+            o = put_dec__(o,cur->chunk_size);
+            *o++ = ',';
+            o = put_str__(o,state);
+            *o++ = ',';
+            *o++ = a;
+            *o++ = ',';
+            *o++ = m;
+            *o++ = ',';
+            *o++ = p;
+            o = put_str__(o,",,,,");
+            o = put_csv_eol__(ex,o);
+        }
+        ex->out_len += (size_t) (o - line);
+    }
+
+    //Put the summary of a heap segment (is_arena == false) or an arena:
+    static void put_export_summary__(export_t* ex,bool is_arena)
+    {
+        const heap_stats_t* st = is_arena ? &ex->arena : &ex->seg;
+        size_t addr = is_arena ? (size_t) ex->ar_ptr : (size_t) ex->seg_start;
+        char* line = get_export_line__(ex);
+        char* o = line;
+        if(ex->format == HEAP_EXPORT_JSONL)
+        {
+            o = put_str__(o,is_arena ? "{\"record\":\"arena\",\"arena\":" :
+                                       "{\"record\":\"segment\",\"arena\":");
+            o = put_dec__(o,ex->arena_no);
+            if(!is_arena)
+            {
+                o = put_str__(o,",\"segment\":");
+                o = put_dec__(o,ex->seg_no);
+            }
+            o = put_str__(o,",\"addr\":\"");
+            o = put_hex__(o,addr);
+            o = put_str__(o,"\",\"size\":");
+            o = put_dec__(o,st->heap_size);
+            if(is_arena)
+            {
+                o = put_str__(o,",\"segments\":");
+                o = put_dec__(o,st->num_segments);
+            }
+            o = put_str__(o,",\"chunks\":");
+            o = put_dec__(o,st->num_chunks);
+            o = put_str__(o,",\"used\":");
+            o = put_dec__(o,st->used_total);
+            o = put_str__(o,",\"free\":");
+            o = put_dec__(o,st->free_total);
+            if(is_arena && ex->with_sizes)
+            {
+                o = put_export_quantiles__(ex,o,&ex->arena_sizes.used,"used");
+                o = put_export_quantiles__(ex,o,&ex->arena_sizes.free,"free");
+            }
+            o = put_str__(o,"}\n");
+        }
+        else
+        {
+            o = put_str__(o,is_arena ? "arena," : "segment,");
+            o = put_dec__(o,ex->arena_no);
+            *o++ = ',';
+            if(!is_arena)
+                o = put_dec__(o,ex->seg_no);
+            *o++ = ',';
+            o = put_hex__(o,addr);
+            *o++ = ',';
+            *o++ = ',';
+            o = put_dec__(o,st->heap_size);
+            o = put_str__(o,",,,,,");
+            if(is_arena)
+                o = put_dec__(o,st->num_segments);
+            *o++ = ',';
+            o = put_dec__(o,st->num_chunks);
+            *o++ = ',';
+            o = put_dec__(o,st->used_total);
+            *o++ = ',';
+            o = put_dec__(o,st->free_total);
+            if(is_arena && ex->with_sizes)
+            {
+                o = put_export_quantiles__(ex,o,&ex->arena_sizes.used,"used");
+                o = put_export_quantiles__(ex,o,&ex->arena_sizes.free,"free");
+                *o++ = '\n';
+            }
+            else
+            {
+                o = put_csv_eol__(ex,o);
+            }
+        }
+        ex->out_len += (size_t) (o - line);
+    }
+
+    static void put_export_error__(export_t* ex,size_t* bad_chunk_ptr)
+    {
+        char* line = get_export_line__(ex);
+        char* o = line;
+        if(ex->format == HEAP_EXPORT_JSONL)
+        {
+            o = put_str__(o,"{\"record\":\"bad_chunk\",\"addr\":\"");
+            o = put_hex__(o,(size_t) bad_chunk_ptr);
+            o = put_str__(o,"\"}\n");
+        }
+        else
+        {
+            o = put_str__(o,"bad_chunk,,,");
+            o = put_hex__(o,(size_t) bad_chunk_ptr);
+            o = put_str__(o,",,,,,,,,,,");
+            o = put_csv_eol__(ex,o);
+        }
+        ex->out_len += (size_t) (o - line);
+    }
+
+    //Export all chunks of an initialized cursor (stepped by 'step'):
+    static void export_heap_walk__(
+                                unsigned char format,
+                                chunk_cursor_t* cur,
+                                bool ok, //result of the cursor init
+                                bool (*step)(chunk_cursor_t* cur))
+    {
+        char out[EXPORT_OUT_BUF_SIZE];
+        export_t ex;
+        memset(&ex,0,sizeof(ex));
+        ex.format = format;
+        ex.out = out;
+        ex.with_sizes = size_stats__;
+        if(format == HEAP_EXPORT_CSV)
+        {
+            char* o = put_str__(
+                        out,
+                        "record,arena,segment,addr,mem_ptr,size,state,a,m,p,"
+                        "segments,chunks,used,free");
+            if(ex.with_sizes)
+            {
+                o = put_str__(
+                        o,
+                        ",used_p50,used_p99,used_max,free_p50,free_p99,"
+                        "free_max");
+            }
+            *o++ = '\n';
+            ex.out_len = (size_t) (o - out);
+        }
+
+        bool in_arena = false;
+        for(;ok;ok = step(cur))
+        {
+            if(in_arena && (cur->new_arena || cur->new_segment))
+                put_export_summary__(&ex,false);
+            if(in_arena && cur->new_arena)
+                put_export_summary__(&ex,true);
+            if(!in_arena || cur->new_arena)
+            {
+                memset(&ex.arena,0,sizeof(heap_stats_t));
+                if(ex.with_sizes)
+                    memset(&ex.arena_sizes,0,sizeof(chunk_sizes_t));
+                ex.ar_ptr = (size_t*) cur->ar_ptr;
+                ex.arena_no = cur->arena_no;
+                in_arena = true;
+            }
+            if(!ex.arena.num_segments || cur->new_segment)
+            {
+                memset(&ex.seg,0,sizeof(heap_stats_t));
+                ex.seg_start = cur->chunk_ptr;
+                ex.seg_no = cur->seg_no;
+                ++ex.arena.num_segments;
+            }
+
+            put_export_chunk__(&ex,cur);
+            if(cur->is_top && cur->in_use)
+                continue; //fencepost, no chunk
+            heap_stats_t st;
+            memset(&st,0,sizeof(st));
+            st.num_chunks = 1;
+            st.heap_size = cur->chunk_size;
+            if(cur->in_use)
+                st.used_total = cur->chunk_size;
+            else
+                st.free_total = cur->chunk_size;
+            merge_heap_stats(&ex.seg,&st);
+            merge_heap_stats(&ex.arena,&st);
+            if(ex.with_sizes)
+                add_chunk_size(&ex.arena_sizes,cur->chunk_size,cur->in_use);
+        }
+        if(in_arena)
+        {
+            put_export_summary__(&ex,false);
+            put_export_summary__(&ex,true);
+        }
+        if(cur->bad_chunk_ptr)
+            put_export_error__(&ex,cur->bad_chunk_ptr);
+        write_sink__(get_sink__(),ex.out,ex.out_len);
+    }
+
+    void dump_heap_export(unsigned char format)
     {
+        sink_flush_t flush_at_return;
         if(!heap_bottom_chunk__)
         {
-            printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return;
+        }
+        if((format != HEAP_EXPORT_JSONL) && (format != HEAP_EXPORT_CSV))
+        {
+            heap_printf("ERROR - unknown export format %u\n",format);
             return;
         }
 
-        //Start with the main arena:
-        gen_ar_t* ar_ptr = main_arena_ptr__;
-        size_t* chunk_ptr = heap_bottom_chunk__;
+        chunk_cursor_t cur;
+        bool ok = false;
+        cursor_step_t step = step_chunk_cursor;
+        if(!begin_own_walk__(&cur,&ok,&step,true))
+            return;
+        export_heap_walk__(format,&cur,ok,step);
+        end_own_walk__(false); //records only
+    }
 
-        //Storage for heap bottoms of further arenas:
-        size_t baddr_arr[MAX_NUM_HEAPS]; //bottom pointer addresses as size_t
-        memset(baddr_arr,0,sizeof(size_t) * MAX_NUM_HEAPS);
-        size_t* baddr_arr_ptr = (size_t*) &baddr_arr[0];
-        size_t bott_idx = 0;
-        size_t num_botts = 0;
+    void dump_remote_heap_export(unsigned char format)
+    {
+        sink_flush_t flush_at_return;
+        if(!remote_main_arena__)
+        {
+            heap_printf("ERROR - no process attached\n");
+            return;
+        }
+        if((format != HEAP_EXPORT_JSONL) && (format != HEAP_EXPORT_CSV))
+        {
+            heap_printf("ERROR - unknown export format %u\n",format);
+            return;
+        }
 
-        size_t used_total = 0;
-        size_t free_total = 0;
-        size_t heap_size = 0;
-        bool in_use = false;
-        void* mem_ptr = (void*) 0;
-        size_t chunk_size = 0;
-        size_t* next_chunk_ptr = (size_t*) 0;
-        printf("--------- MAIN ARENA: ---------\n\n");
+        chunk_cursor_t cur;
+        bool ok = init_remote_cursor__(&cur);
+        export_heap_walk__(format,&cur,ok,step_remote_cursor__);
+        check_remote_ring__();
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the largest chunks per arena:
+//-----------------------------------------------------------------------------
+// The largest used chunks and the largest free chunks of an arena are kept
+// in two min-heaps of a fixed size (binary heaps in an array):
+//
+//                     [0]          root = smallest candidate
+//                    /   \         a parent is not larger than its children:
+//                  [1]   [2]       entry[i] <= entry[2 * i + 1]
+//                  / \   / \       entry[i] <= entry[2 * i + 2]
+//                [3] [4] [5] [6]
+//
+// As long as a heap is not full, a chunk is added at the end and sifted up.
+// Then a chunk not larger than the root is rejected by a single compare,
+// a larger one replaces the root and is sifted down, so the walk takes
+// O(chunks * log(num)) in the worst case and just O(chunks) for most heaps.
+// When the walk leaves an arena, the heaps are emptied root by root into
+// their own tail (in-place heap sort), which leaves them largest first.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    struct top_entry_t
+    {
+        size_t* chunk_ptr;
+        size_t chunk_size;
+        size_t seg_no; //heap segment of the chunk in its arena
+    };
+
+    struct top_heap_t //min-heap of the largest chunks (root = smallest)
+    {
+        top_entry_t entry[MAX_TOP_CHUNKS];
+        uint32 num; //entries in the heap
+        uint32 max; //entries wanted
+        size_t num_seen; //chunks offered to the heap
+    };
+
+    static void reset_top_heap__(top_heap_t* h,uint32 max)
+    {
+        h->num = 0;
+        h->max = max;
+        h->num_seen = 0;
+    }
+
+    static void sift_top_down__(top_heap_t* h,uint32 i)
+    {
+        top_entry_t e = h->entry[i];
         for(;;)
         {
-            chunk_size = get_chunk_size(chunk_ptr);
-            if(!chunk_size)
+            uint32 child = 2 * i + 1;
+            if(child >= h->num)
+                break;
+            if(((child + 1) < h->num) &&
+               (h->entry[child + 1].chunk_size < h->entry[child].chunk_size))
             {
-                printf("ERROR - bad chunk at %p\n",chunk_ptr);
-                return;
+                ++child;
             }
-            heap_size += chunk_size;
+            if(h->entry[child].chunk_size >= e.chunk_size)
+                break;
+            h->entry[i] = h->entry[child];
+            i = child;
+        }
+        h->entry[i] = e;
+    }
 
-            if(is_top_chunk(chunk_ptr))
+    static inline void add_top_chunk__(
+                                    top_heap_t* h,
+                                    const chunk_cursor_t* cur)
+    {
+        ++h->num_seen;
+        top_entry_t e;
+        e.chunk_ptr = cur->chunk_ptr;
+        e.chunk_size = cur->chunk_size;
+        e.seg_no = cur->seg_no;
+        if(h->num < h->max)
+        {
+            //Add the chunk at the end and sift it up:
+            uint32 i = h->num++;
+            for(;i;)
             {
-                free_total += chunk_size;
-                printf(
-                    "%14p  * !HEAP TOP CHUNK! * %10lu bytes FREE\n",
-                    chunk_ptr,
-                    chunk_size);
-                if(ar_ptr)
-                {
-                    //Try to get the bottom of the next heap of the arena:
-                    if(++bott_idx < num_botts)
-                    {
-                        chunk_ptr = (size_t*) baddr_arr[bott_idx];
-                        if(chunk_ptr)
-                        {
-                            printf("\n");
-                            continue; //dump next heap
-                        }
-                    }
+                uint32 parent = (i - 1) / 2;
+                if(h->entry[parent].chunk_size <= e.chunk_size)
+                    break;
+                h->entry[i] = h->entry[parent];
+                i = parent;
+            }
+            h->entry[i] = e;
+            return;
+        }
+        if(e.chunk_size <= h->entry[0].chunk_size)
+            return; //not larger than the smallest candidate
+        h->entry[0] = e; //replace the root and sift it down
+        sift_top_down__(h,0);
+    }
 
-                    //Delete all heap bottoms:
-                    memset(baddr_arr,0,sizeof(size_t) * MAX_NUM_HEAPS);
-                    bott_idx = 0;
-                    num_botts = 0;
+    //Empty the heap into its own tail (entries are largest first then):
+    static uint32 sort_top_heap__(top_heap_t* h)
+    {
+        uint32 num = h->num;
+        for(;h->num > 1;)
+        {
+            top_entry_t smallest = h->entry[0];
+            h->entry[0] = h->entry[--h->num];
+            sift_top_down__(h,0);
+            h->entry[h->num] = smallest;
+        }
+        h->num = 0;
+        return num;
+    }
 
-                    //Try to get another arena:
-                    ar_ptr = (gen_ar_t*) get_next_arena((size_t*) ar_ptr);
-                    if(ar_ptr)
-                    {
-                        //Get all heap bottoms of the arena:
-                        num_botts = get_all_bottom_chunks_of_arena(
-                                                       ar_ptr->addr[top_idx__],
-                                                       &baddr_arr_ptr,
-                                                       MAX_NUM_HEAPS);
-                        if(num_botts)
-                            chunk_ptr = (size_t*) baddr_arr[bott_idx];
-
-                        //Start next arena in case:
-                        if(chunk_ptr)
-                        {
-                            printf("\n");
-                            printf("--------- NEXT ARENA: ---------\n\n");
-                            continue;
-                        }
-                    }
-                }
-                break;
+    static void print_top_heap__(top_heap_t* h,const char* state)
+    {
+        uint32 num = sort_top_heap__(h);
+        heap_printf(
+            "LARGEST %u %s CHUNKS (of %lu):\n",
+            num,
+            state,
+            h->num_seen);
+        uint32 i = 0;
+        for(;i < num;++i)
+        {
+            const top_entry_t* e = &h->entry[i];
+            heap_printf(
+                "%4u %14p  mem: %14p  %10lu bytes  SEGMENT %lu\n",
+                i + 1,
+                e->chunk_ptr,
+                get_mem_ptr(e->chunk_ptr),
+                e->chunk_size,
+                e->seg_no);
+        }
+        heap_printf("\n");
+    }
+
+    static void print_top_arena__(
+                                top_heap_t* used,
+                                top_heap_t* holes,
+                                gen_ar_t* ar_ptr,
+                                size_t arena_no)
+    {
+        if(arena_no)
+        {
+            heap_printf(
+                "--------- ARENA %lu at %p: ---------\n\n",
+                arena_no,
+                ar_ptr);
+        }
+        else
+        {
+            heap_printf("--------- MAIN ARENA at %p: ---------\n\n",ar_ptr);
+        }
+        print_top_heap__(used,"USED");
+        print_top_heap__(holes,"FREE");
+    }
+
+    //Rank the chunks of an initialized cursor (stepped by 'step'):
+    static void top_heap_walk__(
+                                uint32 num,
+                                chunk_cursor_t* cur,
+                                bool ok, //result of the cursor init
+                                bool (*step)(chunk_cursor_t* cur))
+    {
+        if(!num)
+            num = 1;
+        if(num > MAX_TOP_CHUNKS)
+            num = MAX_TOP_CHUNKS;
+
+        top_heap_t used; //largest used chunks
+        top_heap_t holes; //largest free chunks
+        gen_ar_t* ar_ptr = (gen_ar_t*) 0;
+        size_t arena_no = 0;
+        bool in_arena = false;
+        for(;ok;ok = step(cur))
+        {
+            if(in_arena && cur->new_arena)
+                print_top_arena__(&used,&holes,ar_ptr,arena_no);
+            if(!in_arena || cur->new_arena)
+            {
+                reset_top_heap__(&used,num);
+                reset_top_heap__(&holes,num);
+                ar_ptr = cur->ar_ptr;
+                arena_no = cur->arena_no;
+                in_arena = true;
+            }
+            if(cur->is_top)
+                continue; //top chunk (or fencepost of an older segment)
+            add_top_chunk__(cur->in_use ? &used : &holes,cur);
+        }
+        if(in_arena)
+            print_top_arena__(&used,&holes,ar_ptr,arena_no);
+        if(cur->bad_chunk_ptr)
+            heap_printf("ERROR - bad chunk at %p\n",cur->bad_chunk_ptr);
+    }
+
+    void dump_heap_top(uint32 num)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return;
+        }
+
+        chunk_cursor_t cur;
+        bool ok = false;
+        cursor_step_t step = step_chunk_cursor;
+        if(!begin_own_walk__(&cur,&ok,&step,true))
+            return;
+        top_heap_walk__(num,&cur,ok,step);
+        end_own_walk__(true);
+    }
+
+    void dump_remote_heap_top(uint32 num)
+    {
+        sink_flush_t flush_at_return;
+        if(!remote_main_arena__)
+        {
+            heap_printf("ERROR - no process attached\n");
+            return;
+        }
+
+        chunk_cursor_t cur;
+        bool ok = init_remote_cursor__(&cur);
+        top_heap_walk__(num,&cur,ok,step_remote_cursor__);
+        check_remote_ring__();
+    }
+
+#endif
+
+//-----------------------------------------------------------------------------
+// Heap snapshot file (columnar binary format):
+//-----------------------------------------------------------------------------
+// The chunk cursor (or the cursor over another process) is walked once. The
+// arena table, the segment table and the columns grow in anonymous mappings
+// (mremap() doubles them), not on the heap, which is walked. Afterwards the
+// header, the tables and the columns are written one after the other, then
+// the payload pages of the heap segments, if wanted.
+//
+// Reading maps the file and checks the header once. The snapshot cursor
+// then decodes one varint per column and chunk, so a snapshot is read at
+// about memory bandwidth.
+//-----------------------------------------------------------------------------
+// Attention: do not allocate heap inside (no STL) -> only use stack!!!
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+    #define SNAP_MIN_COLUMN_SIZE (1024 * 1024) //first mapping of a column
+    #define SNAP_COPY_BUF_SIZE (64 * 1024)
+
+    struct snap_column_t //growing anonymous mapping
+    {
+        char* base;
+        size_t size; //bytes used
+        size_t cap; //bytes mapped
+    };
+
+    static bool reserve_snap_column__(snap_column_t* col,size_t more)
+    {
+        if((col->size + more) <= col->cap)
+            return true;
+        size_t cap = col->cap ? col->cap : SNAP_MIN_COLUMN_SIZE;
+        while(cap < (col->size + more))
+            cap *= 2;
+        void* base = col->base ?
+                        mremap(col->base,col->cap,cap,MREMAP_MAYMOVE) :
+                        mmap(
+                            (void*) 0,
+                            cap,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1,
+                            0);
+        if(base == MAP_FAILED)
+            return false;
+        col->base = (char*) base;
+        col->cap = cap;
+        return true;
+    }
+
+    static void free_snap_column__(snap_column_t* col)
+    {
+        if(col->base)
+            munmap(col->base,col->cap);
+        memset(col,0,sizeof(snap_column_t));
+    }
+
+    //Append an unsigned LEB128 varint (7 bits per byte, low bits first):
+    static inline bool put_snap_varint__(snap_column_t* col,uint64 value)
+    {
+        if(!reserve_snap_column__(col,10))
+            return false;
+        unsigned char* p = (unsigned char*) (col->base + col->size);
+        for(;value >= 0x80;value >>= 7)
+            *p++ = (unsigned char) (value | 0x80);
+        *p++ = (unsigned char) value;
+        col->size = (size_t) (((char*) p) - col->base);
+        return true;
+    }
+
+    static inline bool get_snap_varint__(
+                                    const unsigned char** pos,
+                                    const unsigned char* end,
+                                    uint64* value)
+    {
+        const unsigned char* p = *pos;
+        uint64 v = 0;
+        uint32 shift = 0;
+        for(;(p < end) && (shift < 64);shift += 7)
+        {
+            unsigned char b = *p++;
+            v |= ((uint64) (b & 0x7f)) << shift;
+            if(!(b & 0x80))
+            {
+                *pos = p;
+                *value = v;
+                return true;
             }
+        }
+        return false;
+    }
+
+    static uint64 get_snap_time_ns__()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME,&ts);
+        return ((uint64) ts.tv_sec) * 1000000000ULL + (uint64) ts.tv_nsec;
+    }
+
+    //Write a column (or table) at the current file offset and pad it to 8:
+    static bool write_snap_section__(
+                                int fd,
+                                const char* buf,
+                                size_t size,
+                                uint64* offs, //in: current, out: next
+                                uint64* section_offs) //or NULL
+    {
+        static const char zeros[8] = {0};
+        if(section_offs)
+            *section_offs = *offs;
+        size_t pad = (8 - (size & 7)) & 7;
+        if(!write_all__(fd,buf,size) || !write_all__(fd,zeros,pad))
+            return false;
+        *offs += size + pad;
+        return true;
+    }
 
-            mem_ptr = get_mem_ptr(chunk_ptr);
+    //Copy the bytes of all heap segments into the file (by 'read', so the
+    //memory may as well be the one of another process):
+    static bool write_snap_payload__(
+                            int fd,
+                            snap_segment_t* segs,
+                            size_t num_segs,
+                            bool (*read)(const void* p,void* buf,size_t len),
+                            uint64* offs)
+    {
+        char buf[SNAP_COPY_BUF_SIZE];
+        size_t i = 0;
+        for(;i < num_segs;++i)
+        {
+            segs[i].payload_offs = *offs;
+            size_t addr = (size_t) segs[i].start;
+            size_t end = (size_t) segs[i].end;
+            while(addr < end)
+            {
+                size_t len = end - addr;
+                if(len > sizeof(buf))
+                    len = sizeof(buf);
+                if(!read((const void*) addr,buf,len))
+                    memset(buf,0,len); //unreadable pages are zeros
+                if(!write_all__(fd,buf,len))
+                    return false;
+                addr += len;
+            }
+            size_t pad = (8 - ((end - (size_t) segs[i].start) & 7)) & 7;
+            memset(buf,0,8);
+            if(!write_all__(fd,buf,pad))
+                return false;
+            *offs += (end - (size_t) segs[i].start) + pad;
+        }
+        return true;
+    }
 
-            in_use = is_in_use(chunk_ptr);
+    static bool read_own_memory__(const void* addr,void* buf,size_t len)
+    {
+        memcpy(buf,addr,len);
+        return true;
+    }
 
-            printf(
-                "%14p  mem: %14p  %10lu bytes %s\n",
-                chunk_ptr,
-                mem_ptr,
-                chunk_size,
-                in_use ? "USED" : "FREE");
+    //Walk an initialized cursor into a snapshot file (the cursor is stepped
+    //by 'step' and the payload is read by 'read', so the walk may as well
+    //read another process):
+    static bool write_heap_snapshot_walk__(
+                            chunk_cursor_t* cur,
+                            bool ok, //result of the cursor init
+                            bool (*step)(chunk_cursor_t* cur),
+                            bool (*read)(const void* p,void* buf,size_t len),
+                            const char* path,
+                            bool with_payload,
+                            size_t* heap_bottom,
+                            size_t* main_heap_end,
+                            size_t* num_chunks) //out
+    {
+        snap_header_t header;
+        memset(&header,0,sizeof(snap_header_t));
+        memcpy(header.magic,SNAP_MAGIC,sizeof(header.magic));
+        header.version = SNAP_VERSION;
+        header.sbrk_start = (uint64) (size_t) heap_bottom;
+        header.sbrk_end = (uint64) (size_t) main_heap_end;
+        header.time_start_ns = get_snap_time_ns__();
+
+        snap_column_t arenas;
+        snap_column_t segs;
+        snap_column_t addrs;
+        snap_column_t sizes;
+        snap_column_t flags;
+        snap_column_t arena_ids;
+        memset(&arenas,0,sizeof(snap_column_t));
+        memset(&segs,0,sizeof(snap_column_t));
+        memset(&addrs,0,sizeof(snap_column_t));
+        memset(&sizes,0,sizeof(snap_column_t));
+        memset(&flags,0,sizeof(snap_column_t));
+        memset(&arena_ids,0,sizeof(snap_column_t));
+
+        bool mapped = true;
+        size_t expected_addr = 0; //behind the previous chunk
+        snap_arena_t* arena = (snap_arena_t*) 0;
+        snap_segment_t* seg = (snap_segment_t*) 0;
+        for(;ok && mapped;ok = step(cur))
+        {
+            if(cur->new_arena || !arena)
+            {
+                mapped = reserve_snap_column__(&arenas,sizeof(snap_arena_t));
+                if(!mapped)
+                    break;
+                arena = (snap_arena_t*) (arenas.base + arenas.size);
+                arenas.size += sizeof(snap_arena_t);
+                memset(arena,0,sizeof(snap_arena_t));
+                arena->ar_ptr = (uint64) (size_t) cur->ar_ptr;
+                ++header.num_arenas;
+            }
+            if(cur->new_segment || cur->new_arena || !seg)
+            {
+                mapped = reserve_snap_column__(&segs,sizeof(snap_segment_t));
+                if(!mapped)
+                    break;
+                seg = (snap_segment_t*) (segs.base + segs.size);
+                segs.size += sizeof(snap_segment_t);
+                memset(seg,0,sizeof(snap_segment_t));
+                seg->start = (uint64) (size_t) cur->chunk_ptr;
+                seg->end = (uint64) (size_t) cur->seg_end;
+                seg->arena_id = header.num_arenas - 1;
+                seg->first_chunk = header.num_chunks;
+                ++header.num_segments;
+                ++arena->num_segments;
+            }
 
-            if(in_use)
-                used_total += chunk_size;
+            //Zigzag encoding of the signed address delta:
+            int64 delta = (int64) ((size_t) cur->chunk_ptr - expected_addr);
+            uint64 zigzag = (((uint64) delta) << 1) ^ (uint64) (delta >> 63);
+            expected_addr = (size_t) cur->chunk_ptr + cur->chunk_size;
+            unsigned char nibble = (unsigned char)
+                            (cur->flags | (cur->in_use ? SNAP_USED : 0));
+            if(!(header.num_chunks & 1))
+            {
+                mapped = reserve_snap_column__(&flags,1);
+                if(!mapped)
+                    break;
+                flags.base[flags.size++] = (char) nibble;
+            }
+            else
+            {
+                flags.base[flags.size - 1] |= (char) (nibble << 4);
+            }
+            mapped = put_snap_varint__(&addrs,zigzag) &&
+                     put_snap_varint__(
+                                &sizes,
+                                cur->chunk_size >> SNAP_SIZE_SHIFT) &&
+                     put_snap_varint__(&arena_ids,header.num_arenas - 1);
+
+            ++header.num_chunks;
+            ++seg->num_chunks;
+            ++arena->num_chunks;
+            if(cur->is_top && cur->in_use)
+                continue; //fencepost, neither used nor free
+            if(cur->in_use)
+                arena->used_total += cur->chunk_size;
             else
-                free_total += chunk_size;
+                arena->free_total += cur->chunk_size;
+        }
+        header.time_end_ns = get_snap_time_ns__();
+        *num_chunks = (size_t) header.num_chunks;
 
-            next_chunk_ptr = get_next_chunk(chunk_ptr);
-            chunk_ptr = next_chunk_ptr;
+        bool written = false;
+        int fd = -1;
+        if(!mapped)
+        {
+            heap_printf("ERROR - cannot map the snapshot columns\n");
+        }
+        else if(cur->bad_chunk_ptr)
+        {
+            heap_printf("ERROR - bad chunk at %p\n",cur->bad_chunk_ptr);
+        }
+        else if((fd = open(path,O_WRONLY | O_CREAT | O_TRUNC,0644)) < 0)
+        {
+            heap_printf("ERROR - can't create %s: %s\n",path,strerror(errno));
+        }
+        else
+        {
+            //Header first (rewritten at the end, when all offsets are known):
+            uint64 offs = 0;
+            header.addr_size = addrs.size;
+            header.size_size = sizes.size;
+            header.flags_size = flags.size;
+            header.arena_id_size = arena_ids.size;
+            written =
+                write_snap_section__(
+                        fd,(const char*) &header,sizeof(header),&offs,0) &&
+                write_snap_section__(
+                        fd,arenas.base,arenas.size,&offs,&header.arena_offs) &&
+                write_snap_section__(
+                        fd,segs.base,segs.size,&offs,&header.segment_offs) &&
+                write_snap_section__(
+                        fd,addrs.base,addrs.size,&offs,&header.addr_offs) &&
+                write_snap_section__(
+                        fd,sizes.base,sizes.size,&offs,&header.size_offs) &&
+                write_snap_section__(
+                        fd,flags.base,flags.size,&offs,&header.flags_offs) &&
+                write_snap_section__(
+                        fd,
+                        arena_ids.base,
+                        arena_ids.size,
+                        &offs,
+                        &header.arena_id_offs);
+            if(written && with_payload)
+            {
+                header.payload_offs = offs;
+                written = write_snap_payload__(
+                                        fd,
+                                        (snap_segment_t*) segs.base,
+                                        header.num_segments,
+                                        read,
+                                        &offs);
+                header.payload_size = offs - header.payload_offs;
+
+                //The segment table now holds the payload offsets:
+                written = written &&
+                    (pwrite(
+                        fd,
+                        segs.base,
+                        segs.size,
+                        (off_t) header.segment_offs) == (ssize_t) segs.size);
+            }
+            header.file_size = offs;
+            written = written &&
+                (pwrite(fd,&header,sizeof(header),0) ==
+                                                (ssize_t) sizeof(header));
+            if(close(fd))
+                written = false;
+            if(!written)
+            {
+                heap_printf(
+                    "ERROR - can't write %s: %s\n",
+                    path,
+                    strerror(errno));
+            }
         }
 
-        printf(
-            "\n"
-            "                 +--------------------------+ STACK TOP\n"
-            "                 |          STACK           |\n"
-            "                 +---||------||-------||----+\n"
-            "                 |   \\/      \\/       \\/    |\n"
-            "                 |        Free Space        |\n"
-            "                 |   /\\      /\\       /\\    |\n"
-            "                 +---||------||-------||----+\n"
-            "                 |                          |\n"
-            "                 |          HEAP            |\n"
-            "                 | %10lu %s size       |\n"
-            "                 |                          |\n"
-            "                 | %10lu %s used       |\n"
-            "                 | %10lu %s free       |\n"
-            "                 |                          |\n"
-            "%16p +--------------------------+ HEAP BOTTOM\n"
-            "\n",
-            HUMAN_READABLE_MEM_SIZE__(heap_size),
-            HUMAN_READABLE_MEM_UNIT_2__(heap_size),
-            HUMAN_READABLE_MEM_SIZE__(used_total),
-            HUMAN_READABLE_MEM_UNIT_2__(used_total),
-            HUMAN_READABLE_MEM_SIZE__(free_total),
-            HUMAN_READABLE_MEM_UNIT_2__(free_total),
-            heap_bottom_chunk__);
+        if(written)
+        {
+            heap_printf(
+                "snapshot %s: %lu arenas, %lu heaps, %lu chunks, "
+                "%lu KB (%.3lf ms walk)\n"
+                "\n",
+                path,
+                (size_t) header.num_arenas,
+                (size_t) header.num_segments,
+                (size_t) header.num_chunks,
+                (size_t) (header.file_size / 1024),
+                (double) (header.time_end_ns - header.time_start_ns) /
+                                                                1000000.0);
+        }
+        free_snap_column__(&arenas);
+        free_snap_column__(&segs);
+        free_snap_column__(&addrs);
+        free_snap_column__(&sizes);
+        free_snap_column__(&flags);
+        free_snap_column__(&arena_ids);
+        return written;
     }
 
-#endif
-
-//-----------------------------------------------------------------------------
-// Dump heap details for debugging:
-//-----------------------------------------------------------------------------
-// Attention: do not allocate heap inside (no STL) -> only use stack!!!
-//-----------------------------------------------------------------------------
+    bool write_heap_snapshot(const char* path,bool with_payload)
+    {
+        sink_flush_t flush_at_return;
+        if(!heap_bottom_chunk__)
+        {
+            heap_printf("ERROR - heap_bottom_chunk__ was not initialized\n");
+            return false;
+        }
 
-#if defined(_WIN32) || defined(_WIN64)
+        chunk_cursor_t cur;
+        size_t num_chunks = 0;
+        bool ok = init_chunk_cursor(&cur,heap_bottom_chunk__);
+        return write_heap_snapshot_walk__(
+                                    &cur,
+                                    ok,
+                                    step_chunk_cursor,
+                                    read_own_memory__,
+                                    path,
+                                    with_payload,
+                                    heap_bottom_chunk__,
+                                    cur.main_heap_end,
+                                    &num_chunks);
+    }
 
-    void dump_heap_details(
-                    size_t* /* start_chunk */,
-                    size_t* /* heap_top_end */) //first invalid address
+    bool write_remote_heap_snapshot(const char* path,bool with_payload)
     {
-        _HEAPINFO hi;
-        hi._pentry = NULL; //initate _heapwalk()
-
-        size_t* chunk_ptr = (size_t*) 0;
-        int heap_status = 0;
-        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+        sink_flush_t flush_at_return;
+        if(!remote_main_arena__)
         {
-            chunk_ptr = (size_t*) ((char*) hi._pentry);
-            dump_chunk(chunk_ptr,hi._size);
+            heap_printf("ERROR - no process attached\n");
+            return false;
         }
-        printf("\n");
+
+        chunk_cursor_t cur;
+        size_t num_chunks = 0;
+        bool ok = init_remote_cursor__(&cur);
+        bool written = write_heap_snapshot_walk__(
+                                            &cur,
+                                            ok,
+                                            step_remote_cursor__,
+                                            read_remote__,
+                                            path,
+                                            with_payload,
+                                            remote_heap_bottom__,
+                                            remote_main_heap_end__,
+                                            &num_chunks);
+        written = check_remote_ring__() && written;
+        print_remote_reads__(num_chunks);
+        return written;
     }
 
-#else
+    //Check that a section lies inside the file:
+    static bool is_snap_section__(
+                                const heap_snapshot_t* snap,
+                                uint64 offs,
+                                uint64 size)
+    {
+        return (offs <= snap->image_size) &&
+               (size <= (snap->image_size - offs)) &&
+               !(offs & 7);
+    }
 
-    void dump_heap_details(
-                    size_t* start_chunk,
-                    size_t* heap_top_end) //first invalid address
+    bool open_heap_snapshot(heap_snapshot_t* snap,const char* path)
     {
-        if(!start_chunk)
+        sink_flush_t flush_at_return;
+        memset(snap,0,sizeof(heap_snapshot_t));
+        int fd = open(path,O_RDONLY);
+        struct stat st;
+        if((fd < 0) || fstat(fd,&st) ||
+           ((size_t) st.st_size < sizeof(snap_header_t)))
         {
-            printf("ERROR - start_chunk address is missing\n");
-            return;
+            heap_printf("ERROR - can't open snapshot %s\n",path);
+            if(fd >= 0)
+                close(fd);
+            return false;
         }
-        if(!heap_top_end)
+        void* image = mmap(
+                        NULL,
+                        (size_t) st.st_size,
+                        PROT_READ,
+                        MAP_PRIVATE,
+                        fd,
+                        0);
+        close(fd);
+        if(image == MAP_FAILED)
         {
-            printf("ERROR - heap top address is missing\n");
-            return;
+            heap_printf("ERROR - can't map snapshot %s\n",path);
+            return false;
         }
-        if(start_chunk >= heap_top_end)
+        snap->image = (const char*) image;
+        snap->image_size = (size_t) st.st_size;
+
+        //The columns are read front to back:
+        madvise(image,snap->image_size,MADV_SEQUENTIAL);
+
+        const snap_header_t* h = (const snap_header_t*) snap->image;
+        if(memcmp(h->magic,SNAP_MAGIC,sizeof(h->magic)) ||
+           (h->version != SNAP_VERSION) ||
+           (h->file_size > snap->image_size) ||
+           (h->num_arenas > (snap->image_size / sizeof(snap_arena_t))) ||
+           (h->num_segments > (snap->image_size / sizeof(snap_segment_t))) ||
+           !is_snap_section__(
+                        snap,
+                        h->arena_offs,
+                        h->num_arenas * sizeof(snap_arena_t)) ||
+           !is_snap_section__(
+                        snap,
+                        h->segment_offs,
+                        h->num_segments * sizeof(snap_segment_t)) ||
+           !is_snap_section__(snap,h->addr_offs,h->addr_size) ||
+           !is_snap_section__(snap,h->size_offs,h->size_size) ||
+           !is_snap_section__(snap,h->flags_offs,h->flags_size) ||
+           !is_snap_section__(snap,h->arena_id_offs,h->arena_id_size) ||
+           (h->flags_size < ((h->num_chunks + 1) / 2)))
         {
-            printf("ERROR - start chunk address is too big\n");
-            return;
+            heap_printf("ERROR - %s is not a heap snapshot\n",path);
+            close_heap_snapshot(snap);
+            return false;
         }
-
-        //Starting arena:
-        gen_ar_t* ar_ptr = (gen_ar_t*) get_arena(start_chunk);
-        heap_bott_t* hb = (heap_bott_t*) 0;
-        if(ar_ptr == main_arena_ptr__)
+        snap->header = h;
+        snap->arenas = (const snap_arena_t*) (snap->image + h->arena_offs);
+        snap->segments = (const snap_segment_t*)
+                                        (snap->image + h->segment_offs);
+
+        //The chunks of the segments must add up to the chunk columns (the
+        //cursor finds the segment of a chunk by these counts):
+        uint64 seg_chunks = 0;
+        uint64 i = 0;
+        for(;i < h->num_segments;++i)
         {
-            printf("--------- MAIN ARENA at %p:\n\n",main_arena_ptr__);
-            printf("          HEAP at %p:\n\n",heap_bottom_chunk__);
+            const snap_segment_t* seg = &snap->segments[i];
+            if((seg->arena_id >= h->num_arenas) ||
+               (seg->num_chunks > (h->num_chunks - seg_chunks)))
+            {
+                break;
+            }
+            seg_chunks += seg->num_chunks;
         }
-        else
+        if((i < h->num_segments) || (seg_chunks != h->num_chunks))
         {
-            hb = get_start_of_allocated_heap_segment(start_chunk);
-            printf("--------- ALLOCATED ARENA at %p:\n\n",ar_ptr);
-            printf("          HEAP at %p:\n\n",(size_t*) hb);
-            dump_heap_info(start_chunk);
+            heap_printf(
+                "ERROR - the segments of %s don't match its chunks\n",
+                path);
+            close_heap_snapshot(snap);
+            return false;
         }
+        return true;
+    }
 
-        //Storage for heap bottoms of further arenas:
-        size_t baddr_arr[MAX_NUM_HEAPS]; //bottom pointer addresses as size_t
-        memset(baddr_arr,0,sizeof(size_t) * MAX_NUM_HEAPS);
-        size_t* baddr_arr_ptr = (size_t*) &baddr_arr[0];
-        size_t bott_idx = 0;
-        size_t num_botts = 0;
+    void close_heap_snapshot(heap_snapshot_t* snap)
+    {
+        if(snap->image)
+            munmap((void*) snap->image,snap->image_size);
+        memset(snap,0,sizeof(heap_snapshot_t));
+    }
 
-        size_t chunk_size = 0;
-        size_t* next_chunk_ptr = (size_t*) 0;
-        size_t* chunk_ptr = start_chunk;
-        for(;;)
+    //Decode the chunk behind the column positions of the cursor:
+    static bool load_snapshot_cursor__(snapshot_cursor_t* cur)
+    {
+        const snap_header_t* h = cur->snap->header;
+        const unsigned char* image = (const unsigned char*) cur->snap->image;
+        uint64 zigzag = 0;
+        uint64 size = 0;
+        uint64 arena_id = 0;
+        if(!get_snap_varint__(
+                        &cur->addr_pos,
+                        image + h->addr_offs + h->addr_size,
+                        &zigzag) ||
+           !get_snap_varint__(
+                        &cur->size_pos,
+                        image + h->size_offs + h->size_size,
+                        &size) ||
+           !get_snap_varint__(
+                        &cur->arena_id_pos,
+                        image + h->arena_id_offs + h->arena_id_size,
+                        &arena_id))
         {
-            if(chunk_ptr >= heap_top_end)
-                break;
-
-            chunk_size = get_chunk_size(chunk_ptr);
-            if(!chunk_size)
+            heap_printf(
+                "ERROR - snapshot chunk #%lu is cut off\n",
+                cur->chunk_no);
+            return false;
+        }
+        if(arena_id >= h->num_arenas)
+        {
+            heap_printf(
+                "ERROR - snapshot chunk #%lu has the bad arena id %lu\n",
+                cur->chunk_no,
+                (size_t) arena_id);
+            return false;
+        }
+        int64 delta = (int64) (zigzag >> 1) ^ -((int64) (zigzag & 1));
+        cur->chunk_addr = (cur->chunk_addr + cur->chunk_size) + (size_t) delta;
+        cur->chunk_size = (size_t) (size << SNAP_SIZE_SHIFT);
+        unsigned char nibble = image[h->flags_offs + (cur->chunk_no >> 1)];
+        if(cur->chunk_no & 1)
+            nibble >>= 4;
+        cur->flags = nibble & FLAGS_MASK;
+        cur->in_use = (nibble & SNAP_USED) ? true : false;
+        cur->arena_id = (size_t) arena_id;
+
+        //Find the segment of the chunk (segments with no chunk are skipped):
+        while(!cur->seg_chunks_left)
+        {
+            if(cur->seg_no >= h->num_segments)
             {
-                printf("ERROR - bad chunk at %p\n",chunk_ptr);
-                return;
+                heap_printf(
+                    "ERROR - snapshot chunk #%lu has no segment\n",
+                    cur->chunk_no);
+                return false;
             }
+            cur->seg_chunks_left =
+                        (size_t) cur->snap->segments[cur->seg_no].num_chunks;
+            if(!cur->seg_chunks_left)
+                ++cur->seg_no;
+        }
+        --cur->seg_chunks_left;
+        cur->is_top = !cur->seg_chunks_left;
+        return true;
+    }
 
-            dump_chunk(chunk_ptr);
+    bool init_snapshot_cursor(
+                            snapshot_cursor_t* cur,
+                            const heap_snapshot_t* snap)
+    {
+        memset(cur,0,sizeof(snapshot_cursor_t));
+        if(!snap->header || !snap->header->num_chunks)
+            return false;
+        const unsigned char* image = (const unsigned char*) snap->image;
+        cur->snap = snap;
+        cur->addr_pos = image + snap->header->addr_offs;
+        cur->size_pos = image + snap->header->size_offs;
+        cur->arena_id_pos = image + snap->header->arena_id_offs;
+        return load_snapshot_cursor__(cur);
+    }
 
-            if(is_top_chunk(chunk_ptr))
+    bool step_snapshot_cursor(snapshot_cursor_t* cur)
+    {
+        if(!cur->snap ||
+           ((cur->chunk_no + 1) >= cur->snap->header->num_chunks))
+        {
+            return false;
+        }
+        ++cur->chunk_no;
+        if(cur->is_top)
+            ++cur->seg_no;
+        return load_snapshot_cursor__(cur);
+    }
+
+    void dump_heap_snapshot_info(const char* path)
+    {
+        sink_flush_t flush_at_return;
+        heap_snapshot_t snap;
+        if(!open_heap_snapshot(&snap,path))
+            return;
+        const snap_header_t* h = snap.header;
+
+        time_t walk_time = (time_t) (h->time_start_ns / 1000000000ULL);
+        char time_str[64];
+        strftime(
+            time_str,
+            sizeof(time_str),
+            "%Y-%m-%d %H:%M:%S",
+            localtime(&walk_time));
+        heap_printf(
+            "snapshot %s: taken %s (%.3lf ms walk)\n"
+            "main heap %p ... %p (sbrk)\n"
+            "\n",
+            path,
+            time_str,
+            (double) (h->time_end_ns - h->time_start_ns) / 1000000.0,
+            (void*) (size_t) h->sbrk_start,
+            (void*) (size_t) h->sbrk_end);
+
+        //Sum up the columns per arena (checks the arena table):
+        double read_start = get_time_sec__();
+        heap_stats_t total;
+        memset(&total,0,sizeof(heap_stats_t));
+        size_t num_mismatches = 0;
+        size_t arena_id = 0;
+        size_t used_total = 0;
+        size_t free_total = 0;
+        size_t num_chunks = 0;
+        snapshot_cursor_t cur;
+        bool ok = init_snapshot_cursor(&cur,&snap);
+        for(;;ok = step_snapshot_cursor(&cur))
+        {
+            if(!ok || (cur.arena_id != arena_id))
             {
-                if(ar_ptr)
+                if(arena_id < h->num_arenas)
                 {
-                    //Try to get the bottom of the next heap of the arena:
-                    if(++bott_idx < num_botts)
-                    {
-                        chunk_ptr = (size_t*) baddr_arr[bott_idx];
-                        if(chunk_ptr)
-                        {
-                            hb = get_start_of_allocated_heap_segment(
-                                                                chunk_ptr);
-                            heap_top_end = get_heap_top_end(chunk_ptr);
-                            printf("\n");
-                            printf("          HEAP at %p:\n\n",(size_t*) hb);
-                            dump_heap_info(chunk_ptr);
-                            continue; //next heap
-                        }
-                    }
-
-                    //Delete all heap bottoms:
-                    memset(baddr_arr,0,sizeof(size_t) * MAX_NUM_HEAPS);
-                    bott_idx = 0;
-                    num_botts = 0;
-
-                    //Try to get another arena:
-                    ar_ptr = (gen_ar_t*) get_next_arena((size_t*) ar_ptr);
-                    if(ar_ptr)
+                    const snap_arena_t* a = &snap.arenas[arena_id];
+                    if((a->num_chunks != num_chunks) ||
+                       (a->used_total != used_total) ||
+                       (a->free_total != free_total))
                     {
-                        //Get all heap bottoms of the arena:
-                        num_botts = get_all_bottom_chunks_of_arena(
-                                                       ar_ptr->addr[top_idx__],
-                                                       &baddr_arr_ptr,
-                                                       MAX_NUM_HEAPS);
-                        if(num_botts)
-                            chunk_ptr = (size_t*) baddr_arr[bott_idx];
-
-                        //Start next arena in case:
-                        if(chunk_ptr)
-                        {
-                            hb = get_start_of_allocated_heap_segment(
-                                                                chunk_ptr);
-                            heap_top_end = get_heap_top_end(chunk_ptr);
-                            printf("\n");
-                            printf(
-                                "--------- ALLOCATED ARENA at %p:\n\n",ar_ptr);
-                            printf("          HEAP at %p:\n\n",(size_t*) hb);
-                            dump_heap_info(chunk_ptr);
-                            continue; //next arena
-                        }
+                        ++num_mismatches;
                     }
                 }
-                break;
+                total.num_chunks += num_chunks;
+                total.used_total += used_total;
+                total.free_total += free_total;
+                used_total = 0;
+                free_total = 0;
+                num_chunks = 0;
+                if(!ok)
+                    break;
+                arena_id = cur.arena_id;
             }
+            ++num_chunks;
+            if(cur.is_top && cur.in_use)
+                continue; //fencepost, neither used nor free
+            if(cur.in_use)
+                used_total += cur.chunk_size;
+            else
+                free_total += cur.chunk_size;
+        }
+        double read_sec = get_time_sec__() - read_start;
+        total.heap_size = total.used_total + total.free_total;
 
-            next_chunk_ptr = get_next_chunk(chunk_ptr);
-            chunk_ptr = next_chunk_ptr;
+        size_t i = 0;
+        for(;i < h->num_arenas;++i)
+        {
+            const snap_arena_t* a = &snap.arenas[i];
+            size_t heap_size = (size_t) (a->used_total + a->free_total);
+            heap_printf(
+                "%s ARENA %4lu at %14p: %4lu heaps %10lu chunks "
+                "%10lu %s size %10lu %s used %10lu %s free\n",
+                i ? "ALLOCATED" : "     MAIN",
+                i,
+                (void*) (size_t) a->ar_ptr,
+                (size_t) a->num_segments,
+                (size_t) a->num_chunks,
+                HUMAN_READABLE_MEM_SIZE__(heap_size),
+                HUMAN_READABLE_MEM_UNIT_2__(heap_size),
+                HUMAN_READABLE_MEM_SIZE__((size_t) a->used_total),
+                HUMAN_READABLE_MEM_UNIT_2__((size_t) a->used_total),
+                HUMAN_READABLE_MEM_SIZE__((size_t) a->free_total),
+                HUMAN_READABLE_MEM_UNIT_2__((size_t) a->free_total));
         }
-        printf("\n");
+        heap_printf(
+            "\n"
+            "%lu arenas, %lu heaps, %lu chunks (%lu read in %.3lf ms)%s\n",
+            (size_t) h->num_arenas,
+            (size_t) h->num_segments,
+            (size_t) h->num_chunks,
+            total.num_chunks,
+            read_sec * 1000.0,
+            h->payload_offs ? ", with payload" : "");
+        if(num_mismatches || (total.num_chunks != h->num_chunks))
+            heap_printf("ERROR - columns don't match the arena table\n");
+
+        print_heap_footprint_totals__(
+                                total.heap_size,
+                                total.used_total,
+                                total.free_total,
+                                (size_t*) (size_t) h->sbrk_start);
+        close_heap_snapshot(&snap);
     }
 
 #endif
 
 //-----------------------------------------------------------------------------
-// HEX dump of the heap:
+// Diff of two heap snapshot files:
+//-----------------------------------------------------------------------------
+// The chunks of both snapshots are merged by their address, like two sorted
+// lists. The chunks of a heap segment are stored in ascending order, so just
+// the heap segments are sorted by their start address: a first pass over the
+// columns keeps the cursor state at the first chunk of every segment, from
+// where the merge restarts the cursor segment by segment:
+//
+//      old:  seg A  [a0 a1 a2 a3 ...]  seg C [c0 c1 ...]
+//      new:  seg A  [a0 a1 x  a3 ...]  seg B [b0 ...]  seg C [c0 c1 ...]
+//                          |                  |
+//                     changed chunk       appeared chunks
+//
+// Each chunk is counted as appeared, disappeared, changed (other size or
+// other state at the same address) or unchanged into the bucket of its arena
+// (matched by the arena pointer) and its size class (power of 2). The buckets
+// are ranked by the growth of the allocated bytes. So the memory needed is
+// bound by the number of heap segments and arenas, not by the number of
+// chunks.
 //-----------------------------------------------------------------------------
 // Attention: do not allocate heap inside (no STL) -> only use stack!!!
 //-----------------------------------------------------------------------------
 
-#if defined(_WIN32) || defined(_WIN64)
+#if !defined(_WIN32) && !defined(_WIN64)
 
-    void dump_heap_hex(
-                    size_t* /* start_chunk */,
-                    size_t* /* heap_top_end */, //first invalid address
-                    uint32 max_kb)
+    #define DIFF_SIZE_CLASSES 64 //size class = log2(chunk size)
+    #define DIFF_MAX_ROWS 20 //buckets printed
+
+    struct diff_sort_t //sort entry
     {
-        _HEAPINFO hi;
-        hi._pentry = NULL; //initate _heapwalk()
+        int64 key;
+        size_t idx;
+    };
 
-        size_t max_bytes = max_kb * 1024; //KB ---> bytes
-        size_t output_cnt = 0;
+    struct diff_bucket_t //chunks of an arena and a size class
+    {
+        size_t num_appeared;
+        size_t num_disappeared;
+        size_t num_changed;
+        int64 used_growth; //allocated bytes (new - old)
+    };
 
-        char* ptr = (char*) 0;
-        size_t* this_chunk_top = (size_t*) 0;
-        int heap_status = 0;
-        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+    struct diff_side_t //one snapshot of the merge
+    {
+        heap_snapshot_t snap;
+        snapshot_cursor_t* seg_starts; //cursor at the segment's 1st chunk
+        diff_sort_t* seg_order; //segments sorted by the start address
+        size_t* arena_slot; //arena id ---> bucket row
+        size_t next_seg; //next entry of seg_order
+        snapshot_cursor_t cur;
+        bool ok; //cur is at a chunk
+    };
+
+    //Sort by the key (heap sort, no recursion and no heap memory):
+    static void sort_diff_entries__(diff_sort_t* a,size_t n)
+    {
+        size_t start = n / 2;
+        size_t end = n;
+        while(end > 1)
         {
-            ptr = (char*) hi._pentry;
-            this_chunk_top = (size_t*) (ptr + hi._size);
-
-            for(;((size_t*) ptr) < this_chunk_top;ptr += 8)
+            if(start)
             {
-                printf(
-                    "%02X %02X %02X %02X   %02X %02X %02X %02X | "
-                    "%c%c%c%c %c%c%c%c %12p ... %12p\n",
-                    (unsigned char) ptr[0],
-                    (unsigned char) ptr[1],
-                    (unsigned char) ptr[2],
-                    (unsigned char) ptr[3],
-                    (unsigned char) ptr[4],
-                    (unsigned char) ptr[5],
-                    (unsigned char) ptr[6],
-                    (unsigned char) ptr[7],
-                    human_readable__(ptr[0]),
-                    human_readable__(ptr[1]),
-                    human_readable__(ptr[2]),
-                    human_readable__(ptr[3]),
-                    human_readable__(ptr[4]),
-                    human_readable__(ptr[5]),
-                    human_readable__(ptr[6]),
-                    human_readable__(ptr[7]),
-                    &ptr[0],
-                    &ptr[7]);
+                --start;
             }
-
-            if(max_bytes)
+            else
             {
-                output_cnt += hi._size;
-                if(output_cnt >= max_bytes)
-                {
-                    printf("\n");
-                    printf(">>> INTERRUPTED after %u KB <<<\n",max_kb);
+                --end;
+                diff_sort_t t = a[0];
+                a[0] = a[end];
+                a[end] = t;
+            }
+            size_t root = start;
+            for(;;)
+            {
+                size_t child = 2 * root + 1;
+                if(child >= end)
                     break;
-                }
+                if(((child + 1) < end) && (a[child].key < a[child + 1].key))
+                    ++child;
+                if(a[root].key >= a[child].key)
+                    break;
+                diff_sort_t t = a[root];
+                a[root] = a[child];
+                a[child] = t;
+                root = child;
             }
         }
-        if(output_cnt < max_bytes)
+    }
+
+    static size_t get_diff_size_class__(size_t chunk_size)
+    {
+        #ifdef __GNUC__
+            if(!chunk_size)
+                return 0;
+            return (size_t)
+                    (63 - __builtin_clzll((unsigned long long) chunk_size));
+        #else
+            size_t size_class = 0;
+            for(;chunk_size > 1;chunk_size >>= 1)
+                ++size_class;
+            return size_class;
+        #endif
+    }
+
+    //Go to the first chunk of the next segment in address order:
+    static void enter_next_diff_segment__(diff_side_t* side)
+    {
+        side->ok = false;
+        const snap_header_t* h = side->snap.header;
+        for(;side->next_seg < h->num_segments;)
         {
-            printf("\n");
-            if(output_cnt < (100 * 1024))
-            {
-                printf(
-                    "TOTAL: %5.3lf KB\n",
-                    (double) (((double) output_cnt)/1024.0));
-            }
-            else
-            {
-                printf("TOTAL: %lu KB\n",output_cnt/1024);
-            }
+            size_t seg_no = side->seg_order[side->next_seg++].idx;
+            if(!side->snap.segments[seg_no].num_chunks)
+                continue;
+            side->cur = side->seg_starts[seg_no];
+            side->ok = true;
+            return;
         }
-        printf("\n");
     }
 
-#else
+    //Get the used bytes of a snapshot chunk (the fencepost at the end of an
+    //older heap segment is the last one of the segment, but no chunk):
+    static inline int64 get_snap_used__(const snapshot_cursor_t* cur)
+    {
+        if(!cur->in_use || cur->is_top)
+            return 0;
+        return (int64) cur->chunk_size;
+    }
+
+    static void step_diff_side__(diff_side_t* side)
+    {
+        if(side->cur.is_top)
+            enter_next_diff_segment__(side);
+        else
+            side->ok = step_snapshot_cursor(&side->cur);
+    }
 
-    void dump_heap_hex(
-                    size_t* start_chunk,
-                    size_t* heap_top_end, //first invalid address
-                    uint32 max_kb)
+    //Map a snapshot and index its segments (the mapping is returned in
+    //*map, its size in *map_size):
+    static bool open_diff_side__(
+                            diff_side_t* side,
+                            const char* path,
+                            void** map,
+                            size_t* map_size)
     {
-        if(!start_chunk)
+        memset(side,0,sizeof(diff_side_t));
+        if(!open_heap_snapshot(&side->snap,path))
+            return false;
+        const snap_header_t* h = side->snap.header;
+        *map_size = h->num_segments *
+                        (sizeof(snapshot_cursor_t) + sizeof(diff_sort_t)) +
+                    h->num_arenas * sizeof(size_t) + 1;
+        *map = mmap(
+                    (void*) 0,
+                    *map_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+        if(*map == MAP_FAILED)
         {
-            printf("ERROR - start_chunk address is missing\n");
-            return;
+            heap_printf("ERROR - cannot map the segment index of %s\n",path);
+            close_heap_snapshot(&side->snap);
+            return false;
         }
-        if(!heap_top_end)
+        side->seg_starts = (snapshot_cursor_t*) *map;
+        side->seg_order = (diff_sort_t*)
+                                (side->seg_starts + h->num_segments);
+        side->arena_slot = (size_t*) (side->seg_order + h->num_segments);
+
+        //Keep the cursor state at the first chunk of every segment, all the
+        //chunks must be read and have an arena id within the arena table
+        //(the merge indexes arena_slot and the buckets by it):
+        snapshot_cursor_t cur;
+        bool ok = init_snapshot_cursor(&cur,&side->snap);
+        size_t seg_no = (size_t) -1;
+        for(;ok;ok = step_snapshot_cursor(&cur))
         {
-            printf("ERROR - heap top address is missing\n");
-            return;
+            if(cur.arena_id >= h->num_arenas)
+                break;
+            if(cur.seg_no != seg_no)
+            {
+                seg_no = cur.seg_no;
+                side->seg_starts[seg_no] = cur;
+            }
         }
-        if(start_chunk >= heap_top_end)
+        if(ok || ((cur.chunk_no + 1) < h->num_chunks))
         {
-            printf("ERROR - start chunk address is too big\n");
-            return;
+            heap_printf("ERROR - bad chunk #%lu in %s\n",cur.chunk_no,path);
+            munmap(*map,*map_size);
+            close_heap_snapshot(&side->snap);
+            return false;
         }
-
-        //Starting arena:
-        gen_ar_t* ar_ptr = (gen_ar_t*) get_arena(start_chunk);
-        heap_bott_t* hb = (heap_bott_t*) 0;
-        if(ar_ptr == main_arena_ptr__)
+        size_t i = 0;
+        for(;i < h->num_segments;++i)
         {
-            printf(
-                "MAIN ARENA at %p (MAIN HEAP at %p):\n\n",
-                main_arena_ptr__,
-                heap_bottom_chunk__);
+            side->seg_order[i].key = (int64) side->snap.segments[i].start;
+            side->seg_order[i].idx = i;
         }
-        else
+        sort_diff_entries__(side->seg_order,(size_t) h->num_segments);
+        enter_next_diff_segment__(side);
+        return true;
+    }
+
+    void dump_heap_snapshot_diff(const char* old_path,const char* new_path)
+    {
+        sink_flush_t flush_at_return;
+        diff_side_t sides[2]; //old, new
+        void* maps[2] = {(void*) 0,(void*) 0};
+        size_t map_sizes[2] = {0,0};
+        if(!open_diff_side__(&sides[0],old_path,&maps[0],&map_sizes[0]))
+            return;
+        if(!open_diff_side__(&sides[1],new_path,&maps[1],&map_sizes[1]))
         {
-            hb = get_start_of_allocated_heap_segment(start_chunk);
-            printf(
-                "ALLOCATED ARENA at %p (HEAP at %p):\n\n",
-                ar_ptr,
-                (size_t*) hb);
+            munmap(maps[0],map_sizes[0]);
+            close_heap_snapshot(&sides[0].snap);
+            return;
         }
-
-        size_t max_bytes = max_kb * 1024; //KB ---> bytes
-        size_t output_cnt = 0;
-        size_t zero_word_cnt = 0;
-
-        size_t num_hidden_zero_blocks = 0;
-        char* p = (char*) 0;
-        char* ptr = (char*) start_chunk;
-        for(;((size_t*) ptr) < heap_top_end;ptr += 8)
+        diff_side_t* o = &sides[0];
+        diff_side_t* n = &sides[1];
+        const snap_header_t* oh = o->snap.header;
+        const snap_header_t* nh = n->snap.header;
+
+        //Bucket rows: the arenas of the new snapshot, then the arenas that
+        //exist in the old one only:
+        size_t num_rows = (size_t) nh->num_arenas;
+        size_t i = 0;
+        for(;i < nh->num_arenas;++i)
+            n->arena_slot[i] = i;
+        for(i = 0;i < oh->num_arenas;++i)
         {
-            if(!ptr[0] && !ptr[1] && !ptr[2] && !ptr[3] &&
-               !ptr[4] && !ptr[5] && !ptr[6] && !ptr[7])
+            size_t j = 0;
+            for(;j < nh->num_arenas;++j)
             {
-                ++zero_word_cnt;
+                if(o->snap.arenas[i].ar_ptr == n->snap.arenas[j].ar_ptr)
+                    break;
             }
-            else
+            o->arena_slot[i] = (j < nh->num_arenas) ? j : num_rows++;
+        }
+        size_t num_buckets = num_rows * DIFF_SIZE_CLASSES;
+        size_t table_size = num_buckets *
+                            (sizeof(diff_bucket_t) + sizeof(diff_sort_t)) +
+                            num_rows * sizeof(uint64);
+        void* table = mmap(
+                        (void*) 0,
+                        table_size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+        if(table == MAP_FAILED)
+        {
+            heap_printf("ERROR - cannot map the diff table (%lu arenas)\n",
+                        num_rows);
+        }
+        else
+        {
+            diff_bucket_t* buckets = (diff_bucket_t*) table;
+            diff_sort_t* ranks = (diff_sort_t*) (buckets + num_buckets);
+            uint64* row_ar_ptrs = (uint64*) (ranks + num_buckets);
+            for(i = 0;i < nh->num_arenas;++i)
+                row_ar_ptrs[i] = n->snap.arenas[i].ar_ptr;
+            for(i = 0;i < oh->num_arenas;++i)
+                row_ar_ptrs[o->arena_slot[i]] = o->snap.arenas[i].ar_ptr;
+
+            //Merge the chunks by address:
+            double merge_start = get_time_sec__();
+            diff_bucket_t total;
+            memset(&total,0,sizeof(diff_bucket_t));
+            size_t num_unchanged = 0;
+            size_t num_freed = 0; //USED ---> FREE
+            size_t num_allocated = 0; //FREE ---> USED
+            while(o->ok || n->ok)
             {
-                if(zero_word_cnt >= 9)
+                const snapshot_cursor_t* oc = &o->cur;
+                const snapshot_cursor_t* nc = &n->cur;
+                if(o->ok && n->ok && (oc->chunk_addr == nc->chunk_addr))
                 {
-                    num_hidden_zero_blocks =
-                                        (zero_word_cnt - 9) * sizeof(size_t);
-                    if(num_hidden_zero_blocks)
+                    if((oc->chunk_size != nc->chunk_size) ||
+                       (oc->in_use != nc->in_use))
                     {
-                        printf(
-                            "%lu more zero words "
-                            "-> total zero block size: %lu bytes\n",
-                            num_hidden_zero_blocks,
-                            zero_word_cnt*sizeof(size_t));
+                        diff_bucket_t* b = &buckets[
+                                n->arena_slot[nc->arena_id] *
+                                    DIFF_SIZE_CLASSES +
+                                get_diff_size_class__(nc->chunk_size)];
+                        int64 growth = get_snap_used__(nc) -
+                                       get_snap_used__(oc);
+                        ++b->num_changed;
+                        b->used_growth += growth;
+                        ++total.num_changed;
+                        total.used_growth += growth;
+                        if(oc->in_use && !nc->in_use)
+                            ++num_freed;
+                        else if(!oc->in_use && nc->in_use)
+                            ++num_allocated;
                     }
                     else
                     {
-                        printf(
-                            "-> total zero block size: %lu bytes\n",
-                            zero_word_cnt*sizeof(size_t));
+                        ++num_unchanged;
                     }
-                    p = ptr - 8;
-                    printf(
-                       "00 00 00 00   00 00 00 00 | .... .... %14p ... %14p\n",
-                       &p[0],
-                       &p[7]);
+                    step_diff_side__(o);
+                    step_diff_side__(n);
+                }
+                else if(n->ok &&
+                        (!o->ok || (nc->chunk_addr < oc->chunk_addr)))
+                {
+                    diff_bucket_t* b = &buckets[
+                            n->arena_slot[nc->arena_id] * DIFF_SIZE_CLASSES +
+                            get_diff_size_class__(nc->chunk_size)];
+                    int64 growth = get_snap_used__(nc);
+                    ++b->num_appeared;
+                    b->used_growth += growth;
+                    ++total.num_appeared;
+                    total.used_growth += growth;
+                    step_diff_side__(n);
+                }
+                else
+                {
+                    diff_bucket_t* b = &buckets[
+                            o->arena_slot[oc->arena_id] * DIFF_SIZE_CLASSES +
+                            get_diff_size_class__(oc->chunk_size)];
+                    int64 growth = get_snap_used__(oc);
+                    ++b->num_disappeared;
+                    b->used_growth -= growth;
+                    ++total.num_disappeared;
+                    total.used_growth -= growth;
+                    step_diff_side__(o);
                 }
-                zero_word_cnt = 0;
-            }
-            if(zero_word_cnt < 9)
-            {
-                printf(
-                    "%02X %02X %02X %02X   %02X %02X %02X %02X | "
-                    "%c%c%c%c %c%c%c%c %14p ... %14p\n",
-                    (unsigned char) ptr[0],
-                    (unsigned char) ptr[1],
-                    (unsigned char) ptr[2],
-                    (unsigned char) ptr[3],
-                    (unsigned char) ptr[4],
-                    (unsigned char) ptr[5],
-                    (unsigned char) ptr[6],
-                    (unsigned char) ptr[7],
-                    human_readable__(ptr[0]),
-                    human_readable__(ptr[1]),
-                    human_readable__(ptr[2]),
-                    human_readable__(ptr[3]),
-                    human_readable__(ptr[4]),
-                    human_readable__(ptr[5]),
-                    human_readable__(ptr[6]),
-                    human_readable__(ptr[7]),
-                    &ptr[0],
-                    &ptr[7]);
             }
+            double merge_sec = get_time_sec__() - merge_start;
 
-            if(max_bytes)
+            heap_printf(
+                "heap diff %s ---> %s (%.3lf s later):\n"
+                "\n"
+                "%10lu chunks appeared\n"
+                "%10lu chunks disappeared\n"
+                "%10lu chunks changed (%lu USED->FREE, %lu FREE->USED, "
+                "%lu resized)\n"
+                "%10lu chunks unchanged\n"
+                "%+10ld bytes allocated\n"
+                "\n",
+                old_path,
+                new_path,
+                (double) ((int64) nh->time_start_ns -
+                          (int64) oh->time_start_ns) / 1000000000.0,
+                total.num_appeared,
+                total.num_disappeared,
+                total.num_changed,
+                num_freed,
+                num_allocated,
+                total.num_changed - num_freed - num_allocated,
+                num_unchanged,
+                (long) total.used_growth);
+
+            //Rank the buckets by the growth of the allocated bytes:
+            size_t num_ranks = 0;
+            for(i = 0;i < num_buckets;++i)
             {
-                output_cnt += 8;
-                if(output_cnt >= max_bytes)
+                diff_bucket_t* b = &buckets[i];
+                if(!b->num_appeared && !b->num_disappeared &&
+                   !b->num_changed)
                 {
-                    printf("\n");
-                    printf(">>> INTERRUPTED after %u KB <<<\n",max_kb);
-                    break;
+                    continue;
                 }
+                ranks[num_ranks].key = -b->used_growth;
+                ranks[num_ranks].idx = i;
+                ++num_ranks;
             }
-        }
-        if(output_cnt < max_bytes)
-        {
-            printf("\n");
-            if(output_cnt < (100 * 1024))
+            sort_diff_entries__(ranks,num_ranks);
+            if(num_ranks)
             {
-                printf(
-                    "TOTAL: %5.3lf KB\n",
-                    (double) (((double) output_cnt)/1024.0));
+                heap_printf(
+                    "RANK  ARENA at        ar_ptr   SIZE CLASS (bytes)  "
+                    "  APPEARED DISAPPEARED    CHANGED   GROWN (bytes)\n");
             }
-            else
+            for(i = 0;(i < num_ranks) && (i < DIFF_MAX_ROWS);++i)
             {
-                printf("TOTAL: %lu KB\n",output_cnt/1024);
+                size_t row = ranks[i].idx / DIFF_SIZE_CLASSES;
+                size_t size_class = ranks[i].idx % DIFF_SIZE_CLASSES;
+                diff_bucket_t* b = &buckets[ranks[i].idx];
+                heap_printf(
+                    "%4lu %6lu %14p %9lu ... %-9lu %10lu %11lu %10lu %+15ld\n",
+                    i + 1,
+                    row,
+                    (void*) (size_t) row_ar_ptrs[row],
+                    ((size_t) 1) << size_class,
+                    (((size_t) 1) << size_class) * 2 - 1,
+                    b->num_appeared,
+                    b->num_disappeared,
+                    b->num_changed,
+                    (long) b->used_growth);
+            }
+            if(num_ranks > DIFF_MAX_ROWS)
+            {
+                heap_printf(
+                    "... %lu more buckets\n",
+                    num_ranks - DIFF_MAX_ROWS);
             }
+            heap_printf(
+                "\n"
+                "%lu + %lu chunks merged in %.3lf ms\n"
+                "\n",
+                (size_t) oh->num_chunks,
+                (size_t) nh->num_chunks,
+                merge_sec * 1000.0);
+            munmap(table,table_size);
+        }
+
+        for(i = 0;i < 2;++i)
+        {
+            munmap(maps[i],map_sizes[i]);
+            close_heap_snapshot(&sides[i].snap);
         }
-        printf("\n");
     }
 
 #endif
 
 //-----------------------------------------------------------------------------
-// Raw heap dump:
+// Arena index (heap segment ---> arena):
+//-----------------------------------------------------------------------------
+// All allocated heap segments are aligned to HEAP_MAX_SIZE, so the segment
+// start (chunk address & ~(HEAP_MAX_SIZE - 1)) is a unique key. The index is
+// an open-addressed hash table (linear probing) over these keys, built from
+// the arena ring and the heap_bott_t->prev chain of each arena:
+//
+//     main arena ---next---> arena 1 ---next---> arena 2 ---next---> ...
+//                               |                   |
+//                          top segment         top segment
+//                               | prev              | prev
+//                          older segment       older segment
+//                               | prev              ...
+//                              ...
+//
+// So any chunk of any heap segment (not only the segment holding the
+// arena's top chunk) is mapped to its arena with one hash lookup. The table
+// is mapped by mmap() and doubled when it gets half full, so the number of
+// heap segments is not limited. It is rebuilt once per walk, and on a miss
+// or a stale hit (heap_bott_t->ar_ptr not matching anymore) only if the
+// arena ring changed since the last build: the number of arenas or the
+// heap segment holding the top chunk of an arena (a new or deleted heap
+// segment moves the top chunk of its arena).
+//
+// The dumps may look up arenas from several threads, so a build is done
+// under a mutex, but a lookup doesn't take it: the table is guarded by a
+// sequence number (seqlock), which is odd while a build is running. A
+// lookup reading the same even number in front of and behind its probe
+// has read a complete table, else it goes the way of a miss:
+//
+//      seq   2       3 (odd)         4
+//      build |------[ fill table ]---|
+//      probe   [ok]      [retry]         [ok]
+//
+// A grown table is mapped beside the old one, which is left mapped (a
+// lookup may still probe it), so all the tables take less than twice the
+// memory of the last one.
 //-----------------------------------------------------------------------------
 // Attention: do not allocate heap inside (no STL) -> only use stack!!!
 //-----------------------------------------------------------------------------
 
-#if defined(_WIN32) || defined(_WIN64)
+#if !defined(_WIN32) && !defined(_WIN64)
 
-    void dump_heap_raw(
-                    size_t* /* start_chunk */,
-                    size_t* /* heap_top_end */, //first invalid address
-                    uint32 max_kb)
+    #define ARENA_IDX_MIN_SIZE 8192 //slots mapped first (a power of 2)
+
+    struct arena_idx_entry_t
     {
-        _HEAPINFO hi;
-        hi._pentry = NULL; //initate _heapwalk()
+        heap_bott_t* hb; //heap segment start (NULL = empty slot)
+        gen_ar_t* ar_ptr; //arena of the heap segment
+        size_t arena_no; //0 = main arena, 1 = next arena, ...
+    };
+
+    static arena_idx_entry_t* arena_idx__ = (arena_idx_entry_t*) 0; //mapped
+    static size_t arena_idx_size__ = 0; //slots (a power of 2)
+    static size_t arena_idx_num__ = 0; //number of indexed heap segments
+    static size_t arena_idx_seq__ = 0; //odd while the table is built
+    static size_t arena_idx_sig__ = 0; //arena ring at the last build
+    static pthread_mutex_t arena_idx_mutex__ = PTHREAD_MUTEX_INITIALIZER;
+
+    //Get the home slot of a heap segment in a table of size slots:
+    static size_t get_arena_idx_slot__(heap_bott_t* hb,size_t size)
+    {
+        size_t key = ((size_t) hb) / HEAP_MAX_SIZE;
+        key *= (size_t) 0x9E3779B97F4A7C15ULL; //Fibonacci hashing
+        return (key >> (8 * sizeof(size_t) - __builtin_ctzl(size))) &
+               (size - 1);
+    }
 
-        size_t max_bytes = max_kb * 1024; //KB ---> bytes
-        size_t output_cnt = 0;
+    //Map a table with twice the slots (or the first slots), the entries
+    //must be indexed again. The table is published in front of its size,
+    //so a lookup reading the size first never probes behind a table:
+    static bool grow_arena_idx__()
+    {
+        size_t size = arena_idx_size__ ?
+                                2 * arena_idx_size__ : ARENA_IDX_MIN_SIZE;
+        void* idx = mmap(
+                        (void*) 0,
+                        size * sizeof(arena_idx_entry_t),
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+        if(idx == MAP_FAILED)
+            return false;
+        __atomic_store_n(
+                    &arena_idx__,
+                    (arena_idx_entry_t*) idx,
+                    __ATOMIC_RELEASE);
+        __atomic_store_n(&arena_idx_size__,size,__ATOMIC_RELEASE);
+        return true;
+    }
 
-        char* ptr = (char*) 0;
-        size_t* this_chunk_top = (size_t*) 0;
-        int heap_status = 0;
-        while((heap_status = _heapwalk(&hi)) == _HEAPOK)
+    static bool insert_arena_idx__(
+                                heap_bott_t* hb,
+                                gen_ar_t* ar_ptr,
+                                size_t arena_no)
+    {
+        size_t mask = arena_idx_size__ - 1;
+        size_t slot = get_arena_idx_slot__(hb,arena_idx_size__);
+        for(;arena_idx__[slot].hb;slot = (slot + 1) & mask)
         {
-            ptr = (char*) hi._pentry;
-            this_chunk_top = (size_t*) (ptr + hi._size);
-
-            for(;ptr < (char*) this_chunk_top;++ptr)
-                printf("%c",*ptr);
+            if(arena_idx__[slot].hb == hb)
+                return false; //already indexed (looped heap chain)
+        }
+        arena_idx__[slot].hb = hb;
+        arena_idx__[slot].ar_ptr = ar_ptr;
+        arena_idx__[slot].arena_no = arena_no;
+        ++arena_idx_num__;
+        return true;
+    }
 
-            if(max_bytes)
+    //Copy the entry of a heap segment out of the table (a build may run
+    //meanwhile, so the probe is bounded by the table size):
+    static bool find_arena_idx__(heap_bott_t* hb,arena_idx_entry_t* entry)
+    {
+        size_t size = __atomic_load_n(&arena_idx_size__,__ATOMIC_ACQUIRE);
+        arena_idx_entry_t* idx = __atomic_load_n(
+                                                &arena_idx__,
+                                                __ATOMIC_ACQUIRE);
+        if(!idx || !size)
+            return false;
+        size_t mask = size - 1;
+        size_t slot = get_arena_idx_slot__(hb,size);
+        size_t n = 0;
+        for(;(n < size) && idx[slot].hb;++n,slot = (slot + 1) & mask)
+        {
+            if(idx[slot].hb == hb)
             {
-                output_cnt += hi._size;
-                if(output_cnt >= max_bytes)
-                    break;
+                *entry = idx[slot];
+                return true;
             }
         }
-        fflush(stdout);
+        return false;
     }
 
-#else
-
-    void dump_heap_raw(
-                    size_t* start_chunk,
-                    size_t* heap_top_end, //first invalid address
-                    uint32 max_kb)
+    //Get a signature of the arena ring: the number of arenas and the heap
+    //segments holding their top chunks:
+    static size_t get_arena_ring_sig__()
     {
-        if(!start_chunk)
+        size_t* main_heap_end = (size_t*) sbrk(0);
+        size_t sig = 0;
+        gen_ar_t* ar_ptr = main_arena_ptr__;
+        for(;ar_ptr;)
         {
-            printf("ERROR - start_chunk address is missing\n");
-            return;
+            size_t* top_chunk_ptr = ar_ptr->addr[top_idx__];
+            size_t key = 0;
+            if(top_chunk_ptr && (top_chunk_ptr > main_heap_end))
+            {
+                key = (size_t)
+                        get_start_of_allocated_heap_segment(top_chunk_ptr);
+            }
+            sig = (sig ^ key) * (size_t) 0x100000001B3ULL + 1; //FNV-1
+            ar_ptr = (gen_ar_t*) get_next_arena((size_t*) ar_ptr);
+            if(ar_ptr == main_arena_ptr__)
+                break; //linked list looped back to start
         }
-        if(!heap_top_end)
+        return sig;
+    }
+
+    //Index the heap segments of all arenas (false if the table got half
+    //full, max. load factor 0.5):
+    static bool fill_arena_idx__()
+    {
+        memset(arena_idx__,0,arena_idx_size__ * sizeof(arena_idx_entry_t));
+        arena_idx_num__ = 0;
+        size_t* main_heap_end = (size_t*) sbrk(0);
+        gen_ar_t* ar_ptr = main_arena_ptr__;
+        size_t arena_no = 0;
+        for(;ar_ptr;++arena_no)
         {
-            printf("ERROR - heap top address is missing\n");
-            return;
+            //Follow the heap segments of the arena from top to bottom:
+            size_t* top_chunk_ptr = ar_ptr->addr[top_idx__];
+            if(top_chunk_ptr && (top_chunk_ptr > main_heap_end))
+            {
+                heap_bott_t* hb =
+                        get_start_of_allocated_heap_segment(top_chunk_ptr);
+                for(;hb;hb = hb->prev)
+                {
+                    if((gen_ar_t*) hb->ar_ptr != ar_ptr)
+                        break; //broken heap chain
+                    if(arena_idx_num__ >= (arena_idx_size__ / 2))
+                        return false;
+                    if(!insert_arena_idx__(hb,ar_ptr,arena_no))
+                        break;
+                }
+            }
+            ar_ptr = (gen_ar_t*) get_next_arena((size_t*) ar_ptr);
+            if(ar_ptr == main_arena_ptr__)
+                break; //linked list looped back to start
         }
-        if(start_chunk >= heap_top_end)
+        return true;
+    }
+
+    //Build the index, the table grows until all heap segments fit in (the
+    //caller holds arena_idx_mutex__):
+    static size_t build_arena_idx__()
+    {
+        arena_idx_num__ = 0;
+        if(!main_arena_ptr__ || (top_idx__ < 0) || (next_idx__ < 0))
+            return 0;
+
+        //Odd sequence number ---> the lookups keep off the table:
+        size_t seq = arena_idx_seq__;
+        __atomic_store_n(&arena_idx_seq__,seq + 1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        arena_idx_sig__ = get_arena_ring_sig__();
+        if(arena_idx__ || grow_arena_idx__())
         {
-            printf("ERROR - start chunk address is too big\n");
-            return;
+            for(;!fill_arena_idx__();)
+            {
+                if(!grow_arena_idx__())
+                    break; //the segments indexed so far are kept
+            }
         }
+        __atomic_store_n(&arena_idx_seq__,seq + 2,__ATOMIC_RELEASE);
+        return arena_idx_num__;
+    }
 
-        size_t max_bytes = max_kb * 1024; //KB ---> bytes
-        size_t output_cnt = 0;
+    size_t build_arena_index()
+    {
+        pthread_mutex_lock(&arena_idx_mutex__);
+        size_t num = build_arena_idx__();
+        pthread_mutex_unlock(&arena_idx_mutex__);
+        return num;
+    }
 
-        if(max_bytes)
+    //Look up the index entry of an allocated heap segment (copied, since
+    //another thread may rebuild the table behind the lookup):
+    static bool lookup_arena_idx__(heap_bott_t* hb,arena_idx_entry_t* entry)
+    {
+        //Hit without the mutex, if no build ran during the probe:
+        size_t seq = __atomic_load_n(&arena_idx_seq__,__ATOMIC_ACQUIRE);
+        if(!(seq & 1))
         {
-            char* ptr = (char*) start_chunk;
-            for(;ptr < (char*) heap_top_end;++ptr)
+            bool found = find_arena_idx__(hb,entry);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(found &&
+               (__atomic_load_n(&arena_idx_seq__,__ATOMIC_RELAXED) == seq) &&
+               ((gen_ar_t*) hb->ar_ptr == entry->ar_ptr))
             {
-                printf("%c",*ptr);
-                if(++output_cnt >= max_bytes)
-                    break;
+                return true;
             }
         }
-        else
+
+        pthread_mutex_lock(&arena_idx_mutex__);
+        bool found = find_arena_idx__(hb,entry);
+        if((!found || ((gen_ar_t*) hb->ar_ptr != entry->ar_ptr)) &&
+           (get_arena_ring_sig__() != arena_idx_sig__))
         {
-            char* ptr = (char*) start_chunk;
-            for(;ptr < (char*) heap_top_end;++ptr)
-                printf("%c",*ptr);
+            //New arena or segment since the last build ---> rebuild once:
+            build_arena_idx__();
+            found = find_arena_idx__(hb,entry);
         }
-        fflush(stdout);
+        pthread_mutex_unlock(&arena_idx_mutex__);
+        return found;
     }
 
 #endif
@@ -1555,33 +8299,40 @@ bool get_memory_dimenions(
 
     size_t* get_arena(size_t* chunk_ptr)
     {
-        if(!main_arena_ptr__)
+        if(!main_arena_ptr__ || !chunk_ptr)
             return (size_t*) 0;
 
-        if(((chunk_t*) chunk_ptr)->size & A__) //allocated arena
-        {
-            size_t* heap_start =
-                     (size_t*) get_start_of_allocated_heap_segment(chunk_ptr);
-            size_t* heap_end =
-                     (size_t*) (((char*) heap_start) + HEAP_MAX_SIZE);
+        //Chunks of the main heap and mmapped chunks:
+        if((((chunk_t*) chunk_ptr)->size & M__) || (chunk_ptr < sbrk(0)))
+            return (size_t*) main_arena_ptr__;
 
-            gen_ar_t* ar_ptr = main_arena_ptr__;
-            gen_ar_t* start_ar_ptr = ar_ptr;
-            for(;ar_ptr;)
-            {
-                if((ar_ptr->addr[top_idx__] >= heap_start) &&
-                   (ar_ptr->addr[top_idx__] < heap_end))
-                {
-                    return (size_t*) ar_ptr;
-                }
-                ar_ptr = (gen_ar_t*) ar_ptr->addr[next_idx__];
-                if(ar_ptr == start_ar_ptr)
-                    break; //linked list looped back to start
-            }
+        //Chunks of allocated heap segments (also free ones without A bit):
+        arena_idx_entry_t entry;
+        if(!lookup_arena_idx__(
+                        get_start_of_allocated_heap_segment(chunk_ptr),
+                        &entry))
+        {
             return (size_t*) 0;
         }
+        return (size_t*) entry.ar_ptr;
+    }
+
+    size_t get_arena_no(size_t* chunk_ptr)
+    {
+        if(!main_arena_ptr__ || !chunk_ptr)
+            return (size_t) -1;
+
+        if((((chunk_t*) chunk_ptr)->size & M__) || (chunk_ptr < sbrk(0)))
+            return 0; //main arena
 
-        return (size_t*) main_arena_ptr__;
+        arena_idx_entry_t entry;
+        if(!lookup_arena_idx__(
+                        get_start_of_allocated_heap_segment(chunk_ptr),
+                        &entry))
+        {
+            return (size_t) -1;
+        }
+        return entry.arena_no;
     }
 
 #endif
@@ -1698,20 +8449,8 @@ bool get_memory_dimenions(
             if(next > heap_end)
                 return (size_t*) 0;
 
-            //Step back to find the first chunk:
-            size_t* last_valid_chunk_ptr = chunk_ptr;
-            size_t* test = (size_t*) 0;
-            size_t* p = chunk_ptr;
-            for(p -= 2;p > (size_t*) hb;p -= 2)
-            {
-                test = get_next_chunk(p); //get next chunk by the 'size' field
-                if(test == last_valid_chunk_ptr)
-                {
-                    last_valid_chunk_ptr = test;
-                }
-            }
-
-            return last_valid_chunk_ptr;
+            //Get the first chunk from the heap segment layout:
+            return get_segment_bottom_chunk__(hb,chunk_ptr);
         }
 
         //If chunk is in the main contiguous heap:
@@ -1724,16 +8463,20 @@ bool get_memory_dimenions(
 // Find all bottom chunks of an arena by the arena's top chunk:
 //-----------------------------------------------------------------------------
 // Call the function after putting a size_t array on the stack to store
-// the found bottom pointer addresses:
+// the found bottom pointer addresses, ordered from the first (oldest) to the
+// last (newest) heap segment of the arena. If the arena has more heap
+// segments than the array can take, the newest ones are returned:
 //
-//     size_t baddr_arr[MAX_NUM_HEAPS]; //bottom pointer addresses as size_t
-//     memset(baddr_arr,0,sizeof(size_t) * MAX_NUM_HEAPS);
+//     size_t baddr_arr[16]; //bottom pointer addresses as size_t
 //     size_t* baddr_arr_ptr = (size_t*) &baddr_arr[0];
 //     ...
 //     size_t num_botts = get_all_bottom_chunks_of_arena(
 //                                                  ar_ptr->addr[top_idx__],
 //                                                  &baddr_arr_ptr,
-//                                                   MAX_NUM_HEAPS);
+//                                                  16);
+//
+// To walk the heap segments of an arena without such a limit, use the chunk
+// cursor, which follows the heap_bott_t->prev chain lazily.
 //-----------------------------------------------------------------------------
 //
 //     MAIN HEAP        ARENA 1 HEAP 1  top 1        ARENA 1 HEAP 2
@@ -1786,8 +8529,7 @@ bool get_memory_dimenions(
                                 size_t max_num_botts)
     {
         size_t* pbaddr = *baddr_arr_ptr;
-        memset(pbaddr,0,sizeof(size_t) * max_num_botts);
-        if(!ar_top_chunk_ptr)
+        if(!ar_top_chunk_ptr || !max_num_botts)
             return 0;
 
         if(ar_top_chunk_ptr < sbrk(0))
@@ -1796,123 +8538,47 @@ bool get_memory_dimenions(
             return 1;
         }
 
-        size_t* last_valid_chunk_ptr = (size_t*) 0;
-        size_t* test = (size_t*) 0;
-        size_t* p = (size_t*) 0;
-
-        size_t* chunk_ptr = ar_top_chunk_ptr;
-        heap_bott_t* hb = get_start_of_allocated_heap_segment(chunk_ptr);
-        if(!hb)
+        heap_bott_t* top_hb =
+                        get_start_of_allocated_heap_segment(ar_top_chunk_ptr);
+        if(!top_hb)
             return 0;
-        size_t* heap_end = (size_t*) (((char*) hb) + hb->size);
-        pbaddr += max_num_botts - 1; //move to last entry
-        size_t i = 0;
-        for(;i < max_num_botts;++i)
-        {
-            //Get the pointer to the next chunk:
-            size_t chunk_size =
-                         (size_t) (((chunk_t*) chunk_ptr)->size & ~FLAGS_MASK);
-            size_t* next = (size_t*) (((char*) chunk_ptr) + chunk_size);
-
-            //Check if the next chunk is in the allowed range:
-            if(next > heap_end) //next is maximum at heap_end (if top chunk)
-            {
-                if(!i) //if first loop
-                    return 0;
-                break;
-            }
 
-            //Step back to find the first chunk in this heap:
-            last_valid_chunk_ptr = chunk_ptr;
-            test = (size_t*) 0;
-            p = chunk_ptr;
-            for(p -= 2;p > (size_t*) hb;p -= 2)
-            {
-                test = get_next_chunk(p); //get next chunk by the 'size' field
-                if(test == last_valid_chunk_ptr)
-                {
-                    last_valid_chunk_ptr = test;
-                }
-            }
+        //Check if the arena's top chunk is in the allowed range:
+        size_t chunk_size =
+                  (size_t) (((chunk_t*) ar_top_chunk_ptr)->size & ~FLAGS_MASK);
+        size_t* next = (size_t*) (((char*) ar_top_chunk_ptr) + chunk_size);
+        if(next > (size_t*) (((char*) top_hb) + top_hb->size))
+            return 0; //next is maximum at heap_end (if top chunk)
 
-            //Store the found bottom pointer (reverse order):
-            *pbaddr = (size_t) last_valid_chunk_ptr;
-            --pbaddr;
+        //Count the heap segments (newest ---> oldest):
+        size_t num_botts = 0;
+        heap_bott_t* hb = top_hb;
+        for(;hb && (num_botts < max_num_botts);hb = hb->prev)
+        {
+            ++num_botts;
+            if(hb->prev && (hb->prev->ar_ptr != hb->ar_ptr))
+                break; //broken heap chain
+        }
 
-            //Get the previous heap:
-            hb = hb->prev;
-            if(!hb)
+        //Store the bottoms in place, from the last array entry down:
+        size_t* top_chunk_ptr = ar_top_chunk_ptr; //known for newest segment
+        size_t i = num_botts;
+        for(hb = top_hb;i;hb = hb->prev)
+        {
+            size_t* bottom = get_segment_bottom_chunk__(hb,top_chunk_ptr);
+            if(!bottom)
                 break;
+            *(pbaddr + --i) = (size_t) bottom;
+            top_chunk_ptr = (size_t*) 0;
+        }
 
-            //Get the heap end:
-            heap_end = (size_t*) (((char*) hb) + hb->size);
-
-            //Find the top chunk of the new heap:
-            test = (size_t*) 0;
-            p = heap_end;
-            for(p -= 2;p > (size_t*) hb;p -= 2)
-            {
-                test = get_next_chunk(p); //get next chunk by the 'size' field
-                if(test == heap_end)
-                {
-                    chunk_ptr = test;
-                    continue; //go ahead
-                }
-            }
-            break;
-        }
-
-        //Get the number of bottoms found:
-        size_t num_botts = max_num_botts; //unlikely
-        if(i != max_num_botts) //---> after broken loop (break)
-            num_botts = ++i;
-
-        ///////////////////////////////////////////////////////////////////////
-        // Shift the found bottoms forward to index 0:
-        //---------------------------------------------------------------------
-        // Example:
-        //
-        // We have max. 10 bottoms and 3 bottoms found:
-        //
-        //    baddr_arr[0] = 0
-        //    baddr_arr[1] = 0
-        //    baddr_arr[2] = 0
-        //    baddr_arr[3] = 0
-        //    baddr_arr[4] = 0
-        //    baddr_arr[5] = 0
-        //    baddr_arr[6] = 0
-        //    baddr_arr[7] = bott_0 <--- idx = 7 = max_num_botts - num_botts
-        //    baddr_arr[8] = bott_1
-        //    baddr_arr[9] = bott_3 <--- idx = 9 = max_num_botts - 1
-        //
-        // So we need to shift by 7 = max_num_botts - num_botts:
-        //
-        //    baddr_arr[0] = baddr_arr[7] = bott_0
-        //    baddr_arr[1] = baddr_arr[8] = bott_1
-        //    baddr_arr[2] = baddr_arr[9] = bott_2
-        //    baddr_arr[3] = 0
-        //    baddr_arr[4] = 0
-        //    baddr_arr[5] = 0
-        //    baddr_arr[6] = 0
-        //    baddr_arr[7] = 0
-        //    baddr_arr[8] = 0
-        //    baddr_arr[9] = 0
-        //
-        // That means:
-        //
-        //  for(i = 0;i < num_botts;++i)
-        //      baddr_arr[i] = baddr_arr[max_num_botts - num_botts + i]
-        //  for(i = num_botts;i < max_num_botts;++i)
-        //      baddr_arr[i] = 0
-        //---------------------------------------------------------------------
-
-        pbaddr = *baddr_arr_ptr; //move to index 0
-        if(num_botts < max_num_botts)
-        {
-            for(i = 0;i < num_botts;++i)
-                *(pbaddr + i) = *(pbaddr + max_num_botts - num_botts + i);
-            for(i = num_botts;i < max_num_botts;++i)
-                *(pbaddr + i) = 0;
+        //Move the entries to index 0, if a bottom was not found:
+        if(i)
+        {
+            size_t j = 0;
+            for(;(j + i) < num_botts;++j)
+                *(pbaddr + j) = *(pbaddr + j + i);
+            num_botts -= i;
         }
 
         return num_botts;
@@ -84,9 +84,25 @@ extern "C" size_t get_allocated_payload_size(void* mem_ptr);
 
 extern "C" void dump_heap_footprint();
 
+//-----------------------------------------------------------------------------
+// Dump the heap footprint per arena, walked by a pool of threads:
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void dump_heap_footprint_parallel(
+                                    uint32 num_threads,
+                                    uint32 num_lanes = 1); //cursors/thread
+#endif
+
 //-----------------------------------------------------------------------------
 // Dump heap details for debugging:
 //-----------------------------------------------------------------------------
+// The dump goes from the start chunk to the top chunk of its heap segment,
+// then on through the older heap segments of the arena (newest ---> oldest,
+// see CHUNK CURSOR) and then through all further arenas. So a dump started
+// in a heap segment of an allocated arena leaves out the newer segments of
+// that arena, start at get_heap_bottom_chunk() to dump all of them.
+//-----------------------------------------------------------------------------
 
 extern "C" void dump_heap_details(
                         size_t* start_chunk, //e.g. get_chunk(void* mem_ptr)
@@ -101,6 +117,26 @@ extern "C" void dump_heap_hex(
                         size_t* heap_top_end, //first invalid address
                         uint32 max_kb = 0);
 
+//-----------------------------------------------------------------------------
+// HEX dump of the heap, formatted by a pool of threads:
+//-----------------------------------------------------------------------------
+// The range is split into blocks of HEX_PAR_BLOCK_SIZE bytes, which are
+// formatted by <num_threads> worker threads into mmapped buffers, while the
+// calling thread writes the buffers in address order. The output is the
+// same as the one of dump_heap_hex():
+//
+//      dump_heap_hex_parallel(get_heap_bottom_chunk(),(size_t*) sbrk(0),8);
+//
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void dump_heap_hex_parallel(
+                        size_t* start_chunk, //e.g. get_chunk(void* mem_ptr)
+                        size_t* heap_top_end, //first invalid address
+                        uint32 num_threads, //0 = dump_heap_hex()
+                        uint32 max_kb = 0);
+#endif
+
 //-----------------------------------------------------------------------------
 // Raw heap dump:
 //-----------------------------------------------------------------------------
@@ -110,13 +146,229 @@ extern "C" void dump_heap_raw(
                         size_t* heap_top_end, //first invalid address
                         uint32 max_kb = 0);
 
+//-----------------------------------------------------------------------------
+// Raw dump of the main heap and of all heap segments of all arenas:
+//-----------------------------------------------------------------------------
+// The bytes are handed to stdout in page aligned spans of RAW_SPAN_SIZE by
+// write(). In the child of dump_heap_fork_snapshot(), the spans are handed
+// to the pipe by vmsplice(), which just references the frozen heap pages
+// instead of copying them (live pages would change until they are read).
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void dump_heap_raw_all(uint32 max_kb = 0);
+#endif
+
+//-----------------------------------------------------------------------------
+// Write all heap segments into a sparse image file:
+//-----------------------------------------------------------------------------
+// The same bytes as dump_heap_raw_all(), but all-zero pages are skipped by
+// lseek(), so they are holes of the file. Each heap segment starts at a file
+// offset with the same offset into the page as its address (a hole of less
+// than a page in front), so the pages lie on file blocks. The index
+// <path>.idx has a line per heap segment: file offset, address, size and
+// arena number.
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" bool write_heap_image( //false on error
+                                const char* path,
+                                uint32 max_kb = 0);
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump just the heap pages in RAM:
+//-----------------------------------------------------------------------------
+// Reading a page of the heap the application never touched (e.g. in the top
+// chunk) or which is swapped out faults it in and grows the RSS of the very
+// process being dumped. With resident_only, the own heap's HEX dump, raw
+// dump and image skip the pages mincore() reports not in RAM: the HEX dump
+// puts a "not resident" line, the raw dump zeros and the image a hole.
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void set_heap_dump_resident_only(bool resident_only);
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the footprint by an asynchronous pipeline:
+//-----------------------------------------------------------------------------
+// With pipelined, the footprint dumps (own heap, another process, core file
+// and fork snapshot) walk the chunks in the calling thread, while a
+// formatter thread makes the lines and a writer thread writes them to the
+// sink. So the walk is not stalled by a blocking output until all buffers
+// of the pipeline are full.
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void set_heap_dump_pipelined(bool pipelined);
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the footprint by runs of chunks:
+//-----------------------------------------------------------------------------
+// With compact, the footprint dumps print a line per run of consecutive
+// chunks of the same size and state (within a heap segment), instead of a
+// line per chunk. A heap of millions of equal objects shrinks to a few lines:
+//
+//      0x55d0c3a2b000  x12034                      48 bytes USED
+//
+// Single chunks and the top chunks are printed as before, so are the totals.
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void set_heap_dump_compact(bool compact);
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the chunk size distribution per arena:
+//-----------------------------------------------------------------------------
+// With size_stats, the footprint dumps (also per arena by threads) fill a
+// sketch of the used and of the free chunk sizes per arena while walking,
+// and print its p50, p99 and max after the totals:
+//
+//      ARENA    0 USED      1204 chunks  p50     48  p99   4112  max  65552
+//                 FREE        37 chunks  p50    144  p99 132096  max 132096
+//
+// The export adds them to the arena records (used_p50, ..., free_max). The
+// sketch has log-linear buckets (see CHUNK SIZE SKETCH), so the quantiles
+// are off by less than 1/8, while the memory is constant (4 KB per arena).
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void set_heap_dump_size_stats(bool size_stats);
+#endif
+
+//-----------------------------------------------------------------------------
+// Walk the own heap under the arena locks:
+//-----------------------------------------------------------------------------
+// With arena_locks, the footprint, the ranking and the export of the own
+// heap take the mutex of an arena while they walk one of its heap segments
+// and release it between two segments. So the walk doesn't read chunks torn
+// by concurrent malloc() and free() calls, while the other arenas keep on
+// allocating. The footprint and the ranking print a sketch of the pauses
+// (the times a lock was held) per arena afterwards:
+//
+//      ARENA    0      1 pauses  p50    2810.0 us  p99    2810.0 us  max ...
+//
+// init_heapdump() finds the mutex at the start of the malloc_state_t (the
+// layout is checked by the index of its 'top' field). The walk by threads
+// and the walk of another process don't lock. The walking thread must not
+// call malloc() meanwhile.
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" void set_heap_dump_arena_locks(bool arena_locks);
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump a consistent snapshot of the heap, walked by a forked child:
+//-----------------------------------------------------------------------------
+// The child walks its copy-on-write image of the heap by the dump function
+// selected by <what>, its output is streamed over a pipe to stdout. The
+// other threads keep on running, the process is paused just for the fork():
+//
+//      dump_heap_fork_snapshot(HEAP_DUMP_FOOTPRINT);
+//
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    static const unsigned char HEAP_DUMP_FOOTPRINT = 1; //dump_heap_footprint()
+    static const unsigned char HEAP_DUMP_DETAILS   = 2; //dump_heap_details()
+    static const unsigned char HEAP_DUMP_HEX       = 3; //dump_heap_hex()
+    static const unsigned char HEAP_DUMP_RAW       = 4; //dump_heap_raw()
+    extern "C" bool dump_heap_fork_snapshot( //false on error
+                                unsigned char what, //HEAP_DUMP_...
+                                uint32 max_kb = 0, //hex and raw dump
+                                uint32 num_threads = 0, //footprint per arena
+                                uint32 num_lanes = 0); //cursors/thread
+#endif
+
+//-----------------------------------------------------------------------------
+// Write, read and diff heap snapshot files (columnar, see SNAP_MAGIC):
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" bool write_heap_snapshot( //false on error
+                                const char* path,
+                                bool with_payload = false); //heap bytes too
+    extern "C" void dump_heap_snapshot_info(const char* path);
+    extern "C" void dump_heap_snapshot_diff(
+                                const char* old_path,
+                                const char* new_path);
+#endif
+
+//-----------------------------------------------------------------------------
+// Export the chunks as JSON Lines or CSV:
+//-----------------------------------------------------------------------------
+// A record per chunk (address, mem_ptr, size, state, A|M|P flags, arena and
+// segment number), and a summary record per heap segment and per arena, for
+// tools reading the heap data. CSV starts with a header line. The state is
+// used, free, top or fencepost (end of an older heap segment, which is not
+// summed up as used or free).
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    static const unsigned char HEAP_EXPORT_JSONL = 1; //a JSON object per line
+    static const unsigned char HEAP_EXPORT_CSV   = 2;
+    extern "C" void dump_heap_export(unsigned char format); //HEAP_EXPORT_...
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the largest chunks per arena:
+//-----------------------------------------------------------------------------
+// The <num> largest used chunks and the <num> largest free chunks (holes) of
+// every arena, with their addresses and heap segments, largest first. While
+// walking, the candidates are kept in two fixed-size min-heaps on the stack,
+// whose root is the smallest candidate, so most chunks are rejected by a
+// single compare and neither the chunks are sorted nor memory is allocated.
+// The top chunks aren't ranked, since they are no holes but unused space.
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    #define MAX_TOP_CHUNKS 1024 //largest <num> of dump_heap_top()
+    extern "C" void dump_heap_top(uint32 num);
+#endif
+
+//-----------------------------------------------------------------------------
+// Dump the heap of another process (or of a core file):
+//-----------------------------------------------------------------------------
+// The heap of the process <pid> is read by process_vm_readv() (or the heap
+// of a crashed process out of its core file), after the own module was
+// initialized by init_heapdump() (same glibc version):
+//
+//      if(attach_remote_heap(pid)) //or attach_remote_core(core_path)
+//      {
+//          dump_remote_heap_footprint();
+//          detach_remote_heap();
+//      }
+//
+//-----------------------------------------------------------------------------
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    extern "C" bool attach_remote_heap(pid_t pid); //false on error
+    extern "C" bool attach_remote_core(const char* core_path); //ELF64 core
+    extern "C" void detach_remote_heap();
+    extern "C" void dump_remote_heap_footprint();
+    extern "C" void dump_remote_heap_details();
+    extern "C" void dump_remote_heap_hex(uint32 max_kb = 0);
+    extern "C" void dump_remote_heap_raw(uint32 max_kb = 0);
+    extern "C" void dump_remote_heap_export(unsigned char format);
+    extern "C" void dump_remote_heap_top(uint32 num);
+    extern "C" bool write_remote_heap_snapshot(
+                                const char* path,
+                                bool with_payload = false);
+#endif
+
 //*****************************************************************************
 // Internal interface:
 //*****************************************************************************
 
 #if !defined(_WIN32) && !defined(_WIN64)
 
+    extern "C" size_t build_arena_index(); //number of indexed heap segments
     extern "C" size_t* get_arena(size_t* chunk_ptr); //or NULL
+    extern "C" size_t get_arena_no(size_t* chunk_ptr); //or (size_t) -1
     extern "C" size_t* get_next_arena(size_t* ar_ptr); //or NULL
     extern "C" bool is_top_chunk(size_t* chunk_ptr);
     extern "C" size_t* get_heap_top_end(size_t* chunk_ptr); //or NULL
@@ -125,6 +377,10 @@ extern "C" void dump_heap_raw(
                                  size_t* ar_top_chunk_ptr, //arena's top chunk
                                  size_t** baddr_arr_ptr, //ptr to size_t array
                                  size_t max_num_botts); //size of array
+    extern "C" void bench_heap_walk(
+                                uint32 num_loops = 10,
+                                uint32 num_lanes = 8); //interleaved cursors
+    extern "C" void bench_heap_hex(uint32 num_loops = 3);
 
 #endif
 
@@ -855,36 +1111,96 @@ inline char human_readable__(char c)
     #define NFASTBINS (fastbin_index(request2size(MAX_FAST_SIZE))+1)
 
     #include <pthread.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <sys/wait.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+    #include <linux/futex.h>
+    #include <elf.h>
+    #if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        #include <immintrin.h> //SSE2, AVX2
+    #endif
     #define mutex_t pthread_mutex_t
 
-    //Dump a chunk:
-    inline void dump_chunk(size_t* p)
-    {
-        if(!p)
-            return;
+    //-------------------------------------------------------------------------
+    // OUTPUT SINK:
+    //-------------------------------------------------------------------------
+    // All dumps write their output through the current sink (stdout if none
+    // is set), not by stdio. A sink collects the output in a fixed buffer,
+    // which is mapped once by mmap() (no heap), and writes it by large
+    // write() calls when the buffer is full or the sink is flushed:
+    //
+    //      heap_sink_t sink;
+    //      if(open_heap_sink_fd(&sink,fd)) //a file, a pipe or a socket
+    //      {
+    //          heap_sink_t* prev = set_heap_sink(&sink);
+    //          dump_heap_footprint();
+    //          set_heap_sink(prev);
+    //          close_heap_sink(&sink); //flushes, but does not close fd
+    //      }
+    //
+    // A memory sink writes into a buffer of the caller instead (the bytes,
+    // which do not fit, are counted by lost). Every dump function flushes
+    // the current sink before it returns, so its output and the one of
+    // printf() do not get mixed up. A sink must not be used by several
+    // threads at the same time.
+    //-------------------------------------------------------------------------
 
-        size_t chunk_size = (size_t) (((chunk_t*) p)->size & ~FLAGS_MASK);
-        bool prev_in_use = (((chunk_t*) p)->size & P__) ? true : false;
-        bool is_mmapped = (((chunk_t*) p)->size & M__) ? true : false;
-        bool thread_arena = (((chunk_t*) p)->size & A__) ? true : false;
+    #define HEAP_SINK_BUF_SIZE (1024 * 1024) //mmap() buffer of a fd sink
 
-        bool is_top = is_top_chunk(p);
+    static const unsigned char HEAP_SINK_FD     = 1; //file, socket, tty...
+    static const unsigned char HEAP_SINK_PIPE   = 2; //fd is a pipe
+    static const unsigned char HEAP_SINK_MEMORY = 3; //buffer of the caller
 
-        bool is_in_use = is_mmapped ? true : false;
-        if(!is_top && !is_mmapped)
-        {
-            size_t* next = (size_t*) (((char*) p) + chunk_size);
-            is_in_use = (((chunk_t*) next)->size & P__) ? true : false;
-        }
+    struct heap_sink_t
+    {
+        unsigned char kind; //HEAP_SINK_...
+        int fd; //output file descriptor or -1 (memory sink)
+        char* buf; //mmap() buffer or the caller's memory
+        size_t buf_size;
+        size_t len; //bytes in buf (not yet written for a fd sink)
+        size_t total; //bytes handed to the sink
+        size_t lost; //bytes a full memory sink could not take
+        bool failed; //write error
+    };
+
+    extern "C" bool open_heap_sink_fd(heap_sink_t* sink,int fd);
+    extern "C" bool open_heap_sink_memory(
+                                heap_sink_t* sink,
+                                char* mem,
+                                size_t mem_size);
+    extern "C" void close_heap_sink(heap_sink_t* sink);
+    extern "C" heap_sink_t* set_heap_sink( //returns the previous sink
+                                heap_sink_t* sink); //NULL ---> stdout
+    extern "C" heap_sink_t* get_heap_sink(); //current sink
+    extern "C" bool flush_heap_sink(); //false on write error
+    extern "C" void heap_sink_write(const char* data,size_t len);
+    extern "C" int heap_printf(const char* format,...)
+                                __attribute__((format(printf,1,2)));
+
+    //Print a chunk at address p from a copy of its first 4 fields (c):
+    inline void print_chunk(
+                        size_t* p,
+                        const chunk_t* c,
+                        bool is_top,
+                        bool is_in_use,
+                        bool top_at_sbrk) //top chunk ends at sbrk(0)
+    {
+        size_t chunk_size = (size_t) (c->size & ~FLAGS_MASK);
+        bool prev_in_use = (c->size & P__) ? true : false;
+        bool is_mmapped = (c->size & M__) ? true : false;
+        bool thread_arena = (c->size & A__) ? true : false;
 
         size_t payload_size = chunk_size - 2 * sizeof(size_t);
 
         if(is_in_use)
         {
-            unsigned char* mem_ptr =
-                        (unsigned char*) (((char*) p) + 2 * sizeof(size_t));
+            const unsigned char* mem_ptr =
+                    (const unsigned char*) (((const char*) c) +
+                                                        2 * sizeof(size_t));
 
-            printf(
+            heap_printf(
                 "%14p +-----------------------------------\n"
                 "   %s | %02X %02X %02X %02X %02X %02X %02X %02X\n"
                 "               +-----------------------------------\n"
@@ -892,14 +1208,14 @@ inline char human_readable__(char c)
                 "               +-----------------------------------\n",
                 p,
                 is_top ? "(TOP CHUNK)" : "           ",
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 56),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 48),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 40),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 32),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 24),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 16),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 8),
-                (unsigned char) (((chunk_t*) p)->overhead),
+                (unsigned char) (c->overhead >> 56),
+                (unsigned char) (c->overhead >> 48),
+                (unsigned char) (c->overhead >> 40),
+                (unsigned char) (c->overhead >> 32),
+                (unsigned char) (c->overhead >> 24),
+                (unsigned char) (c->overhead >> 16),
+                (unsigned char) (c->overhead >> 8),
+                (unsigned char) (c->overhead),
                 HUMAN_READABLE_MEM_SIZE__(chunk_size),
                 HUMAN_READABLE_MEM_UNIT__(chunk_size),
                 thread_arena ? 0x1 : 0x0,
@@ -908,7 +1224,7 @@ inline char human_readable__(char c)
 
             if(payload_size >= 16)
             {
-                printf(
+                heap_printf(
                     "               | "
                         "%02X %02X %02X %02X %02X %02X %02X %02X | "
                             "%c%c%c%c%c%c%c%c\n"
@@ -950,7 +1266,7 @@ inline char human_readable__(char c)
             }
             else
             {
-                printf(
+                heap_printf(
                     "               | "
                         "%02X %02X %02X %02X %02X %02X %02X %02X | "
                             "%c%c%c%c%c%c%c%c\n",
@@ -972,7 +1288,7 @@ inline char human_readable__(char c)
                     human_readable__(mem_ptr[7]));
             }
 
-            printf(
+            heap_printf(
                 "               | ...\n"
                 "               |\n"
                 "               | USED (%lu %s%s%s)\n"
@@ -984,7 +1300,7 @@ inline char human_readable__(char c)
         }
         else
         {
-            printf(
+            heap_printf(
                 "%14p +-----------------------------------\n"
                 "   %s | %02X %02X %02X %02X %02X %02X %02X %02X\n"
                 "               +-----------------------------------\n"
@@ -999,35 +1315,35 @@ inline char human_readable__(char c)
                 "               |\n",
                 p,
                 is_top ? "(TOP CHUNK)" : "           ",
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 56),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 48),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 40),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 32),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 24),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 16),
-                (unsigned char) ((((chunk_t*) p)->overhead) >> 8),
-                (unsigned char) (((chunk_t*) p)->overhead),
+                (unsigned char) (c->overhead >> 56),
+                (unsigned char) (c->overhead >> 48),
+                (unsigned char) (c->overhead >> 40),
+                (unsigned char) (c->overhead >> 32),
+                (unsigned char) (c->overhead >> 24),
+                (unsigned char) (c->overhead >> 16),
+                (unsigned char) (c->overhead >> 8),
+                (unsigned char) (c->overhead),
                 HUMAN_READABLE_MEM_SIZE__(chunk_size),
                 HUMAN_READABLE_MEM_UNIT__(chunk_size),
                 thread_arena ? 0x1 : 0x0,
                 is_mmapped ? 0x1 : 0x0,
                 prev_in_use ? 0x1 : 0x0,
-                (size_t*) ((chunk_t*) p)->next_free,
-                (size_t*) ((chunk_t*) p)->prev_free,
+                (size_t*) c->next_free,
+                (size_t*) c->prev_free,
                 HUMAN_READABLE_MEM_SIZE__(payload_size),
                 HUMAN_READABLE_MEM_UNIT__(payload_size));
             if(is_top)
             {
                 size_t* p_end = (size_t*) (((char*) p) + chunk_size);
-                if(p_end == sbrk(0)) //should be always the case
+                if(top_at_sbrk) //should be always the case
                 {
-                    printf(
+                    heap_printf(
                         "%14p +---------- TOP = sbrk(0) ----------\n",
                         p_end);
                 }
                 else
                 {
-                    printf(
+                    heap_printf(
                         "%14p +-------------- TOP ----------------\n",
                         p_end);
                 }
@@ -1035,6 +1351,30 @@ inline char human_readable__(char c)
         }
     }
 
+    //Dump a chunk:
+    inline void dump_chunk(size_t* p)
+    {
+        if(!p)
+            return;
+
+        size_t chunk_size = (size_t) (((chunk_t*) p)->size & ~FLAGS_MASK);
+        bool is_mmapped = (((chunk_t*) p)->size & M__) ? true : false;
+
+        bool is_top = is_top_chunk(p);
+
+        bool is_in_use = is_mmapped ? true : false;
+        size_t* next = (size_t*) (((char*) p) + chunk_size);
+        if(!is_top && !is_mmapped)
+            is_in_use = (((chunk_t*) next)->size & P__) ? true : false;
+
+        print_chunk(
+                p,
+                (chunk_t*) p,
+                is_top,
+                is_in_use,
+                is_top && (next == (size_t*) sbrk(0)));
+    }
+
     //-------------------------------------------------------------------------
     // ARENAS AND HEAPS (from glibc's arena.c):
     //-------------------------------------------------------------------------
@@ -1235,16 +1575,11 @@ inline char human_readable__(char c)
         return (heap_bott_t*) ((size_t) p & ~(HEAP_MAX_SIZE - 1));
     }
 
-    //Dump heap info:
-    inline void dump_heap_info(size_t* p)
+    //Print the heap info at address hb from a copy of it (hi):
+    inline void print_heap_info(heap_bott_t* hb,const heap_bott_t* hi)
     {
-        if(!p)
-            return;
-        heap_bott_t* hb = get_start_of_allocated_heap_segment(p);
-        if(!hb)
-            return;
-        size_t* heap_end = (size_t*) (((char*) hb) + hb->size);
-        printf(
+        size_t* heap_end = (size_t*) (((char*) hb) + hi->size);
+        heap_printf(
             "%14p +========== HEAP INFO ==============\n"
             "               | ar_ptr = %p\n"
             "               +-----------------------------------\n"
@@ -1255,12 +1590,23 @@ inline char human_readable__(char c)
             "               | ...\n"
             "               +===================================\n",
             (size_t*) hb,
-            (size_t*) (hb->ar_ptr),
-            (size_t*) (hb->prev),
-            hb->size,
+            (size_t*) (hi->ar_ptr),
+            (size_t*) (hi->prev),
+            hi->size,
             heap_end);
     }
 
+    //Dump heap info:
+    inline void dump_heap_info(size_t* p)
+    {
+        if(!p)
+            return;
+        heap_bott_t* hb = get_start_of_allocated_heap_segment(p);
+        if(!hb)
+            return;
+        print_heap_info(hb,hb);
+    }
+
     //Get the memory pointer from the chunk pointer:
     inline void* get_mem_ptr(size_t* p)
     {
@@ -1343,6 +1689,315 @@ inline char human_readable__(char c)
         return (size_t) (chunk_size - 2 * sizeof(size_t));
     }
 
+    //-------------------------------------------------------------------------
+    // CHUNK CURSOR (walk over all chunks of all arenas):
+    //-------------------------------------------------------------------------
+    // The cursor is a plain struct, which is put on the stack of the caller.
+    // It starts at any chunk (usually the heap bottom chunk) and steps chunk
+    // by chunk through the heap segment, then through all further heap
+    // segments of the arena and then through all further arenas, without
+    // allocating any heap memory:
+    //
+    //      chunk_cursor_t cur;
+    //      bool ok = init_chunk_cursor(&cur,get_heap_bottom_chunk());
+    //      for(;ok;ok = step_chunk_cursor(&cur))
+    //      {
+    //          ... //cur.chunk_ptr, cur.chunk_size, cur.in_use, cur.ar_ptr
+    //      }
+    //      if(cur.bad_chunk_ptr)
+    //          ... //---> ERROR
+    //
+    // The flags new_arena and new_segment are set for the first chunk of an
+    // arena or heap segment, so a caller can print separators or reset
+    // per-arena statistics there. Instead of driving the cursor directly,
+    // walk_heap() calls a visitor for each chunk (return false to stop).
+    //
+    // The heap segments of an allocated arena are enumerated lazily, from the
+    // segment holding the arena's top chunk (newest) along heap_bott_t->prev
+    // down to the first segment of the arena (oldest). So there is no limit
+    // on the number of heap segments and the cursor has a constant size.
+    //-------------------------------------------------------------------------
+
+    struct chunk_cursor_t
+    {
+        size_t* chunk_ptr; //current chunk (NULL after the last chunk)
+        size_t chunk_size; //size of the chunk in bytes (without flags)
+        size_t flags; //A|M|P flags of the chunk
+        bool in_use; //chunk is allocated
+        bool is_top; //chunk is the last chunk of its heap segment (top
+                     //chunk, or the fencepost of an older segment if in_use,
+                     //which is no chunk: neither used nor free)
+        bool new_arena; //chunk is the first chunk of an arena
+        bool new_segment; //chunk is the first chunk of a heap segment
+        gen_ar_t* ar_ptr; //arena (NULL if the arena is not known)
+        heap_bott_t* hb; //heap info of the segment (NULL for main heap)
+        size_t* seg_end; //first invalid address of the heap segment
+        size_t arena_no; //0 = arena of the start chunk, 1 = next, ...
+        size_t seg_no; //0 = first heap segment walked in the arena, ...
+        size_t* bad_chunk_ptr; //set if the walk stopped at a bad chunk
+
+        //Walk state (internal):
+        size_t* next_chunk_ptr; //next chunk, decoded with the current one
+        size_t* main_heap_end; //sbrk(0), taken once per walk
+        heap_bott_t* prev_hb; //next (older) heap segment of the arena or NULL
+    };
+
+    typedef bool (*chunk_visitor_t)(const chunk_cursor_t* cur,void* user_data);
+
+    extern "C" bool init_chunk_cursor(
+                                chunk_cursor_t* cur,
+                                size_t* start_chunk); //e.g. heap bottom chunk
+    extern "C" bool step_chunk_cursor(chunk_cursor_t* cur);
+    extern "C" size_t walk_heap( //returns the number of visited chunks
+                                chunk_visitor_t visitor,
+                                void* user_data);
+
+    //-------------------------------------------------------------------------
+    // HEAP STATISTICS (mergeable):
+    //-------------------------------------------------------------------------
+    // The totals of a part of the heap (e.g. a heap segment), which are
+    // summed up by merge_heap_stats(). As the merge is a pure sum, partial
+    // results of several walker threads always merge to the same result.
+    //-------------------------------------------------------------------------
+
+    struct heap_stats_t
+    {
+        size_t num_segments; //number of heap segments
+        size_t num_chunks; //number of chunks (including top chunks)
+        size_t heap_size; //sum of all chunk sizes
+        size_t used_total; //sum of all allocated chunk sizes
+        size_t free_total; //sum of all free chunk sizes (including top)
+        size_t* bad_chunk_ptr; //lowest bad chunk found or NULL
+    };
+
+    inline void merge_heap_stats(heap_stats_t* to,const heap_stats_t* from)
+    {
+        to->num_segments += from->num_segments;
+        to->num_chunks += from->num_chunks;
+        to->heap_size += from->heap_size;
+        to->used_total += from->used_total;
+        to->free_total += from->free_total;
+        if(from->bad_chunk_ptr &&
+           (!to->bad_chunk_ptr || (from->bad_chunk_ptr < to->bad_chunk_ptr)))
+        {
+            to->bad_chunk_ptr = from->bad_chunk_ptr;
+        }
+    }
+
+    //-------------------------------------------------------------------------
+    // CHUNK SIZE SKETCH (mergeable):
+    //-------------------------------------------------------------------------
+    // A histogram of the chunk sizes with log-linear buckets (as the HDR
+    // histogram): every power of two is split into 2^SIZE_HIST_SUB_BITS
+    // buckets of the same width, so a quantile is off by less than 1/8 of
+    // its value, whatever the size. The sketch has a constant size, is
+    // filled in a single pass by add_chunk_size() and merged by a pure sum
+    // (merge_chunk_sizes()), so partial sketches of several walker threads
+    // always merge to the same result. The size of a quantile is the largest
+    // size of its bucket (clipped to the largest size seen):
+    //
+    //      chunk_sizes_t sizes;
+    //      memset(&sizes,0,sizeof(sizes));
+    //      ... add_chunk_size(&sizes,cur.chunk_size,cur.in_use); ...
+    //      size_t p99 = get_size_hist_quantile(&sizes.used,0.99);
+    //
+    // The free sizes include the top chunks, as the free totals do.
+    //-------------------------------------------------------------------------
+
+    #define SIZE_HIST_SUB_BITS 3
+    #define SIZE_HIST_SUB_MASK ((1UL << SIZE_HIST_SUB_BITS) - 1)
+    #define SIZE_HIST_BUCKETS \
+            ((8 * sizeof(size_t) - SIZE_HIST_SUB_BITS + 1) \
+                                << SIZE_HIST_SUB_BITS) //496 for 64 bit
+
+    struct size_hist_t
+    {
+        size_t count; //number of sizes
+        size_t max; //largest size
+        uint32 bucket[SIZE_HIST_BUCKETS]; //number of sizes per bucket
+    };
+
+    struct chunk_sizes_t
+    {
+        size_hist_t used; //allocated chunks
+        size_hist_t free; //free chunks (including top)
+    };
+
+    inline size_t get_size_hist_bucket(size_t size)
+    {
+        if(size <= SIZE_HIST_SUB_MASK)
+            return size; //exact below the first power of two split
+        size_t msb = (8 * sizeof(size_t) - 1) - __builtin_clzl(size);
+        size_t shift = msb - SIZE_HIST_SUB_BITS;
+        return ((shift + 1) << SIZE_HIST_SUB_BITS) +
+               ((size >> shift) & SIZE_HIST_SUB_MASK);
+    }
+
+    inline void add_size_hist(size_hist_t* hist,size_t size)
+    {
+        ++hist->count;
+        if(size > hist->max)
+            hist->max = size;
+        ++hist->bucket[get_size_hist_bucket(size)];
+    }
+
+    inline void add_chunk_size(chunk_sizes_t* sizes,size_t size,bool in_use)
+    {
+        add_size_hist(in_use ? &sizes->used : &sizes->free,size);
+    }
+
+    inline void merge_size_hist(size_hist_t* to,const size_hist_t* from)
+    {
+        to->count += from->count;
+        if(from->max > to->max)
+            to->max = from->max;
+        size_t i = 0;
+        for(;i < SIZE_HIST_BUCKETS;++i)
+            to->bucket[i] += from->bucket[i];
+    }
+
+    inline void merge_chunk_sizes(chunk_sizes_t* to,const chunk_sizes_t* from)
+    {
+        merge_size_hist(&to->used,&from->used);
+        merge_size_hist(&to->free,&from->free);
+    }
+
+    extern "C" size_t get_size_hist_quantile( //0 if the sketch is empty
+                                const size_hist_t* hist,
+                                double quantile); //0.0 ... 1.0
+
+    //-------------------------------------------------------------------------
+    // HEAP SNAPSHOT FILE (columnar, read by mmap()):
+    //-------------------------------------------------------------------------
+    // write_heap_snapshot() writes the chunks of all arenas into a binary
+    // file, whose sections all start 8 byte aligned:
+    //
+    //   +------------------+ 0
+    //   | snap_header_t    | timestamps, sbrk range, counts, section offsets
+    //   +------------------+ arena_offs
+    //   | snap_arena_t[]   | one entry per arena (in the arena ring order)
+    //   +------------------+ segment_offs
+    //   | snap_segment_t[] | one entry per heap segment (in the walk order)
+    //   +------------------+ addr_offs
+    //   | address column   | zigzag varint: addr - (prev. addr + prev. size)
+    //   +------------------+ size_offs
+    //   | size column      | varint: chunk size >> SNAP_SIZE_SHIFT
+    //   +------------------+ flags_offs
+    //   | flags column     | 4 bits per chunk (low nibble first): A|M|P and
+    //   |                  | SNAP_USED
+    //   +------------------+ arena_id_offs
+    //   | arena id column  | varint: index into the arena table
+    //   +------------------+ payload_offs (optional)
+    //   | payload pages    | bytes [start, end) of every heap segment
+    //   +------------------+
+    //
+    // As the chunks of a heap segment are contiguous, the address column
+    // holds a zero byte for every chunk but the first one of a segment. The
+    // snapshot cursor runs over the columns of the mapped file, nothing is
+    // parsed or copied:
+    //
+    //      heap_snapshot_t snap;
+    //      if(open_heap_snapshot(&snap,path))
+    //      {
+    //          snapshot_cursor_t cur;
+    //          bool ok = init_snapshot_cursor(&cur,&snap);
+    //          for(;ok;ok = step_snapshot_cursor(&cur))
+    //          {
+    //              ... //cur.chunk_addr, cur.chunk_size, cur.in_use, ...
+    //          }
+    //          close_heap_snapshot(&snap);
+    //      }
+    //
+    // The addresses are the ones of the walked process (not valid here).
+    //-------------------------------------------------------------------------
+
+    #define SNAP_MAGIC "HEAPSNAP" //8 characters, no terminating zero
+    #define SNAP_VERSION 1
+    #define SNAP_SIZE_SHIFT 3 //chunk sizes are multiples of 8 bytes
+    #define SNAP_USED 0x08 //flag nibble: chunk is allocated
+
+    struct snap_header_t
+    {
+        char magic[8]; //SNAP_MAGIC
+        uint64 version; //SNAP_VERSION
+        uint64 file_size;
+        uint64 time_start_ns; //walk started (CLOCK_REALTIME)
+        uint64 time_end_ns; //walk ended (CLOCK_REALTIME)
+        uint64 sbrk_start; //main heap bottom chunk
+        uint64 sbrk_end; //sbrk(0) of the walk
+        uint64 num_arenas;
+        uint64 num_segments;
+        uint64 num_chunks;
+        uint64 arena_offs;
+        uint64 segment_offs;
+        uint64 addr_offs;
+        uint64 addr_size;
+        uint64 size_offs;
+        uint64 size_size;
+        uint64 flags_offs;
+        uint64 flags_size;
+        uint64 arena_id_offs;
+        uint64 arena_id_size;
+        uint64 payload_offs; //0 if written without payload
+        uint64 payload_size;
+    };
+
+    struct snap_arena_t
+    {
+        uint64 ar_ptr;
+        uint64 num_segments;
+        uint64 num_chunks;
+        uint64 used_total; //sum of all allocated chunk sizes
+        uint64 free_total; //sum of all free chunk sizes (including top)
+    };
+
+    struct snap_segment_t
+    {
+        uint64 start; //bottom chunk
+        uint64 end; //first invalid address
+        uint64 arena_id;
+        uint64 first_chunk; //number of its first chunk in the columns
+        uint64 num_chunks;
+        uint64 payload_offs; //file offset of the bytes [start, end) or 0
+    };
+
+    struct heap_snapshot_t //a mapped snapshot file
+    {
+        const char* image;
+        size_t image_size;
+        const snap_header_t* header;
+        const snap_arena_t* arenas;
+        const snap_segment_t* segments;
+    };
+
+    struct snapshot_cursor_t
+    {
+        size_t chunk_addr; //address of the chunk in the walked process
+        size_t chunk_size; //size of the chunk in bytes (without flags)
+        size_t flags; //A|M|P flags of the chunk
+        bool in_use; //chunk is allocated
+        bool is_top; //chunk is the last chunk of its heap segment
+        size_t arena_id; //index into heap_snapshot_t::arenas
+        size_t seg_no; //index into heap_snapshot_t::segments
+        size_t chunk_no; //0 = first chunk of the snapshot, ...
+
+        //Walk state (internal):
+        const heap_snapshot_t* snap;
+        const unsigned char* addr_pos;
+        const unsigned char* size_pos;
+        const unsigned char* arena_id_pos;
+        size_t seg_chunks_left; //chunks of the segment behind this one
+    };
+
+    extern "C" bool open_heap_snapshot(
+                                heap_snapshot_t* snap,
+                                const char* path); //false on error
+    extern "C" void close_heap_snapshot(heap_snapshot_t* snap);
+    extern "C" bool init_snapshot_cursor(
+                                snapshot_cursor_t* cur,
+                                const heap_snapshot_t* snap);
+    extern "C" bool step_snapshot_cursor(snapshot_cursor_t* cur);
+
 #endif
 
 //*****************************************************************************